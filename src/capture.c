@@ -0,0 +1,464 @@
+/*
+
+  capture.c
+
+  Receive backend that reads UDP packets from a memory-mapped
+  AF_PACKET TPACKET_V3 ring, instead of copying them out of a
+  socket one at a time.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "config.h"
+#include "mast.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <arpa/inet.h>
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+#include <poll.h>
+#include <sys/mman.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#endif
+
+#define ETHERTYPE_IPV4      (0x0800)
+#define ETHERTYPE_IPV6      (0x86DD)
+#define ETHERTYPE_VLAN      (0x8100)
+#define ETHERNET_HEADER_LEN (14)
+#define IPV6_HEADER_LEN     (40)
+#define UDP_HEADER_LEN      (8)
+
+#define bytesToUInt16(a) (uint16_t)(((a)[0] << 8) | (a)[1])
+
+
+int mast_capture_parse_frame(const uint8_t *frame, unsigned int frame_len, const struct sockaddr_storage *dest, uint8_t **payload, unsigned int *payload_len, struct sockaddr_storage *frame_dest)
+{
+    unsigned int offset = ETHERNET_HEADER_LEN;
+    uint16_t ethertype;
+    uint16_t udp_len;
+
+    if (frame_len < ETHERNET_HEADER_LEN)
+        return -1;
+
+    ethertype = bytesToUInt16(&frame[12]);
+    if (ethertype == ETHERTYPE_VLAN) {
+        if (frame_len < ETHERNET_HEADER_LEN + 4)
+            return -1;
+        ethertype = bytesToUInt16(&frame[16]);
+        offset += 4;
+    }
+
+    if (ethertype == ETHERTYPE_IPV4 && dest->ss_family == AF_INET) {
+        const struct sockaddr_in *dest4 = (const struct sockaddr_in*)dest;
+        const uint8_t *ip = &frame[offset];
+        unsigned int header_len;
+
+        if (frame_len < offset + 20 || (ip[0] >> 4) != 4)
+            return -1;
+
+        // Must be UDP and not a fragment
+        header_len = (ip[0] & 0x0F) * 4;
+        if (ip[9] != IPPROTO_UDP || (bytesToUInt16(&ip[6]) & 0x3FFF) != 0)
+            return -1;
+
+        if (dest4->sin_addr.s_addr != INADDR_ANY &&
+                memcmp(&ip[16], &dest4->sin_addr, 4) != 0)
+            return -1;
+
+        if (frame_dest) {
+            struct sockaddr_in *addr = (struct sockaddr_in*)frame_dest;
+            addr->sin_family = AF_INET;
+            memcpy(&addr->sin_addr, &ip[16], 4);
+        }
+
+        offset += header_len;
+        if (frame_len < offset + UDP_HEADER_LEN)
+            return -1;
+        if (memcmp(&frame[offset + 2], &dest4->sin_port, 2) != 0)
+            return -1;
+
+    } else if (ethertype == ETHERTYPE_IPV6 && dest->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *dest6 = (const struct sockaddr_in6*)dest;
+        const uint8_t *ip = &frame[offset];
+
+        // Extension headers are not supported
+        if (frame_len < offset + IPV6_HEADER_LEN || (ip[0] >> 4) != 6 || ip[6] != IPPROTO_UDP)
+            return -1;
+
+        if (!IN6_IS_ADDR_UNSPECIFIED(&dest6->sin6_addr) &&
+                memcmp(&ip[24], &dest6->sin6_addr, 16) != 0)
+            return -1;
+
+        if (frame_dest) {
+            struct sockaddr_in6 *addr = (struct sockaddr_in6*)frame_dest;
+            addr->sin6_family = AF_INET6;
+            memcpy(&addr->sin6_addr, &ip[24], 16);
+        }
+
+        offset += IPV6_HEADER_LEN;
+        if (frame_len < offset + UDP_HEADER_LEN)
+            return -1;
+        if (memcmp(&frame[offset + 2], &dest6->sin6_port, 2) != 0)
+            return -1;
+
+    } else {
+        return -1;
+    }
+
+    // Trust the UDP length field, but not beyond the end of the frame
+    udp_len = bytesToUInt16(&frame[offset + 4]);
+    if (udp_len < UDP_HEADER_LEN || offset + udp_len > frame_len)
+        return -1;
+
+    *payload = (uint8_t*)&frame[offset + UDP_HEADER_LEN];
+    *payload_len = udp_len - UDP_HEADER_LEN;
+
+    return 0;
+}
+
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+
+struct mast_capture_s
+{
+    int fd;
+    uint8_t *ring;
+    size_t ring_len;
+
+    unsigned int block_size;
+    unsigned int block_count;
+
+    // The block currently being read and the next frame within it
+    unsigned int current_block;
+    unsigned int frames_left;
+    struct tpacket3_hdr *frame;
+
+    // Blocks that have been read but are still referenced by the caller
+    unsigned int release_block;
+    unsigned int release_count;
+};
+
+
+static struct tpacket_block_desc* _block(struct mast_capture_s *capture, unsigned int index)
+{
+    return (struct tpacket_block_desc*)(capture->ring + ((size_t)index * capture->block_size));
+}
+
+static int _attach_udp_filter(int fd, uint16_t port)
+{
+    // Only pass UDP packets (IPv4 or IPv6) for our destination port
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IPV4, 0, 7),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 23),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 11),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 20),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x3FFF, 9, 0),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 14),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 16),
+        BPF_JUMP(BPF_JMP | BPF_JA, 4, 0, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IPV6, 0, 5),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 20),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 3),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 56),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, port, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0x40000),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+static int _attach_drop_filter(int fd)
+{
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog prog = { 1, code };
+
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+static uint16_t _dest_port(const struct sockaddr_storage *addr)
+{
+    if (addr->ss_family == AF_INET6) {
+        return ntohs(((const struct sockaddr_in6*)addr)->sin6_port);
+    } else {
+        return ntohs(((const struct sockaddr_in*)addr)->sin_port);
+    }
+}
+
+int mast_capture_open(mast_socket_t *sock)
+{
+    struct mast_capture_s *capture;
+    struct tpacket_req3 req;
+    struct sockaddr_ll sll;
+    int version = TPACKET_V3;
+
+    capture = calloc(1, sizeof(struct mast_capture_s));
+    if (capture == NULL) {
+        mast_error("Failed to allocate memory for packet capture");
+        return -1;
+    }
+
+    capture->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (capture->fd < 0) {
+        mast_error("Failed to open AF_PACKET socket: %s", strerror(errno));
+        free(capture);
+        return -1;
+    }
+
+    if (setsockopt(capture->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version))) {
+        mast_error("Failed to set TPACKET_V3: %s", strerror(errno));
+        goto fail;
+    }
+
+    if (_attach_udp_filter(capture->fd, _dest_port(&sock->dest_addr))) {
+        mast_warn("Failed to attach packet filter: %s", strerror(errno));
+    }
+
+    capture->block_size = MAST_CAPTURE_BLOCK_SIZE;
+    capture->block_count = MAST_CAPTURE_BLOCK_COUNT;
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = capture->block_size;
+    req.tp_block_nr = capture->block_count;
+    req.tp_frame_size = MAST_CAPTURE_FRAME_SIZE;
+    req.tp_frame_nr = (capture->block_size * capture->block_count) / MAST_CAPTURE_FRAME_SIZE;
+    req.tp_retire_blk_tov = MAST_CAPTURE_BLOCK_TIMEOUT;
+    if (setsockopt(capture->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req))) {
+        mast_error("Failed to set up packet ring: %s", strerror(errno));
+        goto fail;
+    }
+
+    capture->ring_len = (size_t)capture->block_size * capture->block_count;
+    capture->ring = mmap(NULL, capture->ring_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_LOCKED, capture->fd, 0);
+    if (capture->ring == MAP_FAILED) {
+        // MAP_LOCKED needs privileges that we might not have
+        capture->ring = mmap(NULL, capture->ring_len, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, capture->fd, 0);
+    }
+    if (capture->ring == MAP_FAILED) {
+        mast_error("Failed to map packet ring: %s", strerror(errno));
+        capture->ring = NULL;
+        goto fail;
+    }
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = sock->if_index;
+    if (bind(capture->fd, (struct sockaddr*)&sll, sizeof(sll))) {
+        mast_error("Failed to bind AF_PACKET socket: %s", strerror(errno));
+        goto fail;
+    }
+
+    // The UDP socket is kept for its group membership, but never read
+    if (_attach_drop_filter(sock->fd)) {
+        mast_warn("Failed to attach drop filter to UDP socket: %s", strerror(errno));
+    }
+
+    sock->capture = capture;
+
+    return 0;
+
+fail:
+    if (capture->ring)
+        munmap(capture->ring, capture->ring_len);
+    close(capture->fd);
+    free(capture);
+    return -1;
+}
+
+static void _release_blocks(struct mast_capture_s *capture)
+{
+    // Hand back every block that the caller has finished with
+    while (capture->release_count > 0) {
+        struct tpacket_block_desc *block = _block(capture, capture->release_block);
+        __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        capture->release_block = (capture->release_block + 1) % capture->block_count;
+        capture->release_count--;
+    }
+}
+
+static int _next_block(struct mast_capture_s *capture)
+{
+    struct tpacket_block_desc *block = _block(capture, capture->current_block);
+
+    // Don't wrap around onto blocks that haven't been released yet
+    if (capture->release_count == capture->block_count)
+        return 0;
+
+    if ((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0)
+        return 0;
+
+    capture->frames_left = block->hdr.bh1.num_pkts;
+    capture->frame = (struct tpacket3_hdr*)((uint8_t*)block + block->hdr.bh1.offset_to_first_pkt);
+
+    return 1;
+}
+
+static void _finish_block(struct mast_capture_s *capture)
+{
+    capture->frame = NULL;
+    capture->current_block = (capture->current_block + 1) % capture->block_count;
+    capture->release_count++;
+}
+
+static int _wait_for_block(mast_socket_t *sock)
+{
+    struct pollfd pfd;
+    int retval;
+
+    if (sock->event_driven)
+        return 0;
+
+    pfd.fd = sock->capture->fd;
+    pfd.events = POLLIN | POLLERR;
+    pfd.revents = 0;
+
+    retval = poll(&pfd, 1, 60 * 1000);
+    sock->syscall_count++;
+    if (retval < 0) {
+        perror("poll()");
+        return -1;
+    } else if (retval == 0) {
+        mast_warn("Timed out waiting for packet after %d seconds", 60);
+    }
+
+    return retval;
+}
+
+int mast_capture_recv_batch(mast_socket_t *sock, mast_socket_datagram_t *datagrams, int count)
+{
+    struct mast_capture_s *capture = sock->capture;
+    int received = 0;
+
+    // Pointers from the previous batch are no longer valid
+    _release_blocks(capture);
+
+    while (received < count) {
+        struct sockaddr_ll *sll;
+        uint8_t *payload;
+        unsigned int payload_len;
+
+        if (capture->frame == NULL) {
+            if (!_next_block(capture)) {
+                int retval;
+
+                if (received > 0)
+                    break;
+
+                // Nothing handed out yet, so the kernel can have them all back
+                _release_blocks(capture);
+                retval = _wait_for_block(sock);
+                if (retval <= 0)
+                    return retval;
+                continue;
+            }
+        }
+
+        if (capture->frames_left == 0) {
+            _finish_block(capture);
+            continue;
+        }
+
+        sll = (struct sockaddr_ll*)((uint8_t*)capture->frame + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+        if (sll->sll_pkttype != PACKET_OUTGOING &&
+                mast_capture_parse_frame((uint8_t*)capture->frame + capture->frame->tp_mac,
+                                         capture->frame->tp_snaplen, &sock->dest_addr,
+                                         &payload, &payload_len, &datagrams[received].local_addr) == 0) {
+            datagrams[received].data = payload;
+            datagrams[received].len = payload_len;
+            datagrams[received].arrival_ns = ((uint64_t)capture->frame->tp_sec * 1000000000) + capture->frame->tp_nsec;
+            datagrams[received].arrival_hw_ns = 0;
+            received++;
+        }
+
+        capture->frames_left--;
+        if (capture->frames_left == 0)
+            _finish_block(capture);
+        else
+            capture->frame = (struct tpacket3_hdr*)((uint8_t*)capture->frame + capture->frame->tp_next_offset);
+    }
+
+    sock->packet_count += received;
+
+    return received;
+}
+
+int mast_capture_fd(mast_socket_t *sock)
+{
+    return sock->capture->fd;
+}
+
+int mast_capture_update_stats(mast_socket_t *sock)
+{
+    struct tpacket_stats_v3 stats;
+    socklen_t len = sizeof(stats);
+
+    if (getsockopt(sock->capture->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &len))
+        return -1;
+
+    // Reading the statistics resets them
+    sock->kernel_drops += stats.tp_drops;
+
+    return 0;
+}
+
+void mast_capture_close(mast_socket_t *sock)
+{
+    struct mast_capture_s *capture = sock->capture;
+
+    if (capture == NULL)
+        return;
+
+    munmap(capture->ring, capture->ring_len);
+    close(capture->fd);
+    free(capture);
+    sock->capture = NULL;
+}
+
+#else
+
+int mast_capture_open(mast_socket_t *sock)
+{
+    mast_error("The packet capture backend is only available on Linux");
+    return -1;
+}
+
+int mast_capture_recv_batch(mast_socket_t *sock, mast_socket_datagram_t *datagrams, int count)
+{
+    return -1;
+}
+
+int mast_capture_fd(mast_socket_t *sock)
+{
+    return -1;
+}
+
+int mast_capture_update_stats(mast_socket_t *sock)
+{
+    return -1;
+}
+
+void mast_capture_close(mast_socket_t *sock)
+{
+}
+
+#endif
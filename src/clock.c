@@ -0,0 +1,106 @@
+/*
+
+  clock.c
+
+  Extends the 32-bit RTP timestamps of a stream into a 64-bit count
+  of media clock ticks since the PTP epoch, so that any packet can be
+  converted to TAI or UTC time without ambiguity when the timestamp
+  wraps round (every 24.8 hours at 48kHz).
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "config.h"
+#include "mast.h"
+
+#include <string.h>
+#include <time.h>
+
+
+void mast_clock_init(mast_clock_t *media_clock, mast_sdp_t *sdp)
+{
+    memset(media_clock, 0, sizeof(mast_clock_t));
+
+    media_clock->clock_rate = sdp->sample_rate;
+    media_clock->clock_offset = (uint32_t)sdp->clock_offset;
+    media_clock->direct = sdp->has_clock_offset;
+}
+
+// Number of media clock ticks since the PTP epoch for a time in nanoseconds
+static uint64_t _ns_to_ticks(uint64_t ns, int clock_rate)
+{
+    return ((ns / 1000000000) * clock_rate) + (((ns % 1000000000) * clock_rate) / 1000000000);
+}
+
+static uint64_t _now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static uint64_t _anchor(mast_clock_t *media_clock, uint32_t timestamp, uint64_t arrival_ns)
+{
+    uint64_t expected;
+    int64_t extended;
+
+    if (arrival_ns == 0)
+        arrival_ns = _now_ns();
+    expected = _ns_to_ticks(arrival_ns + (MAST_TAI_UTC_OFFSET * 1000000000ULL), media_clock->clock_rate);
+
+    if (!media_clock->direct) {
+        // No relationship with the PTP epoch; line the first packet up with its arrival
+        media_clock->clock_offset = timestamp - (uint32_t)expected;
+        return expected;
+    }
+
+    // Pick the wrap of the 32-bit timestamp nearest to the time the packet arrived
+    extended = (int64_t)expected + (int32_t)((timestamp - media_clock->clock_offset) - (uint32_t)expected);
+    if (extended < 0)
+        extended += ((int64_t)1 << 32);
+
+    return extended;
+}
+
+uint64_t mast_clock_extend(mast_clock_t *media_clock, uint32_t timestamp, uint64_t arrival_ns)
+{
+    if (media_clock->clock_rate <= 0)
+        return 0;
+
+    if (!media_clock->started) {
+        media_clock->started = TRUE;
+        media_clock->extended = _anchor(media_clock, timestamp, arrival_ns);
+    } else {
+        // Signed difference, so that packets either side of a wrap are placed correctly
+        media_clock->extended += (int32_t)(timestamp - media_clock->last_timestamp);
+    }
+
+    media_clock->last_timestamp = timestamp;
+
+    return media_clock->extended;
+}
+
+uint64_t mast_clock_to_tai_ns(const mast_clock_t *media_clock, uint64_t extended)
+{
+    uint64_t secs, ticks;
+
+    if (media_clock->clock_rate <= 0)
+        return 0;
+
+    // Split into whole seconds first, so that nothing overflows
+    secs = extended / media_clock->clock_rate;
+    ticks = extended % media_clock->clock_rate;
+
+    return (secs * 1000000000) + ((ticks * 1000000000) / media_clock->clock_rate);
+}
+
+uint64_t mast_clock_to_utc_ns(const mast_clock_t *media_clock, uint64_t extended)
+{
+    uint64_t tai_ns = mast_clock_to_tai_ns(media_clock, extended);
+    uint64_t offset_ns = MAST_TAI_UTC_OFFSET * 1000000000ULL;
+
+    return tai_ns > offset_ns ? tai_ns - offset_ns : 0;
+}
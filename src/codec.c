@@ -0,0 +1,576 @@
+/*
+
+  codec.c
+
+  Conversion of audio samples between the encodings carried in RTP
+  payloads (L8, L16, L24, PCMU and PCMA) and 32-bit integers or
+  floating point, in interleaved or planar layouts.
+
+  Integer samples are left-justified, so full scale is 2^31 whatever
+  the encoding, the same as libsndfile's int functions. Floating point
+  samples are in the range -1.0 to 1.0.
+
+  There is a table of implementations for each encoding; the first one
+  that the CPU supports is used.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "config.h"
+#include "mast.h"
+#include "bytestoint.h"
+#include "kernels.h"
+
+#include <math.h>
+#include <string.h>
+
+// Samples converted at a time when going through an intermediate buffer
+#define CHUNK_SAMPLES       (1024)
+
+// Largest float below 2^31, so that full scale positive doesn't overflow
+#define FLOAT_MAX_INT32     (2147483520.0f)
+#define FLOAT_MIN_INT32     (-2147483648.0f)
+#define FLOAT_SCALE         (2147483648.0f)
+
+
+// ------- G.711 tables ---------
+
+static int16_t ulaw_decode_table[256];
+static int16_t alaw_decode_table[256];
+
+// Indexed by the top 14 bits (u-law) or 13 bits (A-law) of the sample, offset to be positive
+static uint8_t ulaw_encode_table[1 << 14];
+static uint8_t alaw_encode_table[1 << 13];
+
+static int tables_ready = FALSE;
+
+
+static int16_t _ulaw_decode(uint8_t code)
+{
+    int t;
+
+    code = ~code;
+    t = ((code & 0x0F) << 3) + 0x84;
+    t <<= (code & 0x70) >> 4;
+
+    return (code & 0x80) ? (0x84 - t) : (t - 0x84);
+}
+
+static uint8_t _ulaw_encode(int16_t pcm)
+{
+    static const int segment_end[8] = {0x3F, 0x7F, 0xFF, 0x1FF, 0x3FF, 0x7FF, 0xFFF, 0x1FFF};
+    int value = pcm >> 2;
+    int mask, segment;
+
+    if (value < 0) {
+        value = -value;
+        mask = 0x7F;
+    } else {
+        mask = 0xFF;
+    }
+
+    if (value > 8159)
+        value = 8159;
+    value += 0x84 >> 2;
+
+    for (segment = 0; segment < 8; segment++) {
+        if (value <= segment_end[segment])
+            break;
+    }
+
+    if (segment >= 8)
+        return 0x7F ^ mask;
+
+    return ((segment << 4) | ((value >> (segment + 1)) & 0x0F)) ^ mask;
+}
+
+static int16_t _alaw_decode(uint8_t code)
+{
+    int t, segment;
+
+    code ^= 0x55;
+    t = (code & 0x0F) << 4;
+    segment = (code & 0x70) >> 4;
+
+    if (segment == 0) {
+        t += 8;
+    } else {
+        t = (t + 0x108) << (segment - 1);
+    }
+
+    return (code & 0x80) ? t : -t;
+}
+
+static uint8_t _alaw_encode(int16_t pcm)
+{
+    static const int segment_end[8] = {0x1F, 0x3F, 0x7F, 0xFF, 0x1FF, 0x3FF, 0x7FF, 0xFFF};
+    int value = pcm >> 3;
+    int mask, segment, code;
+
+    if (value >= 0) {
+        mask = 0xD5;
+    } else {
+        mask = 0x55;
+        value = -value - 1;
+    }
+
+    for (segment = 0; segment < 8; segment++) {
+        if (value <= segment_end[segment])
+            break;
+    }
+
+    if (segment >= 8)
+        return 0x7F ^ mask;
+
+    code = segment << 4;
+    if (segment < 2) {
+        code |= (value >> 1) & 0x0F;
+    } else {
+        code |= (value >> segment) & 0x0F;
+    }
+
+    return code ^ mask;
+}
+
+static void _init_tables()
+{
+    int i;
+
+    if (__atomic_load_n(&tables_ready, __ATOMIC_ACQUIRE))
+        return;
+
+    // Every caller fills in the same values, so it doesn't matter if two threads get here
+    for (i = 0; i < 256; i++) {
+        ulaw_decode_table[i] = _ulaw_decode(i);
+        alaw_decode_table[i] = _alaw_decode(i);
+    }
+    for (i = 0; i < (1 << 14); i++) {
+        ulaw_encode_table[i] = _ulaw_encode((i - (1 << 13)) * 4);
+    }
+    for (i = 0; i < (1 << 13); i++) {
+        alaw_encode_table[i] = _alaw_encode((i - (1 << 12)) * 8);
+    }
+
+    __atomic_store_n(&tables_ready, TRUE, __ATOMIC_RELEASE);
+}
+
+
+// ------- Scalar implementations ---------
+
+static void _l8_decode(const uint8_t *payload, int samples, int32_t *output)
+{
+    int i;
+
+    // Offset binary: 128 is silence
+    for (i = 0; i < samples; i++)
+        output[i] = (int32_t)((uint32_t)(payload[i] ^ 0x80) << 24);
+}
+
+static void _l8_encode(const int32_t *input, int samples, uint8_t *payload)
+{
+    int i;
+
+    for (i = 0; i < samples; i++)
+        payload[i] = ((uint32_t)input[i] >> 24) ^ 0x80;
+}
+
+static void _l16_decode(const uint8_t *payload, int samples, int32_t *output)
+{
+    int i;
+
+    for (i = 0; i < samples; i++)
+        output[i] = (int32_t)((uint32_t)bytesToUInt16(&payload[i * 2]) << 16);
+}
+
+static void _l16_encode(const int32_t *input, int samples, uint8_t *payload)
+{
+    int i;
+
+    for (i = 0; i < samples; i++) {
+        uint32_t value = input[i];
+        payload[i * 2] = value >> 24;
+        payload[i * 2 + 1] = value >> 16;
+    }
+}
+
+static void _l24_decode(const uint8_t *payload, int samples, int32_t *output)
+{
+    int i;
+
+    for (i = 0; i < samples; i++)
+        output[i] = bytesToInt24(&payload[i * 3]);
+}
+
+static void _l24_encode(const int32_t *input, int samples, uint8_t *payload)
+{
+    int i;
+
+    for (i = 0; i < samples; i++) {
+        uint32_t value = input[i];
+        payload[i * 3] = value >> 24;
+        payload[i * 3 + 1] = value >> 16;
+        payload[i * 3 + 2] = value >> 8;
+    }
+}
+
+static void _pcmu_decode(const uint8_t *payload, int samples, int32_t *output)
+{
+    int i;
+
+    _init_tables();
+    for (i = 0; i < samples; i++)
+        output[i] = (int32_t)((uint32_t)(uint16_t)ulaw_decode_table[payload[i]] << 16);
+}
+
+static void _pcmu_encode(const int32_t *input, int samples, uint8_t *payload)
+{
+    int i;
+
+    _init_tables();
+    for (i = 0; i < samples; i++)
+        payload[i] = ulaw_encode_table[(input[i] >> 18) + (1 << 13)];
+}
+
+static void _pcma_decode(const uint8_t *payload, int samples, int32_t *output)
+{
+    int i;
+
+    _init_tables();
+    for (i = 0; i < samples; i++)
+        output[i] = (int32_t)((uint32_t)(uint16_t)alaw_decode_table[payload[i]] << 16);
+}
+
+static void _pcma_encode(const int32_t *input, int samples, uint8_t *payload)
+{
+    int i;
+
+    _init_tables();
+    for (i = 0; i < samples; i++)
+        payload[i] = alaw_encode_table[(input[i] >> 19) + (1 << 12)];
+}
+
+static void _to_float(const int32_t *input, int count, float *output)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        output[i] = (float)input[i] * (1.0f / FLOAT_SCALE);
+}
+
+static void _from_float(const float *input, int count, int32_t *output)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        float value = input[i] * FLOAT_SCALE;
+
+        // Written so that NaN becomes full scale negative, the same as the vector version
+        if (!(value > FLOAT_MIN_INT32))
+            value = FLOAT_MIN_INT32;
+        if (value > FLOAT_MAX_INT32)
+            value = FLOAT_MAX_INT32;
+        output[i] = (int32_t)lrintf(value);
+    }
+}
+
+
+// ------- AVX2 implementations ---------
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("avx2")))
+static void _l16_decode_avx2(const uint8_t *payload, int samples, int32_t *output)
+{
+    // Two bytes of each sample into the top of a 32-bit lane, in the other order
+    const __m256i shuffle = _mm256_set_epi8(
+                                12, 13, -1, -1, 8, 9, -1, -1, 4, 5, -1, -1, 0, 1, -1, -1,
+                                12, 13, -1, -1, 8, 9, -1, -1, 4, 5, -1, -1, 0, 1, -1, -1);
+    int i;
+
+    for (i = 0; i + 8 <= samples; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)&payload[i * 2]);
+        __m256i y = _mm256_cvtepu16_epi32(x);
+        _mm256_storeu_si256((__m256i*)&output[i], _mm256_shuffle_epi8(y, shuffle));
+    }
+
+    _l16_decode(&payload[i * 2], samples - i, &output[i]);
+}
+
+__attribute__((target("avx2")))
+static void _l16_encode_avx2(const int32_t *input, int samples, uint8_t *payload)
+{
+    // Top two bytes of each lane, big-endian, packed into the bottom of each half
+    const __m256i shuffle = _mm256_set_epi8(
+                                -1, -1, -1, -1, -1, -1, -1, -1, 14, 15, 10, 11, 6, 7, 2, 3,
+                                -1, -1, -1, -1, -1, -1, -1, -1, 14, 15, 10, 11, 6, 7, 2, 3);
+    int i;
+
+    for (i = 0; i + 8 <= samples; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)&input[i]);
+        x = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(x, shuffle), 0x08);
+        _mm_storeu_si128((__m128i*)&payload[i * 2], _mm256_castsi256_si128(x));
+    }
+
+    _l16_encode(&input[i], samples - i, &payload[i * 2]);
+}
+
+__attribute__((target("avx2")))
+static void _l24_decode_avx2(const uint8_t *payload, int samples, int32_t *output)
+{
+    const __m256i shuffle = _mm256_set_epi8(
+                                9, 10, 11, -1, 6, 7, 8, -1, 3, 4, 5, -1, 0, 1, 2, -1,
+                                9, 10, 11, -1, 6, 7, 8, -1, 3, 4, 5, -1, 0, 1, 2, -1);
+    int i;
+
+    // Loads of 16 bytes for 12 bytes of samples; stop before reading past the end
+    for (i = 0; i + 8 <= samples && (i * 3) + 28 <= samples * 3; i += 8) {
+        __m128i lo = _mm_loadu_si128((const __m128i*)&payload[i * 3]);
+        __m128i hi = _mm_loadu_si128((const __m128i*)&payload[i * 3 + 12]);
+        __m256i x = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        _mm256_storeu_si256((__m256i*)&output[i], _mm256_shuffle_epi8(x, shuffle));
+    }
+
+    _l24_decode(&payload[i * 3], samples - i, &output[i]);
+}
+
+__attribute__((target("avx2")))
+static void _l24_encode_avx2(const int32_t *input, int samples, uint8_t *payload)
+{
+    // Top three bytes of each lane, big-endian, packed into the bottom 12 bytes of each half
+    const __m256i shuffle = _mm256_set_epi8(
+                                -1, -1, -1, -1, 13, 14, 15, 9, 10, 11, 5, 6, 7, 1, 2, 3,
+                                -1, -1, -1, -1, 13, 14, 15, 9, 10, 11, 5, 6, 7, 1, 2, 3);
+    int i;
+
+    // Stores of 16 bytes for 12 bytes of samples; stop before writing past the end
+    for (i = 0; i + 8 <= samples && (i * 3) + 28 <= samples * 3; i += 8) {
+        __m256i x = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)&input[i]), shuffle);
+        _mm_storeu_si128((__m128i*)&payload[i * 3], _mm256_castsi256_si128(x));
+        _mm_storeu_si128((__m128i*)&payload[i * 3 + 12], _mm256_extracti128_si256(x, 1));
+    }
+
+    _l24_encode(&input[i], samples - i, &payload[i * 3]);
+}
+
+__attribute__((target("avx2")))
+static void _to_float_avx2(const int32_t *input, int count, float *output)
+{
+    const __m256 scale = _mm256_set1_ps(1.0f / FLOAT_SCALE);
+    int i;
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        __m256 x = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)&input[i]));
+        _mm256_storeu_ps(&output[i], _mm256_mul_ps(x, scale));
+    }
+
+    _to_float(&input[i], count - i, &output[i]);
+}
+
+__attribute__((target("avx2")))
+static void _from_float_avx2(const float *input, int count, int32_t *output)
+{
+    const __m256 scale = _mm256_set1_ps(FLOAT_SCALE);
+    const __m256 lowest = _mm256_set1_ps(FLOAT_MIN_INT32);
+    const __m256 highest = _mm256_set1_ps(FLOAT_MAX_INT32);
+    int i;
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        __m256 x = _mm256_mul_ps(_mm256_loadu_ps(&input[i]), scale);
+        // max() returns the second operand for NaN
+        x = _mm256_min_ps(_mm256_max_ps(x, lowest), highest);
+        _mm256_storeu_si256((__m256i*)&output[i], _mm256_cvtps_epi32(x));
+    }
+
+    _from_float(&input[i], count - i, &output[i]);
+}
+
+#endif
+
+
+// In order of preference for each encoding
+static const mast_codec_t codecs[] = {
+#ifdef HAVE_X86_KERNELS
+    { "avx2", mast_cpu_avx2, MAST_ENCODING_L16, 2, _l16_decode_avx2, _l16_encode_avx2, _to_float_avx2, _from_float_avx2 },
+    { "avx2", mast_cpu_avx2, MAST_ENCODING_L24, 3, _l24_decode_avx2, _l24_encode_avx2, _to_float_avx2, _from_float_avx2 },
+    { "avx2", mast_cpu_avx2, MAST_ENCODING_PCMU, 1, _pcmu_decode, _pcmu_encode, _to_float_avx2, _from_float_avx2 },
+    { "avx2", mast_cpu_avx2, MAST_ENCODING_PCMA, 1, _pcma_decode, _pcma_encode, _to_float_avx2, _from_float_avx2 },
+#endif
+    { "scalar", mast_cpu_any, MAST_ENCODING_L8, 1, _l8_decode, _l8_encode, _to_float, _from_float },
+    { "scalar", mast_cpu_any, MAST_ENCODING_L16, 2, _l16_decode, _l16_encode, _to_float, _from_float },
+    { "scalar", mast_cpu_any, MAST_ENCODING_L24, 3, _l24_decode, _l24_encode, _to_float, _from_float },
+    { "scalar", mast_cpu_any, MAST_ENCODING_PCMU, 1, _pcmu_decode, _pcmu_encode, _to_float, _from_float },
+    { "scalar", mast_cpu_any, MAST_ENCODING_PCMA, 1, _pcma_decode, _pcma_encode, _to_float, _from_float },
+};
+
+#define CODEC_COUNT     (sizeof(codecs) / sizeof(codecs[0]))
+
+
+const mast_codec_t* mast_codec_get(int encoding, int index)
+{
+    const mast_codec_t *codec;
+    int i, found = 0;
+
+    for (i = 0; (codec = mast_kernel_get(codecs, CODEC_COUNT, sizeof(codecs[0]), i)); i++) {
+        if (codec->encoding == encoding) {
+            if (found == index)
+                return codec;
+            found++;
+        }
+    }
+
+    return NULL;
+}
+
+const mast_codec_t* mast_codec_lookup(int encoding)
+{
+    const mast_codec_t *codec = mast_codec_get(encoding, 0);
+
+    if (codec == NULL) {
+        mast_error("Unsupported encoding: %s", mast_encoding_name(encoding));
+    }
+
+    return codec;
+}
+
+int mast_codec_decode_float(const mast_codec_t *codec, const uint8_t *payload, int samples, float *output)
+{
+    int32_t chunk[CHUNK_SAMPLES];
+    int done, count;
+
+    for (done = 0; done < samples; done += count) {
+        count = samples - done;
+        if (count > CHUNK_SAMPLES)
+            count = CHUNK_SAMPLES;
+
+        codec->decode(&payload[done * codec->sample_bytes], count, chunk);
+        codec->to_float(chunk, count, &output[done]);
+    }
+
+    return samples;
+}
+
+int mast_codec_encode_float(const mast_codec_t *codec, const float *input, int samples, uint8_t *payload)
+{
+    int32_t chunk[CHUNK_SAMPLES];
+    int done, count;
+
+    for (done = 0; done < samples; done += count) {
+        count = samples - done;
+        if (count > CHUNK_SAMPLES)
+            count = CHUNK_SAMPLES;
+
+        codec->from_float(&input[done], count, chunk);
+        codec->encode(chunk, count, &payload[done * codec->sample_bytes]);
+    }
+
+    return samples * codec->sample_bytes;
+}
+
+int mast_codec_decode_planar(const mast_codec_t *codec, const uint8_t *payload, int frames, int channels, int32_t **planes)
+{
+    int32_t chunk[CHUNK_SAMPLES];
+    int chunk_frames, done, count, frame, channel;
+
+    if (channels <= 0 || channels > CHUNK_SAMPLES)
+        return -1;
+    chunk_frames = CHUNK_SAMPLES / channels;
+
+    // Decode a block of frames, then deal them out to the channels
+    for (done = 0; done < frames; done += count) {
+        count = frames - done;
+        if (count > chunk_frames)
+            count = chunk_frames;
+
+        codec->decode(&payload[done * channels * codec->sample_bytes], count * channels, chunk);
+        for (frame = 0; frame < count; frame++) {
+            for (channel = 0; channel < channels; channel++) {
+                planes[channel][done + frame] = chunk[frame * channels + channel];
+            }
+        }
+    }
+
+    return frames;
+}
+
+int mast_codec_decode_planar_float(const mast_codec_t *codec, const uint8_t *payload, int frames, int channels, float **planes)
+{
+    int32_t chunk[CHUNK_SAMPLES];
+    float samples[CHUNK_SAMPLES];
+    int chunk_frames, done, count, frame, channel;
+
+    if (channels <= 0 || channels > CHUNK_SAMPLES)
+        return -1;
+    chunk_frames = CHUNK_SAMPLES / channels;
+
+    for (done = 0; done < frames; done += count) {
+        count = frames - done;
+        if (count > chunk_frames)
+            count = chunk_frames;
+
+        codec->decode(&payload[done * channels * codec->sample_bytes], count * channels, chunk);
+        codec->to_float(chunk, count * channels, samples);
+        for (frame = 0; frame < count; frame++) {
+            for (channel = 0; channel < channels; channel++) {
+                planes[channel][done + frame] = samples[frame * channels + channel];
+            }
+        }
+    }
+
+    return frames;
+}
+
+int mast_codec_encode_planar(const mast_codec_t *codec, const int32_t * const *planes, int frames, int channels, uint8_t *payload)
+{
+    int32_t chunk[CHUNK_SAMPLES];
+    int chunk_frames, done, count, frame, channel;
+
+    if (channels <= 0 || channels > CHUNK_SAMPLES)
+        return -1;
+    chunk_frames = CHUNK_SAMPLES / channels;
+
+    // Interleave a block of frames, then encode them
+    for (done = 0; done < frames; done += count) {
+        count = frames - done;
+        if (count > chunk_frames)
+            count = chunk_frames;
+
+        for (frame = 0; frame < count; frame++) {
+            for (channel = 0; channel < channels; channel++) {
+                chunk[frame * channels + channel] = planes[channel][done + frame];
+            }
+        }
+        codec->encode(chunk, count * channels, &payload[done * channels * codec->sample_bytes]);
+    }
+
+    return frames * channels * codec->sample_bytes;
+}
+
+int mast_codec_encode_planar_float(const mast_codec_t *codec, const float * const *planes, int frames, int channels, uint8_t *payload)
+{
+    int32_t chunk[CHUNK_SAMPLES];
+    float samples[CHUNK_SAMPLES];
+    int chunk_frames, done, count, frame, channel;
+
+    if (channels <= 0 || channels > CHUNK_SAMPLES)
+        return -1;
+    chunk_frames = CHUNK_SAMPLES / channels;
+
+    for (done = 0; done < frames; done += count) {
+        count = frames - done;
+        if (count > chunk_frames)
+            count = chunk_frames;
+
+        for (frame = 0; frame < count; frame++) {
+            for (channel = 0; channel < channels; channel++) {
+                samples[frame * channels + channel] = planes[channel][done + frame];
+            }
+        }
+        codec->from_float(samples, count * channels, chunk);
+        codec->encode(chunk, count * channels, &payload[done * channels * codec->sample_bytes]);
+    }
+
+    return frames * channels * codec->sample_bytes;
+}
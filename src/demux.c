@@ -0,0 +1,233 @@
+/*
+
+  demux.c
+
+  Hash table that maps the destination address of a received
+  datagram to the session that it belongs to, so that one socket
+  can receive many multicast groups. And a second one that maps
+  the SSRC and Payload Type of an RTP packet to the source that
+  sent it, so that sources sharing a group can be kept apart.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "config.h"
+#include "mast.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+// FNV-1a
+static uint32_t _hash(const uint8_t *key, unsigned key_size)
+{
+    uint32_t hash = 2166136261u;
+    unsigned i;
+
+    for (i = 0; i < key_size; i++) {
+        hash = (hash ^ key[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+static unsigned _round_up_pow2(unsigned n)
+{
+    unsigned size = MAST_DEMUX_MIN_SIZE;
+
+    while (size < n)
+        size <<= 1;
+
+    return size;
+}
+
+static int _table_init(mast_demux_table_t *table, unsigned int capacity, unsigned int key_size)
+{
+    // Keep the load factor at or below a half
+    table->size = _round_up_pow2(capacity * 2);
+    table->count = 0;
+    table->key_size = key_size;
+    table->entries = calloc(table->size, sizeof(mast_demux_entry_t));
+    if (table->entries == NULL) {
+        mast_error("Failed to allocate memory for demux table");
+        return -1;
+    }
+
+    return 0;
+}
+
+static mast_demux_entry_t* _find_slot(mast_demux_entry_t *entries, unsigned size, const uint8_t *key, unsigned key_size)
+{
+    unsigned mask = size - 1;
+    unsigned i = _hash(key, key_size) & mask;
+
+    // Linear probing: stop at the matching entry or the first empty slot
+    while (entries[i].value != NULL) {
+        if (memcmp(entries[i].key, key, key_size) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+
+    return &entries[i];
+}
+
+static int _grow(mast_demux_table_t *table)
+{
+    unsigned new_size = table->size * 2;
+    mast_demux_entry_t *entries = calloc(new_size, sizeof(mast_demux_entry_t));
+    unsigned i;
+
+    if (entries == NULL) {
+        mast_error("Failed to allocate memory for demux table");
+        return -1;
+    }
+
+    for (i = 0; i < table->size; i++) {
+        mast_demux_entry_t *old = &table->entries[i];
+        if (old->value != NULL)
+            *_find_slot(entries, new_size, old->key, table->key_size) = *old;
+    }
+
+    free(table->entries);
+    table->entries = entries;
+    table->size = new_size;
+
+    return 0;
+}
+
+static int _table_add(mast_demux_table_t *table, const uint8_t *key, void *value)
+{
+    mast_demux_entry_t *entry;
+
+    if (value == NULL)
+        return -1;
+
+    if ((table->count + 1) * 2 > table->size && _grow(table))
+        return -1;
+
+    entry = _find_slot(table->entries, table->size, key, table->key_size);
+    if (entry->value == NULL) {
+        memcpy(entry->key, key, table->key_size);
+        table->count++;
+    }
+    entry->value = value;
+
+    return 0;
+}
+
+static void* _table_lookup(mast_demux_table_t *table, const uint8_t *key)
+{
+    if (table->entries == NULL)
+        return NULL;
+
+    return _find_slot(table->entries, table->size, key, table->key_size)->value;
+}
+
+static void _table_free(mast_demux_table_t *table)
+{
+    free(table->entries);
+    table->entries = NULL;
+    table->size = 0;
+    table->count = 0;
+}
+
+
+
+// The address family followed by the address: IPv4 addresses are zero padded
+#define ADDRESS_KEY_SIZE    (17)
+
+static int _address_key(const struct sockaddr_storage *addr, uint8_t key[ADDRESS_KEY_SIZE])
+{
+    memset(key, 0, ADDRESS_KEY_SIZE);
+
+    switch (addr->ss_family) {
+    case AF_INET:
+        memcpy(key + 1, &((const struct sockaddr_in*)addr)->sin_addr, 4);
+        break;
+    case AF_INET6:
+        memcpy(key + 1, &((const struct sockaddr_in6*)addr)->sin6_addr, 16);
+        break;
+    default:
+        return -1;
+    }
+
+    key[0] = addr->ss_family;
+
+    return 0;
+}
+
+int mast_demux_init(mast_demux_t *demux, unsigned int capacity)
+{
+    return _table_init(demux, capacity, ADDRESS_KEY_SIZE);
+}
+
+int mast_demux_add(mast_demux_t *demux, const struct sockaddr_storage *addr, void *session)
+{
+    uint8_t key[ADDRESS_KEY_SIZE];
+
+    if (_address_key(addr, key))
+        return -1;
+
+    return _table_add(demux, key, session);
+}
+
+void* mast_demux_lookup(mast_demux_t *demux, const struct sockaddr_storage *addr)
+{
+    uint8_t key[ADDRESS_KEY_SIZE];
+
+    if (_address_key(addr, key))
+        return NULL;
+
+    return _table_lookup(demux, key);
+}
+
+void mast_demux_free(mast_demux_t *demux)
+{
+    _table_free(demux);
+}
+
+
+
+// The Payload Type followed by the SSRC, least significant byte first
+#define SOURCE_KEY_SIZE     (5)
+
+static void _source_key(uint32_t ssrc, uint8_t payload_type, uint8_t key[SOURCE_KEY_SIZE])
+{
+    int i;
+
+    key[0] = payload_type;
+    for (i = 0; i < 4; i++) {
+        key[i + 1] = (ssrc >> (i * 8)) & 0xFF;
+    }
+}
+
+int mast_source_demux_init(mast_source_demux_t *demux, unsigned int capacity)
+{
+    return _table_init(demux, capacity, SOURCE_KEY_SIZE);
+}
+
+int mast_source_demux_add(mast_source_demux_t *demux, uint32_t ssrc, uint8_t payload_type, void *source)
+{
+    uint8_t key[SOURCE_KEY_SIZE];
+
+    _source_key(ssrc, payload_type, key);
+
+    return _table_add(demux, key, source);
+}
+
+void* mast_source_demux_lookup(mast_source_demux_t *demux, uint32_t ssrc, uint8_t payload_type)
+{
+    uint8_t key[SOURCE_KEY_SIZE];
+
+    _source_key(ssrc, payload_type, key);
+
+    return _table_lookup(demux, key);
+}
+
+void mast_source_demux_free(mast_source_demux_t *demux)
+{
+    _table_free(demux);
+}
@@ -0,0 +1,167 @@
+/*
+
+  gap.c
+
+  Uses the RTP timestamps of received packets to work out how many
+  audio frames went missing, so that they can be replaced and a
+  recording stays the same length as the time it covers.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "config.h"
+#include "mast.h"
+
+#include <string.h>
+
+
+static const char* mast_gap_mode_names[] = {
+    [MAST_GAP_NONE] = "none",
+    [MAST_GAP_ZERO] = "zero",
+    [MAST_GAP_REPEAT] = "repeat"
+};
+
+
+int mast_gap_mode_lookup(const char* name)
+{
+    int i;
+
+    for(i=0; i< MAST_GAP_MODE_MAX; i++) {
+        if (strcmp(mast_gap_mode_names[i], name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+const char* mast_gap_mode_name(int mode)
+{
+    if (mode >= 0 && mode < MAST_GAP_MODE_MAX) {
+        return mast_gap_mode_names[mode];
+    } else {
+        return NULL;
+    }
+}
+
+void mast_gap_init(mast_gap_t *gap, mast_sdp_t *sdp, int mode)
+{
+    memset(gap, 0, sizeof(mast_gap_t));
+
+    gap->mode = mode;
+    gap->frame_size = mast_encoding_sample_bytes(sdp->encoding) * sdp->channel_count;
+    gap->silence = mast_encoding_silence(sdp->encoding);
+    gap->max_frames = (uint32_t)sdp->sample_rate * MAST_GAP_MAX_DURATION;
+}
+
+int64_t mast_gap_check(mast_gap_t *gap, mast_rtp_packet_t *packet)
+{
+    int32_t missing;
+    uint32_t frames;
+
+    if (gap->frame_size <= 0)
+        return 0;
+
+    frames = packet->payload_length / gap->frame_size;
+    gap->frames_received += frames;
+
+    if (!gap->started || packet->ssrc != gap->ssrc) {
+        gap->started = TRUE;
+        gap->ssrc = packet->ssrc;
+        gap->next_timestamp = packet->timestamp + frames;
+        return 0;
+    }
+
+    // Signed difference, so that the timestamp wrapping round is not a gap
+    missing = (int32_t)(packet->timestamp - gap->next_timestamp);
+
+    if ((missing > 0 && (uint32_t)missing > gap->max_frames) ||
+        (missing < 0 && (uint32_t)(-(int64_t)missing) > gap->max_frames)) {
+        // Probably the sender restarting rather than lost packets
+        gap->resyncs++;
+        gap->next_timestamp = packet->timestamp + frames;
+        return 0;
+    } else if (missing < 0) {
+        // Overlaps audio already written; the caller drops those frames
+        uint32_t overlap = -(int64_t)missing;
+
+        gap->overlaps++;
+        if (overlap >= frames) {
+            overlap = frames;
+        } else {
+            gap->next_timestamp = packet->timestamp + frames;
+        }
+        gap->frames_dropped += overlap;
+        return -(int64_t)overlap;
+    }
+
+    gap->next_timestamp = packet->timestamp + frames;
+    if (missing == 0)
+        return 0;
+
+    gap->gaps++;
+    if ((uint32_t)missing > gap->largest_gap)
+        gap->largest_gap = missing;
+
+    if (gap->mode == MAST_GAP_NONE)
+        return 0;
+
+    gap->frames_inserted += missing;
+    return missing;
+}
+
+int mast_gap_conceal(mast_gap_t *gap, uint8_t *buffer, int64_t frames)
+{
+    int max_frames = RTP_MAX_PAYLOAD / gap->frame_size;
+    int len, i;
+
+    if (frames > max_frames)
+        frames = max_frames;
+    len = frames * gap->frame_size;
+
+    if (gap->mode == MAST_GAP_REPEAT && gap->last_length > 0) {
+        // Keep cycling through the last packet received
+        for (i = 0; i < len; i++) {
+            buffer[i] = gap->last_payload[gap->repeat_offset++];
+            if (gap->repeat_offset >= gap->last_length)
+                gap->repeat_offset = 0;
+        }
+    } else {
+        memset(buffer, gap->silence, len);
+    }
+
+    return len;
+}
+
+void mast_gap_remember(mast_gap_t *gap, mast_rtp_packet_t *packet)
+{
+    int len = packet->payload_length;
+
+    if (gap->mode != MAST_GAP_REPEAT || gap->frame_size <= 0)
+        return;
+
+    // Only whole frames, so that channels stay in the right place
+    len -= len % gap->frame_size;
+    if (len > RTP_MAX_PAYLOAD)
+        len = RTP_MAX_PAYLOAD;
+
+    memcpy(gap->last_payload, packet->payload, len);
+    gap->last_length = len;
+    gap->repeat_offset = 0;
+}
+
+void mast_gap_print(mast_gap_t *gap)
+{
+    mast_info(
+        "SSRC 0x%8.8x timestamp gaps: %lu (%lu frames %s filled, largest %u), overlaps: %lu (%lu frames dropped), resyncs: %lu",
+        gap->ssrc,
+        (unsigned long)gap->gaps,
+        (unsigned long)gap->frames_inserted,
+        mast_gap_mode_name(gap->mode),
+        gap->largest_gap,
+        (unsigned long)gap->overlaps,
+        (unsigned long)gap->frames_dropped,
+        (unsigned long)gap->resyncs
+    );
+}
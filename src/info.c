@@ -18,13 +18,20 @@
 
 // Globals
 const char * ifname = NULL;
+int use_capture = FALSE;
+int watch_interval = 0;
+int use_json = FALSE;
 mast_sdp_t sdp;
+mast_stats_t stats;
 
 static void usage()
 {
     fprintf(stderr, "MAST Info version %s\n\n", PACKAGE_VERSION);
     fprintf(stderr, "Usage: mast-info [options] <file.sdp>\n");
     fprintf(stderr, "   -i <iface>     Interface Name to listen on\n");
+    fprintf(stderr, "   -C             Receive from a memory-mapped packet capture ring\n");
+    fprintf(stderr, "   -w <secs>      Watch mode: display reception statistics periodically\n");
+    fprintf(stderr, "   -j             Display statistics as JSON (one object per line)\n");
     fprintf(stderr, "   -v             Verbose Logging\n");
     fprintf(stderr, "   -q             Quiet Logging\n");
 
@@ -36,11 +43,21 @@ static void parse_opts(int argc, char **argv)
     int ch;
 
     // Parse the options/switches
-    while ((ch = getopt(argc, argv, "i:vq?h")) != -1) {
+    while ((ch = getopt(argc, argv, "i:Cw:jvq?h")) != -1) {
         switch (ch) {
         case 'i':
             ifname = optarg;
             break;
+        case 'C':
+            use_capture = TRUE;
+            break;
+        case 'w':
+            watch_interval = atoi(optarg);
+            if (watch_interval <= 0) mast_error("Invalid watch interval: %s", optarg);
+            break;
+        case 'j':
+            use_json = TRUE;
+            break;
         case 'v':
             verbose = TRUE;
             break;
@@ -75,34 +92,21 @@ static void parse_opts(int argc, char **argv)
     }
 }
 
-int main(int argc, char *argv[])
+static void check_payload_type(mast_rtp_packet_t *packet)
 {
-    mast_rtp_packet_t packet;
-    mast_socket_t sock;
-    uint64_t tai;
-    int result;
-
-    mast_sdp_set_defaults(&sdp);
-    parse_opts(argc, argv);
-    setup_signal_hander();
-
-
-    result = mast_socket_open_recv(&sock, sdp.address, sdp.port, ifname);
-    if (result) {
-        return EXIT_FAILURE;
-    }
-
-
-    // Wait for an RTP packet
-    result = mast_rtp_recv(&sock, &packet);
-    if (result < 0) exit(-1);
-
     // Is the Payload Type what we were expecting?
     if (sdp.payload_type == -1) {
-        mast_sdp_set_payload_type(&sdp, packet.payload_type);
-    } else if (sdp.payload_type != packet.payload_type) {
-        mast_warn("RTP packet Payload Type does not match SDP: %d", packet.payload_type);
+        mast_sdp_set_payload_type(&sdp, packet->payload_type);
+    } else if (sdp.payload_type != packet->payload_type) {
+        mast_warn("RTP packet Payload Type does not match SDP: %d", packet->payload_type);
     }
+}
+
+static void display_session(mast_rtp_packet_t *packet)
+{
+    mast_clock_t media_clock;
+    uint64_t ticks;
+    char when[40];
 
     // Display information about the session
     printf("\n");
@@ -110,6 +114,15 @@ int main(int argc, char *argv[])
     printf("===================\n");
     printf("Session ID       : %s-%s\n", sdp.session_origin, sdp.session_id);
     printf("Dest Address     : %s:%s\n", sdp.address, sdp.port );
+    if (sdp.source_filter.mode != MAST_SOURCE_FILTER_NONE) {
+        int i;
+        printf("Source Filter    : %s",
+               sdp.source_filter.mode == MAST_SOURCE_FILTER_INCLUDE ? "incl" : "excl");
+        for (i = 0; i < sdp.source_filter.count; i++) {
+            printf(" %s", sdp.source_filter.addresses[i]);
+        }
+        printf("\n");
+    }
     printf("Session Name     : %s\n", sdp.session_name );
     printf("Description      : %s\n", sdp.information );
     printf("PTP Grandmaster  : %s\n", sdp.ptp_gmid );
@@ -127,16 +140,117 @@ int main(int argc, char *argv[])
     // Display information about the packet received
     printf("RTP Header\n");
     printf("==========\n");
-    printf("Payload type     : %u\n", packet.payload_type );
-    printf("Payload size     : %u bytes\n", packet.payload_length );
-    printf("SSRC Identifier  : 0x%8.8x\n", packet.ssrc );
-    printf("Marker Bit       : %s\n", packet.marker ? "Set" : "Not Set");
-    printf("Sequence Number  : %u\n", packet.sequence );
-
-    tai = (((uint64_t)packet.timestamp + sdp.clock_offset) / sdp.sample_rate );
-    printf("Timestamp        : %u\n", packet.timestamp );
-    printf("TAI Seconds      : %" PRIu64 "\n", tai);
+    printf("Payload type     : %u\n", packet->payload_type );
+    printf("Payload size     : %u bytes\n", packet->payload_length );
+    printf("SSRC Identifier  : 0x%8.8x\n", packet->ssrc );
+    printf("Marker Bit       : %s\n", packet->marker ? "Set" : "Not Set");
+    printf("Sequence Number  : %u\n", packet->sequence );
+
+    printf("Timestamp        : %u\n", packet->timestamp );
+    mast_clock_init(&media_clock, &sdp);
+    ticks = mast_clock_extend(&media_clock, packet->timestamp, packet->arrival_ns);
+    if (media_clock.direct) {
+        uint64_t tai_ns = mast_clock_to_tai_ns(&media_clock, ticks);
+        mast_unix_ns_to_iso8601(mast_clock_to_utc_ns(&media_clock, ticks), when, sizeof(when));
+        printf("Media Clock      : %" PRIu64 "\n", ticks);
+        printf("TAI Seconds      : %" PRIu64 ".%9.9" PRIu64 "\n", tai_ns / 1000000000, tai_ns % 1000000000);
+        printf("UTC Time         : %s\n", when);
+    }
+    printf("Arrival Time     : %" PRIu64 ".%9.9" PRIu64 "\n",
+           packet->arrival_ns / 1000000000, packet->arrival_ns % 1000000000);
+    if (packet->arrival_hw_ns) {
+        printf("NIC Arrival Time : %" PRIu64 ".%9.9" PRIu64 "\n",
+               packet->arrival_hw_ns / 1000000000, packet->arrival_hw_ns % 1000000000);
+    }
     printf("\n");
+}
+
+static void receive_packets(void *user_data)
+{
+    static mast_rtp_packet_t packets[MAST_SOCKET_MAX_BATCH];
+    static int first_packet = TRUE;
+    mast_socket_t *sock = user_data;
+    int count, i;
+
+    count = mast_rtp_recv_batch(sock, packets, MAST_SOCKET_MAX_BATCH);
+    if (count < 0) {
+        running = FALSE;
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (first_packet) {
+            check_payload_type(&packets[i]);
+            stats.clock_rate = sdp.sample_rate;
+            first_packet = FALSE;
+        }
+
+        mast_stats_add(&stats, &packets[i]);
+    }
+}
+
+static void display_timer(void *user_data)
+{
+    if (use_json) {
+        mast_stats_print_json(&stats, stdout);
+    } else {
+        mast_stats_print(&stats, stdout);
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+static int watch(mast_socket_t *sock)
+{
+    mast_loop_t loop;
+
+    if (mast_loop_init(&loop))
+        return -1;
+
+    mast_stats_init(&stats, sdp.sample_rate);
+
+    mast_loop_add_socket(&loop, sock, receive_packets, sock);
+    mast_loop_add_timer(&loop, watch_interval * 1000, display_timer, NULL);
+    mast_loop_run(&loop);
+
+    mast_loop_close(&loop);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    mast_rtp_packet_t packet;
+    mast_socket_t sock;
+    int result;
+
+    mast_sdp_set_defaults(&sdp);
+    parse_opts(argc, argv);
+    setup_signal_hander();
+
+
+    result = mast_socket_open_recv_filtered(&sock, sdp.address, sdp.port, ifname, &sdp.source_filter);
+    if (result) {
+        return EXIT_FAILURE;
+    }
+
+    if (use_capture && mast_socket_enable_capture(&sock)) {
+        mast_socket_close(&sock);
+        return EXIT_FAILURE;
+    }
+
+    if (watch_interval > 0) {
+        watch(&sock);
+        mast_socket_close(&sock);
+        return exit_code;
+    }
+
+    // Wait for an RTP packet
+    result = mast_rtp_recv_batch(&sock, &packet, 1);
+    if (result < 1) exit(-1);
+
+    check_payload_type(&packet);
+    display_session(&packet);
 
     mast_socket_close(&sock);
 
@@ -0,0 +1,691 @@
+/*
+
+  interface.c
+
+  Table of network interfaces and their addresses, so that opening a
+  socket doesn't need to walk the whole interface list. On Linux the
+  table is kept current using rtnetlink, and sockets re-join their
+  multicast groups when their interface comes back.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "config.h"
+#include "mast.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+
+
+static struct {
+    mast_interface_t *entries;
+    unsigned int size;
+    unsigned int count;
+
+    // Netlink socket that keeps the table current, or -1 if there isn't one
+    int fd;
+
+    // Sockets that have joined multicast groups
+    mast_socket_t **sockets;
+    unsigned int socket_count;
+} table = { NULL, 0, 0, -1, NULL, 0 };
+
+
+// FNV-1a
+static uint32_t _hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*name) {
+        hash = (hash ^ (uint8_t)*name++) * 16777619u;
+    }
+
+    return hash;
+}
+
+static mast_interface_t* _find_slot(mast_interface_t *entries, unsigned int size, const char *name)
+{
+    unsigned int mask = size - 1;
+    unsigned int i = _hash(name) & mask;
+
+    // Entries are never removed, so the probe always ends at the name or an empty slot
+    while (entries[i].name[0] != '\0') {
+        if (strcmp(entries[i].name, name) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+
+    return &entries[i];
+}
+
+static int _grow()
+{
+    unsigned int new_size = table.size ? table.size * 2 : MAST_INTERFACE_MIN_SIZE;
+    mast_interface_t *entries = calloc(new_size, sizeof(mast_interface_t));
+    unsigned int i;
+
+    if (entries == NULL) {
+        mast_error("Failed to allocate memory for interface table");
+        return -1;
+    }
+
+    for (i = 0; i < table.size; i++) {
+        mast_interface_t *old = &table.entries[i];
+        if (old->name[0] != '\0')
+            *_find_slot(entries, new_size, old->name) = *old;
+    }
+
+    free(table.entries);
+    table.entries = entries;
+    table.size = new_size;
+
+    return 0;
+}
+
+static mast_interface_t* _add(const char *name)
+{
+    mast_interface_t *iface;
+
+    if (name[0] == '\0' || strlen(name) >= IFNAMSIZ)
+        return NULL;
+
+    // Keep the load factor at or below a half
+    if ((table.count + 1) * 2 > table.size && _grow())
+        return NULL;
+
+    iface = _find_slot(table.entries, table.size, name);
+    if (iface->name[0] == '\0') {
+        strncpy(iface->name, name, IFNAMSIZ - 1);
+        iface->addr4.ss_family = AF_UNSPEC;
+        iface->addr6.ss_family = AF_UNSPEC;
+        table.count++;
+    }
+
+    return iface;
+}
+
+static mast_interface_t* _find_index(unsigned int index)
+{
+    unsigned int i;
+
+    for (i = 0; i < table.size; i++) {
+        if (table.entries[i].name[0] != '\0' && table.entries[i].index == index)
+            return &table.entries[i];
+    }
+
+    return NULL;
+}
+
+static int _is_usable(const mast_interface_t *iface)
+{
+    return iface->index != 0 && (iface->flags & IFF_UP) && (iface->flags & IFF_RUNNING);
+}
+
+// Returns 1 if the interface has become usable again
+static int _update_link(mast_interface_t *iface, unsigned int index, unsigned int flags)
+{
+    int was_usable = _is_usable(iface);
+    unsigned int old_index = iface->index;
+
+    iface->index = index;
+    iface->flags = flags;
+
+    // A re-created interface has a new index, and none of its old addresses
+    if (old_index != index) {
+        iface->addr4.ss_family = AF_UNSPEC;
+        iface->addr6.ss_family = AF_UNSPEC;
+    }
+
+    if (_is_usable(iface) && (!was_usable || old_index != index)) {
+        iface->came_back = TRUE;
+        return 1;
+    }
+
+    return 0;
+}
+
+static void _remove_link(mast_interface_t *iface)
+{
+    iface->index = 0;
+    iface->flags = 0;
+    iface->addr4.ss_family = AF_UNSPEC;
+    iface->addr6.ss_family = AF_UNSPEC;
+}
+
+// Returns 1 if the interface has become usable for IPv4 multicast
+static int _add_address(mast_interface_t *iface, const struct sockaddr *addr)
+{
+    switch (addr->sa_family) {
+    case AF_INET:
+        // IPv4 groups are joined using the interface address
+        if (iface->addr4.ss_family == AF_UNSPEC) {
+            memcpy(&iface->addr4, addr, sizeof(struct sockaddr_in));
+            if (_is_usable(iface)) {
+                iface->came_back = TRUE;
+                return 1;
+            }
+        }
+        break;
+
+    case AF_INET6: {
+        const struct sockaddr_in6 *current = (struct sockaddr_in6*)&iface->addr6;
+        const struct sockaddr_in6 *addr6 = (struct sockaddr_in6*)addr;
+
+        // Prefer a global address to a link-local one
+        if (iface->addr6.ss_family == AF_UNSPEC ||
+                (IN6_IS_ADDR_LINKLOCAL(&current->sin6_addr) && !IN6_IS_ADDR_LINKLOCAL(&addr6->sin6_addr))) {
+            memcpy(&iface->addr6, addr, sizeof(struct sockaddr_in6));
+        }
+        break;
+    }
+    }
+
+    return 0;
+}
+
+static void _remove_address(mast_interface_t *iface, const struct sockaddr *addr)
+{
+    switch (addr->sa_family) {
+    case AF_INET: {
+        const struct sockaddr_in *current = (struct sockaddr_in*)&iface->addr4;
+        if (iface->addr4.ss_family == AF_INET &&
+                current->sin_addr.s_addr == ((struct sockaddr_in*)addr)->sin_addr.s_addr)
+            iface->addr4.ss_family = AF_UNSPEC;
+        break;
+    }
+
+    case AF_INET6: {
+        const struct sockaddr_in6 *current = (struct sockaddr_in6*)&iface->addr6;
+        if (iface->addr6.ss_family == AF_INET6 &&
+                memcmp(&current->sin6_addr, &((struct sockaddr_in6*)addr)->sin6_addr, sizeof(struct in6_addr)) == 0)
+            iface->addr6.ss_family = AF_UNSPEC;
+        break;
+    }
+    }
+}
+
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+
+static int _parse_link(const struct nlmsghdr *nlh)
+{
+    const struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+    const struct rtattr *rta;
+    const char *name = NULL;
+    mast_interface_t *iface;
+    int len;
+
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+        return 0;
+
+    len = IFLA_PAYLOAD(nlh);
+    for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == IFLA_IFNAME && RTA_PAYLOAD(rta) > 0) {
+            name = RTA_DATA(rta);
+            if (name[RTA_PAYLOAD(rta) - 1] != '\0')
+                name = NULL;
+        }
+    }
+
+    if (nlh->nlmsg_type == RTM_DELLINK) {
+        iface = _find_index(ifi->ifi_index);
+        if (iface) {
+            mast_debug("Network interface removed: %s", iface->name);
+            _remove_link(iface);
+        }
+        return 0;
+    }
+
+    if (name == NULL)
+        return 0;
+
+    // A renamed interface keeps its index
+    iface = _find_index(ifi->ifi_index);
+    if (iface && strcmp(iface->name, name) != 0)
+        _remove_link(iface);
+
+    iface = _add(name);
+    if (iface == NULL)
+        return 0;
+
+    return _update_link(iface, ifi->ifi_index, ifi->ifi_flags);
+}
+
+static int _parse_addr(const struct nlmsghdr *nlh)
+{
+    const struct ifaddrmsg *ifa = NLMSG_DATA(nlh);
+    const struct rtattr *rta;
+    const void *address = NULL, *local = NULL;
+    int address_len = 0, local_len = 0;
+    struct sockaddr_storage addr;
+    mast_interface_t *iface;
+    int len;
+
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa)))
+        return 0;
+
+    iface = _find_index(ifa->ifa_index);
+    if (iface == NULL)
+        return 0;
+
+    len = IFA_PAYLOAD(nlh);
+    for (rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == IFA_ADDRESS) {
+            address = RTA_DATA(rta);
+            address_len = RTA_PAYLOAD(rta);
+        } else if (rta->rta_type == IFA_LOCAL) {
+            local = RTA_DATA(rta);
+            local_len = RTA_PAYLOAD(rta);
+        }
+    }
+
+    // On point-to-point links IFA_ADDRESS is the remote end
+    if (local) {
+        address = local;
+        address_len = local_len;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    if (ifa->ifa_family == AF_INET && address_len >= sizeof(struct in_addr)) {
+        struct sockaddr_in *addr4 = (struct sockaddr_in*)&addr;
+        addr4->sin_family = AF_INET;
+        memcpy(&addr4->sin_addr, address, sizeof(struct in_addr));
+    } else if (ifa->ifa_family == AF_INET6 && address_len >= sizeof(struct in6_addr)) {
+        struct sockaddr_in6 *addr6 = (struct sockaddr_in6*)&addr;
+        addr6->sin6_family = AF_INET6;
+        memcpy(&addr6->sin6_addr, address, sizeof(struct in6_addr));
+        if (IN6_IS_ADDR_LINKLOCAL(&addr6->sin6_addr))
+            addr6->sin6_scope_id = ifa->ifa_index;
+    } else {
+        return 0;
+    }
+
+    if (nlh->nlmsg_type == RTM_DELADDR) {
+        _remove_address(iface, (struct sockaddr*)&addr);
+        return 0;
+    }
+
+    return _add_address(iface, (struct sockaddr*)&addr);
+}
+
+static int _parse_netlink(const void *buffer, size_t len, int *done)
+{
+    const struct nlmsghdr *nlh;
+    int remaining = len;
+    int came_back = 0;
+
+    for (nlh = buffer; NLMSG_OK(nlh, remaining); nlh = NLMSG_NEXT(nlh, remaining)) {
+        switch (nlh->nlmsg_type) {
+        case NLMSG_DONE:
+            if (done)
+                *done = TRUE;
+            break;
+        case NLMSG_ERROR:
+            mast_debug("Received netlink error message");
+            if (done)
+                *done = TRUE;
+            break;
+        case RTM_NEWLINK:
+        case RTM_DELLINK:
+            came_back += _parse_link(nlh);
+            break;
+        case RTM_NEWADDR:
+        case RTM_DELADDR:
+            came_back += _parse_addr(nlh);
+            break;
+        }
+    }
+
+    return came_back;
+}
+
+int mast_interface_parse_netlink(const void *buffer, size_t len)
+{
+    return _parse_netlink(buffer, len, NULL);
+}
+
+static int _request_dump(int fd, int type, int seq)
+{
+    struct {
+        struct nlmsghdr nlh;
+        struct rtgenmsg gen;
+    } request;
+
+    memset(&request, 0, sizeof(request));
+    request.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(request.gen));
+    request.nlh.nlmsg_type = type;
+    request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.nlh.nlmsg_seq = seq;
+    request.gen.rtgen_family = AF_UNSPEC;
+
+    if (send(fd, &request, request.nlh.nlmsg_len, 0) < 0) {
+        mast_warn("Failed to send netlink request: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int _resync_netlink(int fd);
+
+// Read netlink messages until a dump is complete, or until none are waiting
+static int _read_netlink(int fd, int until_done)
+{
+    static uint8_t buffer[MAST_INTERFACE_NETLINK_BUFFER];
+    int done = FALSE;
+    int came_back = 0;
+
+    while (!done) {
+        int len = recv(fd, buffer, sizeof(buffer), until_done ? 0 : MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            // Events were lost, so the table may now be out of date
+            if (errno == ENOBUFS && !until_done) {
+                mast_warn("Missed network interface changes; reloading them all");
+                return _resync_netlink(fd);
+            }
+
+            mast_warn("Failed to read from netlink socket: %s", strerror(errno));
+            return -1;
+        } else if (len == 0) {
+            break;
+        }
+
+        came_back += _parse_netlink(buffer, len, until_done ? &done : NULL);
+    }
+
+    return came_back;
+}
+
+// Throw away whatever is queued, then load every link and address again
+static int _resync_netlink(int fd)
+{
+    static uint8_t buffer[MAST_INTERFACE_NETLINK_BUFFER];
+    int came_back = 0;
+    unsigned int i;
+
+    for (;;) {
+        int len = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (len < 0 && errno != EINTR && errno != ENOBUFS)
+            break;
+        if (len == 0)
+            break;
+    }
+
+    for (i = 0; i < table.size; i++) {
+        if (table.entries[i].name[0] != '\0')
+            _remove_link(&table.entries[i]);
+    }
+
+    if (_request_dump(fd, RTM_GETLINK, 1) || _read_netlink(fd, TRUE) < 0 ||
+            _request_dump(fd, RTM_GETADDR, 2) || _read_netlink(fd, TRUE) < 0)
+        return -1;
+
+    // Changes may have been missed for any of them, so every socket checks again
+    for (i = 0; i < table.size; i++) {
+        mast_interface_t *iface = &table.entries[i];
+
+        iface->came_back = iface->name[0] != '\0' && _is_usable(iface);
+        if (iface->came_back)
+            came_back++;
+    }
+
+    return came_back;
+}
+
+static int _open_netlink()
+{
+    struct sockaddr_nl addr;
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0) {
+        mast_debug("Failed to open netlink socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        mast_debug("Failed to bind netlink socket: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    // Addresses refer to interfaces by index, so load the links first
+    if (_request_dump(fd, RTM_GETLINK, 1) || _read_netlink(fd, TRUE) < 0 ||
+            _request_dump(fd, RTM_GETADDR, 2) || _read_netlink(fd, TRUE) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+#else
+
+int mast_interface_parse_netlink(const void *buffer, size_t len)
+{
+    return 0;
+}
+
+#endif
+
+
+static int _load_ifaddrs()
+{
+    struct ifaddrs *addrs, *cur;
+    unsigned int i;
+
+    if (getifaddrs(&addrs) < 0) {
+        mast_warn("Failed to get list of network interfaces: %s", strerror(errno));
+        return -1;
+    }
+
+    // Forget everything we knew, then fill in what exists now
+    for (i = 0; i < table.size; i++) {
+        if (table.entries[i].name[0] != '\0')
+            _remove_link(&table.entries[i]);
+    }
+
+    for (cur = addrs; cur; cur = cur->ifa_next) {
+        mast_interface_t *iface = _add(cur->ifa_name);
+        if (iface == NULL)
+            continue;
+
+        if (iface->index == 0) {
+            iface->index = if_nametoindex(cur->ifa_name);
+            iface->flags = cur->ifa_flags;
+        }
+
+        if (cur->ifa_addr)
+            _add_address(iface, cur->ifa_addr);
+    }
+
+    freeifaddrs(addrs);
+
+    return 0;
+}
+
+static int _load()
+{
+    unsigned int i;
+
+    // A table kept current by netlink never needs re-loading
+    if (table.fd >= 0)
+        return 0;
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+    table.fd = _open_netlink();
+#endif
+
+    // Otherwise the only way to be current is to look every time
+    if (table.fd < 0 && _load_ifaddrs())
+        return -1;
+
+    // Interfaces that existed before we looked didn't come back
+    for (i = 0; i < table.size; i++) {
+        table.entries[i].came_back = FALSE;
+    }
+
+    return 0;
+}
+
+const mast_interface_t* mast_interface_get(const char *name)
+{
+    mast_interface_t *iface;
+
+    if (table.entries == NULL || name == NULL)
+        return NULL;
+
+    iface = _find_slot(table.entries, table.size, name);
+    if (iface->name[0] == '\0' || iface->index == 0)
+        return NULL;
+
+    return iface;
+}
+
+const mast_interface_t* mast_interface_lookup(const char *name)
+{
+    if (_load())
+        return NULL;
+
+    return mast_interface_get(name);
+}
+
+const mast_interface_t* mast_interface_choose(sa_family_t family)
+{
+    const mast_interface_t *best = NULL;
+    unsigned int i;
+
+    if (_load())
+        return NULL;
+
+    for (i = 0; i < table.size; i++) {
+        const mast_interface_t *iface = &table.entries[i];
+        const struct sockaddr_storage *addr = family == AF_INET6 ? &iface->addr6 : &iface->addr4;
+
+        if (iface->name[0] == '\0' || iface->index == 0 || addr->ss_family != family)
+            continue;
+
+        // Ignore loopback and point-to-point network interfaces
+        if ((iface->flags & IFF_LOOPBACK) || (iface->flags & IFF_POINTOPOINT))
+            continue;
+
+        // Ignore interfaces that arn't up and running
+        if (!(iface->flags & IFF_RUNNING))
+            continue;
+
+        // FIXME: find a way to avoid Wifi interfaces
+        // FIXME: Could we prefer network interfaces that support IFCAP_AV?
+
+        // The hash table has no order, so prefer the lowest index
+        if (best == NULL || iface->index < best->index)
+            best = iface;
+    }
+
+    return best;
+}
+
+int mast_interface_monitor_fd()
+{
+    if (_load())
+        return -1;
+
+    return table.fd;
+}
+
+void mast_interface_process()
+{
+    unsigned int i, j;
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+    if (table.fd < 0 || _read_netlink(table.fd, FALSE) <= 0)
+        return;
+#endif
+
+    for (i = 0; i < table.size; i++) {
+        mast_interface_t *iface = &table.entries[i];
+
+        if (!iface->came_back)
+            continue;
+        iface->came_back = FALSE;
+
+        mast_debug("Network interface is usable: %s", iface->name);
+        for (j = 0; j < table.socket_count; j++) {
+            if (strcmp(table.sockets[j]->ifname, iface->name) == 0)
+                mast_socket_rejoin(table.sockets[j]);
+        }
+    }
+}
+
+int mast_interface_watch_socket(mast_socket_t *sock)
+{
+    mast_socket_t **sockets;
+    unsigned int i;
+
+    for (i = 0; i < table.socket_count; i++) {
+        if (table.sockets[i] == sock)
+            return 0;
+    }
+
+    sockets = realloc(table.sockets, (table.socket_count + 1) * sizeof(mast_socket_t*));
+    if (sockets == NULL) {
+        mast_error("Failed to allocate memory for interface table");
+        return -1;
+    }
+
+    table.sockets = sockets;
+    table.sockets[table.socket_count++] = sock;
+
+    return 0;
+}
+
+void mast_interface_unwatch_socket(mast_socket_t *sock)
+{
+    unsigned int i;
+
+    for (i = 0; i < table.socket_count; i++) {
+        if (table.sockets[i] == sock) {
+            table.sockets[i] = table.sockets[--table.socket_count];
+            break;
+        }
+    }
+}
+
+void mast_interface_free()
+{
+    if (table.fd >= 0) {
+        close(table.fd);
+        table.fd = -1;
+    }
+
+    free(table.entries);
+    table.entries = NULL;
+    table.size = 0;
+    table.count = 0;
+
+    free(table.sockets);
+    table.sockets = NULL;
+    table.socket_count = 0;
+}
@@ -0,0 +1,186 @@
+/*
+
+  jitter.c
+
+  Reorder buffer that holds received RTP packets for a number of
+  packet times, so that they can be released in sequence number order.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "config.h"
+#include "mast.h"
+
+#include <string.h>
+
+
+#define SLOT(sequence)  ((sequence) & (MAST_JITTER_SLOTS - 1))
+
+
+void mast_jitter_init(mast_jitter_t *jitter, int depth)
+{
+    memset(jitter, 0, sizeof(mast_jitter_t));
+
+    if (depth < 0) {
+        depth = 0;
+    } else if (depth > MAST_JITTER_MAX_DEPTH) {
+        mast_warn("Jitter buffer depth limited to %d packets", MAST_JITTER_MAX_DEPTH);
+        depth = MAST_JITTER_MAX_DEPTH;
+    }
+
+    jitter->depth = depth;
+}
+
+static void _store(mast_jitter_t *jitter, mast_rtp_packet_t *packet)
+{
+    jitter->slots[SLOT(packet->sequence)] = packet;
+    jitter->count++;
+
+    if (jitter->count == 1 || (int16_t)(packet->sequence - jitter->newest_sequence) > 0)
+        jitter->newest_sequence = packet->sequence;
+}
+
+static void _start(mast_jitter_t *jitter, mast_rtp_packet_t *packet)
+{
+    jitter->started = TRUE;
+    jitter->ssrc = packet->ssrc;
+    jitter->next_sequence = packet->sequence;
+    jitter->released_any = FALSE;
+    jitter->consecutive_late = 0;
+    _store(jitter, packet);
+}
+
+int mast_jitter_add(mast_jitter_t *jitter, mast_rtp_packet_t *packet)
+{
+    int16_t diff;
+
+    jitter->received++;
+
+    if (!jitter->started) {
+        _start(jitter, packet);
+        return 0;
+    }
+
+    // A new stream, or a jump too big to buffer: release what we have and start again
+    diff = (int16_t)(packet->sequence - jitter->next_sequence);
+    if (packet->ssrc != jitter->ssrc || diff >= MAST_JITTER_SLOTS || diff <= -MAST_JITTER_SLOTS) {
+        if (jitter->restart) {
+            // Only one restart can be waiting at a time
+            jitter->late++;
+            mast_packet_unref(packet);
+            return -1;
+        }
+        jitter->resets++;
+        jitter->restart = packet;
+        return 0;
+    }
+
+    // Already released (or given up on) the packet with this sequence number
+    if (diff < 0 || (jitter->released_any && (int32_t)(packet->timestamp - jitter->last_timestamp) < 0)) {
+        jitter->late++;
+
+        // Nothing but late packets means the sender has gone back in time
+        if (++jitter->consecutive_late >= MAST_JITTER_SLOTS && !jitter->restart) {
+            jitter->resets++;
+            jitter->restart = packet;
+            return 0;
+        }
+
+        mast_packet_unref(packet);
+        return -1;
+    }
+    jitter->consecutive_late = 0;
+
+    if (jitter->slots[SLOT(packet->sequence)]) {
+        jitter->duplicate++;
+        mast_packet_unref(packet);
+        return -1;
+    }
+
+    _store(jitter, packet);
+
+    return 0;
+}
+
+static mast_rtp_packet_t* _pop(mast_jitter_t *jitter, int early)
+{
+    while (jitter->count > 0) {
+        mast_rtp_packet_t **slot = &jitter->slots[SLOT(jitter->next_sequence)];
+        int16_t ahead = (int16_t)(jitter->newest_sequence - jitter->next_sequence);
+
+        // Hold packets until enough newer ones have arrived
+        if (!early && !jitter->flushing && !jitter->restart && ahead < jitter->depth)
+            return NULL;
+
+        jitter->next_sequence++;
+
+        if (*slot) {
+            mast_rtp_packet_t *packet = *slot;
+            *slot = NULL;
+            jitter->count--;
+            jitter->released++;
+            jitter->released_any = TRUE;
+            jitter->last_timestamp = packet->timestamp;
+            return packet;
+        }
+
+        // Waited long enough; this one isn't coming
+        jitter->lost++;
+    }
+
+    if (jitter->restart) {
+        mast_rtp_packet_t *packet = jitter->restart;
+        jitter->restart = NULL;
+        _start(jitter, packet);
+        return _pop(jitter, early);
+    }
+
+    return NULL;
+}
+
+mast_rtp_packet_t* mast_jitter_pop(mast_jitter_t *jitter)
+{
+    return _pop(jitter, FALSE);
+}
+
+mast_rtp_packet_t* mast_jitter_pop_early(mast_jitter_t *jitter)
+{
+    return _pop(jitter, TRUE);
+}
+
+mast_rtp_packet_t* mast_jitter_pop_expired(mast_jitter_t *jitter, uint64_t now_ns, uint64_t timeout_ns)
+{
+    const mast_rtp_packet_t *oldest = jitter->restart;
+    uint16_t sequence;
+
+    // The next packet waiting, which may be after some missing ones
+    for (sequence = jitter->next_sequence; jitter->count > 0; sequence++) {
+        if (jitter->slots[SLOT(sequence)]) {
+            oldest = jitter->slots[SLOT(sequence)];
+            break;
+        }
+    }
+
+    if (oldest == NULL || oldest->arrival_ns + timeout_ns > now_ns)
+        return NULL;
+
+    return _pop(jitter, TRUE);
+}
+
+void mast_jitter_flush(mast_jitter_t *jitter)
+{
+    jitter->flushing = TRUE;
+}
+
+void mast_jitter_free(mast_jitter_t *jitter)
+{
+    mast_rtp_packet_t *packet;
+
+    mast_jitter_flush(jitter);
+    while ((packet = mast_jitter_pop(jitter))) {
+        mast_packet_unref(packet);
+    }
+}
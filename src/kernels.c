@@ -0,0 +1,83 @@
+/*
+
+  kernels.c
+
+  Checking which instruction sets the CPU supports, and choosing from
+  tables of kernels in order of preference.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "config.h"
+#include "mast.h"
+#include "kernels.h"
+
+#include <string.h>
+
+
+int mast_cpu_any()
+{
+    return TRUE;
+}
+
+int mast_cpu_sse41()
+{
+#ifdef HAVE_X86_KERNELS
+    return __builtin_cpu_supports("sse4.1");
+#else
+    return FALSE;
+#endif
+}
+
+int mast_cpu_avx2()
+{
+#ifdef HAVE_X86_KERNELS
+    return __builtin_cpu_supports("avx2");
+#else
+    return FALSE;
+#endif
+}
+
+int mast_cpu_neon()
+{
+    // Part of every AArch64 CPU
+#ifdef HAVE_NEON_KERNELS
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+const void* mast_kernel_get(const void *table, size_t count, size_t size, int index)
+{
+    const uint8_t *entry = table;
+    int found = 0;
+    size_t i;
+
+    // Only the kernels that will run on this CPU
+    for (i = 0; i < count; i++, entry += size) {
+        if (((const mast_kernel_t*)entry)->supported()) {
+            if (found == index)
+                return entry;
+            found++;
+        }
+    }
+
+    return NULL;
+}
+
+const void* mast_kernel_lookup(const void *table, size_t count, size_t size, const char *name)
+{
+    const mast_kernel_t *kernel;
+    int i;
+
+    for (i = 0; (kernel = mast_kernel_get(table, count, size, i)); i++) {
+        if (strcmp(kernel->name, name) == 0)
+            return kernel;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,30 @@
+/*
+  kernels.h
+
+  The intrinsics that vectorised kernels are written with, when the
+  compiler and target have them. The kernels are chosen at run time
+  using mast_kernel_get(), from the ones that the CPU supports.
+
+  Vector kernels multiply then add, rather than using fused multiply-add
+  instructions, so that their results are the same as the scalar kernel.
+  configure also stops the compiler from fusing them itself.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+*/
+
+#ifndef MAST_KERNELS_H
+#define MAST_KERNELS_H
+
+#if defined(HAVE_IMMINTRIN_H) && defined(HAVE_BUILTIN_CPU_SUPPORTS) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+#if defined(HAVE_ARM_NEON_H) && defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS
+#endif
+
+#endif
@@ -0,0 +1,140 @@
+/*
+
+  latency.c
+
+  Histogram of the time between the kernel receiving a packet and
+  the packet being parsed, which includes the time taken to wake up
+  the receiving thread.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "config.h"
+#include "mast.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+
+static uint64_t _realtime_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static int _bucket(uint64_t latency_ns)
+{
+    int bucket = 0;
+
+    while (latency_ns > 1 && bucket < MAST_LATENCY_BUCKETS - 1) {
+        latency_ns >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+void mast_latency_init(mast_latency_t *latency)
+{
+    memset(latency, 0, sizeof(mast_latency_t));
+    latency->min_ns = UINT64_MAX;
+}
+
+void mast_latency_add(mast_latency_t *latency, uint64_t latency_ns)
+{
+    latency->buckets[_bucket(latency_ns)]++;
+    latency->count++;
+    latency->total_ns += latency_ns;
+
+    if (latency_ns < latency->min_ns)
+        latency->min_ns = latency_ns;
+    if (latency_ns > latency->max_ns)
+        latency->max_ns = latency_ns;
+}
+
+void mast_latency_add_packet(mast_latency_t *latency, const mast_rtp_packet_t *packet)
+{
+    uint64_t now = _realtime_ns();
+
+    if (packet->arrival_ns == 0) {
+        latency->unknown++;
+        return;
+    }
+
+    // The clock may have been stepped since the packet arrived
+    mast_latency_add(latency, now > packet->arrival_ns ? now - packet->arrival_ns : 0);
+}
+
+uint64_t mast_latency_percentile(const mast_latency_t *latency, double percentile)
+{
+    uint64_t target, seen = 0;
+    int i;
+
+    if (latency->count == 0)
+        return 0;
+
+    target = (uint64_t)ceil((percentile / 100.0) * latency->count);
+    if (target < 1)
+        target = 1;
+
+    for (i = 0; i < MAST_LATENCY_BUCKETS; i++) {
+        seen += latency->buckets[i];
+        if (seen >= target)
+            break;
+    }
+
+    // The last bucket has no upper bound
+    if (i >= MAST_LATENCY_BUCKETS - 1 || ((uint64_t)2 << i) > latency->max_ns)
+        return latency->max_ns;
+
+    return (uint64_t)2 << i;
+}
+
+void mast_latency_print(const mast_latency_t *latency)
+{
+    uint64_t largest = 0;
+    int i;
+
+    fprintf(stderr, "\nReceive latency (kernel to parse) of %llu packets",
+            (unsigned long long)latency->count);
+    if (latency->unknown)
+        fprintf(stderr, ", %llu without timestamps", (unsigned long long)latency->unknown);
+    fprintf(stderr, "\n");
+
+    if (latency->count == 0)
+        return;
+
+    fprintf(
+        stderr, "  min %.1fus  mean %.1fus  p50 %.1fus  p99 %.1fus  p99.9 %.1fus  max %.1fus\n\n",
+        latency->min_ns / 1000.0,
+        (double)latency->total_ns / latency->count / 1000.0,
+        mast_latency_percentile(latency, 50.0) / 1000.0,
+        mast_latency_percentile(latency, 99.0) / 1000.0,
+        mast_latency_percentile(latency, 99.9) / 1000.0,
+        latency->max_ns / 1000.0
+    );
+
+    for (i = 0; i < MAST_LATENCY_BUCKETS; i++) {
+        if (latency->buckets[i] > largest)
+            largest = latency->buckets[i];
+    }
+
+    for (i = 0; i < MAST_LATENCY_BUCKETS; i++) {
+        int width, j;
+
+        if (latency->buckets[i] == 0)
+            continue;
+
+        width = (int)((latency->buckets[i] * 50) / largest);
+        fprintf(stderr, "  %10.1fus %10llu ", ((uint64_t)1 << i) / 1000.0,
+                (unsigned long long)latency->buckets[i]);
+        for (j = 0; j < width; j++)
+            fputc('#', stderr);
+        fputc('\n', stderr);
+    }
+}
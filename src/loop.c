@@ -0,0 +1,378 @@
+/*
+
+  loop.c
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "config.h"
+#include "mast.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H) && defined(HAVE_SYS_SIGNALFD_H)
+#define USE_EPOLL
+#endif
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#else
+#include <sys/select.h>
+#endif
+
+enum {
+    MAST_LOOP_SOURCE_SOCKET,
+    MAST_LOOP_SOURCE_TIMER,
+    MAST_LOOP_SOURCE_SIGNAL,
+    MAST_LOOP_SOURCE_INTERFACES
+};
+
+struct mast_loop_source_s
+{
+    int type;
+    int fd;
+    mast_loop_callback callback;
+    void *user_data;
+
+    // Only used by the select() fallback
+    uint64_t period_ns;
+    uint64_t deadline_ns;
+
+    struct mast_loop_source_s *next;
+};
+
+
+static struct mast_loop_source_s* _add_source(mast_loop_t *loop, int type, int fd, mast_loop_callback callback, void *user_data)
+{
+    struct mast_loop_source_s *source = calloc(1, sizeof(struct mast_loop_source_s));
+    if (source == NULL) {
+        mast_error("Failed to allocate memory for event loop source");
+        return NULL;
+    }
+
+    source->type = type;
+    source->fd = fd;
+    source->callback = callback;
+    source->user_data = user_data;
+
+#ifdef USE_EPOLL
+    {
+        struct epoll_event event;
+
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = source;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+            mast_error("Failed to add file descriptor to event loop: %s", strerror(errno));
+            free(source);
+            return NULL;
+        }
+    }
+#endif
+
+    source->next = loop->sources;
+    loop->sources = source;
+
+    return source;
+}
+
+
+#ifdef USE_EPOLL
+
+static int _add_signals(mast_loop_t *loop)
+{
+    sigset_t mask;
+    int fd;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
+
+    // Signals are delivered through the file descriptor instead of a handler
+    if (sigprocmask(SIG_BLOCK, &mask, NULL)) {
+        mast_error("Failed to block signals: %s", strerror(errno));
+        return -1;
+    }
+
+    fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) {
+        mast_error("Failed to create signalfd: %s", strerror(errno));
+        return -1;
+    }
+
+    if (_add_source(loop, MAST_LOOP_SOURCE_SIGNAL, fd, NULL, NULL) == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void _handle_signal(struct mast_loop_source_s *source)
+{
+    struct signalfd_siginfo info;
+
+    while (read(source->fd, &info, sizeof(info)) == sizeof(info)) {
+        running = FALSE;
+        switch(info.ssi_signo) {
+        case SIGTERM:
+            mast_info("Got termination signal");
+            break;
+        case SIGINT:
+            mast_info("Got interupt signal");
+            break;
+        }
+    }
+}
+
+int mast_loop_init(mast_loop_t *loop)
+{
+    memset(loop, 0, sizeof(mast_loop_t));
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        mast_error("Failed to create epoll instance: %s", strerror(errno));
+        return -1;
+    }
+
+    if (_add_signals(loop)) {
+        mast_loop_close(loop);
+        return -1;
+    }
+
+    return 0;
+}
+
+int mast_loop_add_timer(mast_loop_t *loop, unsigned int period_ms, mast_loop_callback callback, void *user_data)
+{
+    struct itimerspec spec;
+    int fd;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        mast_error("Failed to create timerfd: %s", strerror(errno));
+        return -1;
+    }
+
+    spec.it_interval.tv_sec = period_ms / 1000;
+    spec.it_interval.tv_nsec = (period_ms % 1000) * 1000000;
+    spec.it_value = spec.it_interval;
+    if (timerfd_settime(fd, 0, &spec, NULL)) {
+        mast_error("Failed to set timer: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (_add_source(loop, MAST_LOOP_SOURCE_TIMER, fd, callback, user_data) == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void _dispatch(struct mast_loop_source_s *source)
+{
+    switch(source->type) {
+    case MAST_LOOP_SOURCE_SOCKET:
+    case MAST_LOOP_SOURCE_INTERFACES:
+        source->callback(source->user_data);
+        break;
+
+    case MAST_LOOP_SOURCE_TIMER: {
+        uint64_t expirations;
+        if (read(source->fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+            if (expirations > 1)
+                mast_debug("Event loop missed %d timer expirations", (int)(expirations - 1));
+            source->callback(source->user_data);
+        }
+        break;
+    }
+
+    case MAST_LOOP_SOURCE_SIGNAL:
+        _handle_signal(source);
+        break;
+    }
+}
+
+int mast_loop_run(mast_loop_t *loop)
+{
+    struct epoll_event events[MAST_LOOP_MAX_EVENTS];
+
+    while (running) {
+        int count, i;
+
+        count = epoll_wait(loop->epoll_fd, events, MAST_LOOP_MAX_EVENTS, loop->busy_poll ? 0 : -1);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            mast_error("epoll_wait() failed: %s", strerror(errno));
+            return -1;
+        }
+
+        for (i = 0; i < count && running; i++) {
+            _dispatch(events[i].data.ptr);
+        }
+    }
+
+    return 0;
+}
+
+#else
+
+// Portable fallback using select() and a signal handler
+
+static uint64_t _monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+int mast_loop_init(mast_loop_t *loop)
+{
+    memset(loop, 0, sizeof(mast_loop_t));
+    loop->epoll_fd = -1;
+    setup_signal_hander();
+    return 0;
+}
+
+int mast_loop_add_timer(mast_loop_t *loop, unsigned int period_ms, mast_loop_callback callback, void *user_data)
+{
+    struct mast_loop_source_s *source;
+
+    source = _add_source(loop, MAST_LOOP_SOURCE_TIMER, -1, callback, user_data);
+    if (source == NULL)
+        return -1;
+
+    source->period_ns = (uint64_t)period_ms * 1000000;
+    source->deadline_ns = _monotonic_ns() + source->period_ns;
+
+    return 0;
+}
+
+int mast_loop_run(mast_loop_t *loop)
+{
+    while (running) {
+        struct mast_loop_source_s *source;
+        struct timeval timeout, *timeout_ptr = NULL;
+        uint64_t now = _monotonic_ns();
+        uint64_t next_deadline = UINT64_MAX;
+        fd_set readfds;
+        int retval;
+
+        FD_ZERO(&readfds);
+        for (source = loop->sources; source; source = source->next) {
+            if (source->type == MAST_LOOP_SOURCE_TIMER) {
+                if (source->deadline_ns < next_deadline)
+                    next_deadline = source->deadline_ns;
+            } else {
+                FD_SET(source->fd, &readfds);
+            }
+        }
+
+        if (loop->busy_poll) {
+            next_deadline = now;
+        }
+
+        if (next_deadline != UINT64_MAX) {
+            uint64_t wait = next_deadline > now ? next_deadline - now : 0;
+            timeout.tv_sec = wait / 1000000000;
+            timeout.tv_usec = (wait % 1000000000) / 1000;
+            timeout_ptr = &timeout;
+        }
+
+        retval = select(FD_SETSIZE, &readfds, NULL, NULL, timeout_ptr);
+        if (retval < 0) {
+            if (errno == EINTR)
+                continue;
+            mast_error("select() failed: %s", strerror(errno));
+            return -1;
+        }
+
+        now = _monotonic_ns();
+        for (source = loop->sources; source && running; source = source->next) {
+            if (source->type == MAST_LOOP_SOURCE_TIMER) {
+                if (source->deadline_ns <= now) {
+                    source->deadline_ns += source->period_ns;
+                    if (source->deadline_ns <= now)
+                        source->deadline_ns = now + source->period_ns;
+                    source->callback(source->user_data);
+                }
+            } else if (FD_ISSET(source->fd, &readfds)) {
+                source->callback(source->user_data);
+            }
+        }
+    }
+
+    return 0;
+}
+
+#endif
+
+
+static void _process_interfaces(void *user_data)
+{
+    mast_interface_process();
+}
+
+int mast_loop_add_socket(mast_loop_t *loop, mast_socket_t *sock, mast_loop_callback callback, void *user_data)
+{
+    if (_add_source(loop, MAST_LOOP_SOURCE_SOCKET, mast_socket_recv_fd(sock), callback, user_data) == NULL)
+        return -1;
+
+    // Watch for interfaces coming back, so that sockets can re-join their groups
+    if (!loop->watching_interfaces && sock->group_count > 0) {
+        int fd = mast_interface_monitor_fd();
+        if (fd >= 0 && _add_source(loop, MAST_LOOP_SOURCE_INTERFACES, fd, _process_interfaces, NULL))
+            loop->watching_interfaces = TRUE;
+    }
+
+    // The loop tells us when data is waiting, so receiving should never block
+    sock->event_driven = TRUE;
+
+    return 0;
+}
+
+void mast_loop_enable_busy_poll(mast_loop_t *loop)
+{
+    // Trade a whole CPU for not having to wait for the scheduler to wake us up
+    loop->busy_poll = TRUE;
+}
+
+void mast_loop_close(mast_loop_t *loop)
+{
+    struct mast_loop_source_s *source = loop->sources;
+
+    while (source) {
+        struct mast_loop_source_s *next = source->next;
+
+        // Socket and interface file descriptors are owned by someone else
+        if (source->type != MAST_LOOP_SOURCE_SOCKET && source->type != MAST_LOOP_SOURCE_INTERFACES && source->fd >= 0)
+            close(source->fd);
+
+        free(source);
+        source = next;
+    }
+    loop->sources = NULL;
+
+    if (loop->epoll_fd >= 0) {
+        close(loop->epoll_fd);
+        loop->epoll_fd = -1;
+    }
+}
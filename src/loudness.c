@@ -0,0 +1,586 @@
+/*
+
+  loudness.c
+
+  Loudness measurement as described in ITU-R BS.1770-4 and EBU R128:
+  momentary (400ms), short-term (3s) and integrated loudness, and
+  loudness range (EBU Tech 3342).
+
+  The audio is K-weighted by two biquad filters; each lane of a vector
+  register is a different channel, so a group of channels is filtered
+  together. The mean square of each 100ms step is kept, and the
+  gating blocks made from them are stored in fixed size rings with a
+  histogram alongside, so that reading the integrated loudness or
+  loudness range takes the same time however long the programme is.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "config.h"
+#include "mast.h"
+#include "kernels.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Size of the buffer that samples are converted into for filtering
+#define WORK_SAMPLES            (4096)
+
+#define RELATIVE_GATE           (-10.0f)    // For integrated loudness
+#define RANGE_RELATIVE_GATE     (-20.0f)    // For loudness range
+#define RANGE_LOW_PERCENTILE    (0.10)
+#define RANGE_HIGH_PERCENTILE   (0.95)
+
+// Filter state smaller than this is flushed to zero, to avoid slow denormal arithmetic
+#define STATE_FLUSH_LEVEL       (1e-20f)
+
+
+// ------- Kernels ---------
+
+static void _k_weight_scalar(const mast_biquad_t *filters, float *state, const float *input, int frames, int stride, float *energy)
+{
+    const mast_biquad_t *a = &filters[0], *b = &filters[1];
+    int lane, frame;
+
+    for (lane = 0; lane < stride; lane++) {
+        float a1 = state[lane], a2 = state[stride + lane];
+        float b1 = state[2 * stride + lane], b2 = state[3 * stride + lane];
+        float sum = 0.0f;
+
+        // Transposed direct form II
+        for (frame = 0; frame < frames; frame++) {
+            float x = input[frame * stride + lane];
+            float y = a->b0 * x + a1;
+            a1 = a->b1 * x - a->a1 * y + a2;
+            a2 = a->b2 * x - a->a2 * y;
+
+            x = y;
+            y = b->b0 * x + b1;
+            b1 = b->b1 * x - b->a1 * y + b2;
+            b2 = b->b2 * x - b->a2 * y;
+
+            sum += y * y;
+        }
+
+        state[lane] = a1;
+        state[stride + lane] = a2;
+        state[2 * stride + lane] = b1;
+        state[3 * stride + lane] = b2;
+        energy[lane] += sum;
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("sse4.1")))
+static void _k_weight_sse41(const mast_biquad_t *filters, float *state, const float *input, int frames, int stride, float *energy)
+{
+    const __m128 ab0 = _mm_set1_ps(filters[0].b0), ab1 = _mm_set1_ps(filters[0].b1), ab2 = _mm_set1_ps(filters[0].b2);
+    const __m128 aa1 = _mm_set1_ps(filters[0].a1), aa2 = _mm_set1_ps(filters[0].a2);
+    const __m128 bb0 = _mm_set1_ps(filters[1].b0), bb1 = _mm_set1_ps(filters[1].b1), bb2 = _mm_set1_ps(filters[1].b2);
+    const __m128 ba1 = _mm_set1_ps(filters[1].a1), ba2 = _mm_set1_ps(filters[1].a2);
+    int lane, frame;
+
+    // Four channels at a time
+    for (lane = 0; lane < stride; lane += 4) {
+        __m128 a1 = _mm_loadu_ps(&state[lane]), a2 = _mm_loadu_ps(&state[stride + lane]);
+        __m128 b1 = _mm_loadu_ps(&state[2 * stride + lane]), b2 = _mm_loadu_ps(&state[3 * stride + lane]);
+        __m128 sum = _mm_setzero_ps();
+
+        for (frame = 0; frame < frames; frame++) {
+            __m128 x = _mm_loadu_ps(&input[frame * stride + lane]);
+            __m128 y = _mm_add_ps(_mm_mul_ps(ab0, x), a1);
+            a1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(ab1, x), _mm_mul_ps(aa1, y)), a2);
+            a2 = _mm_sub_ps(_mm_mul_ps(ab2, x), _mm_mul_ps(aa2, y));
+
+            x = y;
+            y = _mm_add_ps(_mm_mul_ps(bb0, x), b1);
+            b1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(bb1, x), _mm_mul_ps(ba1, y)), b2);
+            b2 = _mm_sub_ps(_mm_mul_ps(bb2, x), _mm_mul_ps(ba2, y));
+
+            sum = _mm_add_ps(sum, _mm_mul_ps(y, y));
+        }
+
+        _mm_storeu_ps(&state[lane], a1);
+        _mm_storeu_ps(&state[stride + lane], a2);
+        _mm_storeu_ps(&state[2 * stride + lane], b1);
+        _mm_storeu_ps(&state[3 * stride + lane], b2);
+        _mm_storeu_ps(&energy[lane], _mm_add_ps(_mm_loadu_ps(&energy[lane]), sum));
+    }
+}
+
+__attribute__((target("avx2")))
+static void _k_weight_avx2(const mast_biquad_t *filters, float *state, const float *input, int frames, int stride, float *energy)
+{
+    const __m256 ab0 = _mm256_set1_ps(filters[0].b0), ab1 = _mm256_set1_ps(filters[0].b1), ab2 = _mm256_set1_ps(filters[0].b2);
+    const __m256 aa1 = _mm256_set1_ps(filters[0].a1), aa2 = _mm256_set1_ps(filters[0].a2);
+    const __m256 bb0 = _mm256_set1_ps(filters[1].b0), bb1 = _mm256_set1_ps(filters[1].b1), bb2 = _mm256_set1_ps(filters[1].b2);
+    const __m256 ba1 = _mm256_set1_ps(filters[1].a1), ba2 = _mm256_set1_ps(filters[1].a2);
+    int lane, frame;
+
+    for (lane = 0; lane < stride; lane += 8) {
+        __m256 a1 = _mm256_loadu_ps(&state[lane]), a2 = _mm256_loadu_ps(&state[stride + lane]);
+        __m256 b1 = _mm256_loadu_ps(&state[2 * stride + lane]), b2 = _mm256_loadu_ps(&state[3 * stride + lane]);
+        __m256 sum = _mm256_setzero_ps();
+
+        for (frame = 0; frame < frames; frame++) {
+            __m256 x = _mm256_loadu_ps(&input[frame * stride + lane]);
+            __m256 y = _mm256_add_ps(_mm256_mul_ps(ab0, x), a1);
+            a1 = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(ab1, x), _mm256_mul_ps(aa1, y)), a2);
+            a2 = _mm256_sub_ps(_mm256_mul_ps(ab2, x), _mm256_mul_ps(aa2, y));
+
+            x = y;
+            y = _mm256_add_ps(_mm256_mul_ps(bb0, x), b1);
+            b1 = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(bb1, x), _mm256_mul_ps(ba1, y)), b2);
+            b2 = _mm256_sub_ps(_mm256_mul_ps(bb2, x), _mm256_mul_ps(ba2, y));
+
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(y, y));
+        }
+
+        _mm256_storeu_ps(&state[lane], a1);
+        _mm256_storeu_ps(&state[stride + lane], a2);
+        _mm256_storeu_ps(&state[2 * stride + lane], b1);
+        _mm256_storeu_ps(&state[3 * stride + lane], b2);
+        _mm256_storeu_ps(&energy[lane], _mm256_add_ps(_mm256_loadu_ps(&energy[lane]), sum));
+    }
+}
+
+#endif
+
+#ifdef HAVE_NEON_KERNELS
+
+static void _k_weight_neon(const mast_biquad_t *filters, float *state, const float *input, int frames, int stride, float *energy)
+{
+    const mast_biquad_t *a = &filters[0], *b = &filters[1];
+    int lane, frame;
+
+    for (lane = 0; lane < stride; lane += 4) {
+        float32x4_t a1 = vld1q_f32(&state[lane]), a2 = vld1q_f32(&state[stride + lane]);
+        float32x4_t b1 = vld1q_f32(&state[2 * stride + lane]), b2 = vld1q_f32(&state[3 * stride + lane]);
+        float32x4_t sum = vdupq_n_f32(0.0f);
+
+        for (frame = 0; frame < frames; frame++) {
+            float32x4_t x = vld1q_f32(&input[frame * stride + lane]);
+            float32x4_t y = vaddq_f32(vmulq_n_f32(x, a->b0), a1);
+            a1 = vaddq_f32(vsubq_f32(vmulq_n_f32(x, a->b1), vmulq_n_f32(y, a->a1)), a2);
+            a2 = vsubq_f32(vmulq_n_f32(x, a->b2), vmulq_n_f32(y, a->a2));
+
+            x = y;
+            y = vaddq_f32(vmulq_n_f32(x, b->b0), b1);
+            b1 = vaddq_f32(vsubq_f32(vmulq_n_f32(x, b->b1), vmulq_n_f32(y, b->a1)), b2);
+            b2 = vsubq_f32(vmulq_n_f32(x, b->b2), vmulq_n_f32(y, b->a2));
+
+            sum = vaddq_f32(sum, vmulq_f32(y, y));
+        }
+
+        vst1q_f32(&state[lane], a1);
+        vst1q_f32(&state[stride + lane], a2);
+        vst1q_f32(&state[2 * stride + lane], b1);
+        vst1q_f32(&state[3 * stride + lane], b2);
+        vst1q_f32(&energy[lane], vaddq_f32(vld1q_f32(&energy[lane]), sum));
+    }
+}
+
+#endif
+
+// In order of preference
+static const mast_loudness_kernel_t kernels[] = {
+#ifdef HAVE_X86_KERNELS
+    { "avx2", mast_cpu_avx2, _k_weight_avx2 },
+    { "sse4.1", mast_cpu_sse41, _k_weight_sse41 },
+#endif
+#ifdef HAVE_NEON_KERNELS
+    { "neon", mast_cpu_neon, _k_weight_neon },
+#endif
+    { "scalar", mast_cpu_any, _k_weight_scalar },
+};
+
+#define KERNEL_COUNT    (sizeof(kernels) / sizeof(kernels[0]))
+
+
+const mast_loudness_kernel_t* mast_loudness_kernel_get(int index)
+{
+    return mast_kernel_get(kernels, KERNEL_COUNT, sizeof(kernels[0]), index);
+}
+
+const mast_loudness_kernel_t* mast_loudness_kernel_lookup(const char *name)
+{
+    return mast_kernel_lookup(kernels, KERNEL_COUNT, sizeof(kernels[0]), name);
+}
+
+
+// ------- Gating blocks ---------
+
+// The histogram bin for a block, or -1 if it is below the absolute gate
+static int _bin(float lufs)
+{
+    int bin;
+
+    if (!(lufs >= MAST_LOUDNESS_ABSOLUTE_GATE))
+        return -1;
+
+    bin = (int)((lufs - MAST_LOUDNESS_ABSOLUTE_GATE) * 10.0f);
+    if (bin >= MAST_LOUDNESS_HISTOGRAM_BINS)
+        bin = MAST_LOUDNESS_HISTOGRAM_BINS - 1;
+
+    return bin;
+}
+
+static float _bin_lufs(int bin)
+{
+    return MAST_LOUDNESS_ABSOLUTE_GATE + (bin + 0.5f) / 10.0f;
+}
+
+int mast_loudness_blocks_init(mast_loudness_blocks_t *blocks, uint32_t size)
+{
+    memset(blocks, 0, sizeof(mast_loudness_blocks_t));
+
+    // Pages are only touched as the ring fills up
+    blocks->powers = calloc(size, sizeof(float));
+    if (blocks->powers == NULL) {
+        mast_error("Failed to allocate memory for loudness blocks");
+        return -1;
+    }
+
+    blocks->size = size;
+    return 0;
+}
+
+void mast_loudness_blocks_add(mast_loudness_blocks_t *blocks, float power)
+{
+    int bin;
+
+    // Forget the oldest block once the ring is full
+    if (blocks->count == blocks->size) {
+        bin = _bin(MAST_POWER_TO_LUFS(blocks->powers[blocks->next]));
+        if (bin >= 0) {
+            blocks->histogram[bin]--;
+            blocks->histogram_power[bin] -= blocks->powers[blocks->next];
+            if (blocks->histogram[bin] == 0)
+                blocks->histogram_power[bin] = 0.0;
+        }
+    } else {
+        blocks->count++;
+    }
+
+    blocks->powers[blocks->next] = power;
+    if (++blocks->next == blocks->size)
+        blocks->next = 0;
+
+    bin = _bin(MAST_POWER_TO_LUFS(power));
+    if (bin >= 0) {
+        blocks->histogram[bin]++;
+        blocks->histogram_power[bin] += power;
+    }
+}
+
+void mast_loudness_blocks_clear(mast_loudness_blocks_t *blocks)
+{
+    blocks->count = 0;
+    blocks->next = 0;
+    memset(blocks->histogram, 0, sizeof(blocks->histogram));
+    memset(blocks->histogram_power, 0, sizeof(blocks->histogram_power));
+}
+
+void mast_loudness_blocks_free(mast_loudness_blocks_t *blocks)
+{
+    free(blocks->powers);
+    blocks->powers = NULL;
+}
+
+// The first bin above a relative gate, from the mean power of the blocks above the absolute gate
+static int _relative_gate_bin(const mast_loudness_blocks_t *blocks, float gate)
+{
+    double power = 0.0;
+    uint64_t count = 0;
+    int bin;
+
+    for (bin = 0; bin < MAST_LOUDNESS_HISTOGRAM_BINS; bin++) {
+        count += blocks->histogram[bin];
+        power += blocks->histogram_power[bin];
+    }
+
+    if (count == 0)
+        return -1;
+
+    bin = _bin(MAST_POWER_TO_LUFS(power / count) + gate);
+    return bin < 0 ? 0 : bin;
+}
+
+
+// ------- Measurement ---------
+
+// K-weighting filter coefficients for any sample rate (ITU-R BS.1770-4 Annex 1)
+static void _init_filters(mast_biquad_t *filters, int sample_rate)
+{
+    double f0, gain, q, k, vh, vb, a0;
+
+    // High shelf, modelling the acoustic effect of the head
+    f0 = 1681.974450955533;
+    gain = 3.999843853973347;
+    q = 0.7071752369554196;
+    k = tan(M_PI * f0 / sample_rate);
+    vh = pow(10.0, gain / 20.0);
+    vb = pow(vh, 0.4996667741545416);
+    a0 = 1.0 + k / q + k * k;
+    filters[0].b0 = (vh + vb * k / q + k * k) / a0;
+    filters[0].b1 = 2.0 * (k * k - vh) / a0;
+    filters[0].b2 = (vh - vb * k / q + k * k) / a0;
+    filters[0].a1 = 2.0 * (k * k - 1.0) / a0;
+    filters[0].a2 = (1.0 - k / q + k * k) / a0;
+
+    // High pass (RLB weighting)
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan(M_PI * f0 / sample_rate);
+    a0 = 1.0 + k / q + k * k;
+    filters[1].b0 = 1.0;
+    filters[1].b1 = -2.0;
+    filters[1].b2 = 1.0;
+    filters[1].a1 = 2.0 * (k * k - 1.0) / a0;
+    filters[1].a2 = (1.0 - k / q + k * k) / a0;
+}
+
+int mast_loudness_init(mast_loudness_t *loudness, int channels, int sample_rate)
+{
+    int channel;
+
+    memset(loudness, 0, sizeof(mast_loudness_t));
+
+    if (sample_rate <= 0) {
+        mast_error("Invalid sample rate for loudness measurement: %d", sample_rate);
+        return -1;
+    }
+
+    if (channels > MAST_MAX_CHANNEL_COUNT) {
+        mast_warn("Only measuring the loudness of the first %d channels", MAST_MAX_CHANNEL_COUNT);
+        channels = MAST_MAX_CHANNEL_COUNT;
+    }
+
+    loudness->channel_count = channels;
+    loudness->stride = (channels + MAST_LOUDNESS_LANES - 1) & ~(MAST_LOUDNESS_LANES - 1);
+    loudness->step_frames = (sample_rate * MAST_LOUDNESS_STEP_MS) / 1000;
+    loudness->kernel = mast_loudness_kernel_get(0);
+    mast_debug("Using %s loudness kernel", loudness->kernel->name);
+    _init_filters(loudness->filters, sample_rate);
+
+    // 5.1 is assumed to be in the order L, R, C, LFE, Ls, Rs
+    for (channel = 0; channel < channels; channel++)
+        loudness->weights[channel] = 1.0f;
+    if (channels == 6) {
+        loudness->weights[3] = 0.0f;
+        loudness->weights[4] = 1.41f;
+        loudness->weights[5] = 1.41f;
+    }
+
+    if (mast_loudness_blocks_init(&loudness->momentary_blocks, MAST_LOUDNESS_MAX_BLOCKS))
+        return -1;
+
+    if (mast_loudness_blocks_init(&loudness->short_term_blocks, MAST_LOUDNESS_MAX_BLOCKS)) {
+        mast_loudness_blocks_free(&loudness->momentary_blocks);
+        return -1;
+    }
+
+    return 0;
+}
+
+int mast_loudness_set_kernel(mast_loudness_t *loudness, const char *name)
+{
+    const mast_loudness_kernel_t *found = mast_loudness_kernel_lookup(name);
+
+    if (found == NULL) {
+        mast_warn("Loudness kernel is not available: %s", name);
+        return -1;
+    }
+
+    loudness->kernel = found;
+    return 0;
+}
+
+void mast_loudness_reset(mast_loudness_t *loudness)
+{
+    memset(loudness->state, 0, sizeof(loudness->state));
+    memset(loudness->energy, 0, sizeof(loudness->energy));
+    memset(loudness->steps, 0, sizeof(loudness->steps));
+    loudness->frames = 0;
+    loudness->step_count = 0;
+
+    mast_loudness_blocks_clear(&loudness->momentary_blocks);
+    mast_loudness_blocks_clear(&loudness->short_term_blocks);
+}
+
+void mast_loudness_free(mast_loudness_t *loudness)
+{
+    mast_loudness_blocks_free(&loudness->momentary_blocks);
+    mast_loudness_blocks_free(&loudness->short_term_blocks);
+}
+
+// Mean of the weighted mean square of the most recent steps
+static float _mean_steps(const mast_loudness_t *loudness, int steps)
+{
+    double power = 0.0;
+    int i;
+
+    for (i = 1; i <= steps; i++)
+        power += loudness->steps[(loudness->step_count - i) % MAST_LOUDNESS_SHORT_TERM_STEPS];
+
+    return power / steps;
+}
+
+static void _end_step(mast_loudness_t *loudness)
+{
+    double power = 0.0;
+    int channel;
+
+    for (channel = 0; channel < loudness->channel_count; channel++) {
+        power += loudness->weights[channel] * loudness->energy[channel];
+        loudness->energy[channel] = 0.0;
+    }
+
+    loudness->steps[loudness->step_count % MAST_LOUDNESS_SHORT_TERM_STEPS] = power / loudness->step_frames;
+    loudness->step_count++;
+    loudness->frames = 0;
+
+    // Gating blocks overlap, starting every step
+    if (loudness->step_count >= MAST_LOUDNESS_MOMENTARY_STEPS) {
+        float block = _mean_steps(loudness, MAST_LOUDNESS_MOMENTARY_STEPS);
+        mast_loudness_blocks_add(&loudness->momentary_blocks, block);
+    }
+
+    if (loudness->step_count >= MAST_LOUDNESS_SHORT_TERM_STEPS) {
+        float block = _mean_steps(loudness, MAST_LOUDNESS_SHORT_TERM_STEPS);
+        mast_loudness_blocks_add(&loudness->short_term_blocks, block);
+    }
+}
+
+void mast_loudness_process_int32(mast_loudness_t *loudness, const int32_t *samples, int count)
+{
+    float work[WORK_SAMPLES];
+    float energy[MAST_MAX_CHANNEL_COUNT];
+    int channels = loudness->channel_count;
+    int stride = loudness->stride;
+    int chunk_frames = WORK_SAMPLES / stride;
+    int frames, done, chunk, frame, channel, i;
+
+    if (channels <= 0)
+        return;
+
+    // The padding lanes are never written, so they stay silent
+    if (stride != channels)
+        memset(work, 0, sizeof(work));
+
+    frames = count / channels;
+    for (done = 0; done < frames; done += chunk) {
+        // Stop at the end of each step
+        chunk = frames - done;
+        if (chunk > chunk_frames)
+            chunk = chunk_frames;
+        if (chunk > loudness->step_frames - loudness->frames)
+            chunk = loudness->step_frames - loudness->frames;
+
+        for (frame = 0; frame < chunk; frame++) {
+            const int32_t *input = &samples[(done + frame) * channels];
+            float *output = &work[frame * stride];
+            for (channel = 0; channel < channels; channel++)
+                output[channel] = (float)input[channel] * (1.0f / 2147483648.0f);
+        }
+
+        memset(energy, 0, sizeof(energy[0]) * stride);
+        loudness->kernel->k_weight(loudness->filters, loudness->state, work, chunk, stride, energy);
+        for (channel = 0; channel < channels; channel++)
+            loudness->energy[channel] += energy[channel];
+
+        loudness->frames += chunk;
+        if (loudness->frames == loudness->step_frames)
+            _end_step(loudness);
+    }
+
+    for (i = 0; i < 4 * stride; i++) {
+        if (fabsf(loudness->state[i]) < STATE_FLUSH_LEVEL)
+            loudness->state[i] = 0.0f;
+    }
+}
+
+void mast_loudness_process(mast_loudness_t *loudness, const mast_codec_t *codec, uint8_t* payload, int payload_length)
+{
+    int32_t samples[RTP_MAX_PAYLOAD];
+    int count = payload_length / codec->sample_bytes;
+
+    if (count > RTP_MAX_PAYLOAD)
+        count = RTP_MAX_PAYLOAD;
+
+    codec->decode(payload, count, samples);
+    mast_loudness_process_int32(loudness, samples, count);
+}
+
+float mast_loudness_momentary(mast_loudness_t *loudness)
+{
+    if (loudness->step_count < MAST_LOUDNESS_MOMENTARY_STEPS)
+        return -INFINITY;
+
+    return MAST_POWER_TO_LUFS(_mean_steps(loudness, MAST_LOUDNESS_MOMENTARY_STEPS));
+}
+
+float mast_loudness_short_term(mast_loudness_t *loudness)
+{
+    if (loudness->step_count < MAST_LOUDNESS_SHORT_TERM_STEPS)
+        return -INFINITY;
+
+    return MAST_POWER_TO_LUFS(_mean_steps(loudness, MAST_LOUDNESS_SHORT_TERM_STEPS));
+}
+
+float mast_loudness_integrated(mast_loudness_t *loudness)
+{
+    const mast_loudness_blocks_t *blocks = &loudness->momentary_blocks;
+    int gate = _relative_gate_bin(blocks, RELATIVE_GATE);
+    double power = 0.0;
+    uint64_t count = 0;
+    int bin;
+
+    if (gate < 0)
+        return -INFINITY;
+
+    for (bin = gate; bin < MAST_LOUDNESS_HISTOGRAM_BINS; bin++) {
+        count += blocks->histogram[bin];
+        power += blocks->histogram_power[bin];
+    }
+
+    return MAST_POWER_TO_LUFS(power / count);
+}
+
+// The loudness of the block at a percentile of those above the gate
+static float _percentile(const mast_loudness_blocks_t *blocks, int gate, uint64_t count, double percentile)
+{
+    uint64_t index = (uint64_t)((count - 1) * percentile + 0.5);
+    uint64_t seen = 0;
+    int bin;
+
+    for (bin = gate; bin < MAST_LOUDNESS_HISTOGRAM_BINS; bin++) {
+        seen += blocks->histogram[bin];
+        if (seen > index)
+            break;
+    }
+
+    return _bin_lufs(bin);
+}
+
+float mast_loudness_range(mast_loudness_t *loudness)
+{
+    const mast_loudness_blocks_t *blocks = &loudness->short_term_blocks;
+    int gate = _relative_gate_bin(blocks, RANGE_RELATIVE_GATE);
+    uint64_t count = 0;
+    int bin;
+
+    if (gate < 0)
+        return 0.0f;
+
+    for (bin = gate; bin < MAST_LOUDNESS_HISTOGRAM_BINS; bin++)
+        count += blocks->histogram[bin];
+
+    return _percentile(blocks, gate, count, RANGE_HIGH_PERCENTILE) -
+           _percentile(blocks, gate, count, RANGE_LOW_PERCENTILE);
+}
@@ -12,6 +12,7 @@
 #define MAST_H
 
 #include <stdint.h>
+#include <stdio.h>
 #include <sys/types.h>
 #include <sys/time.h>
 
@@ -48,6 +49,46 @@
 
 // ------- Network Sockets ---------
 
+#define MAST_SOCKET_MAX_BATCH       (64)
+#define MAST_SOCKET_GRO_BUFFER_LEN  (65535)
+#define MAST_SOCKET_CONTROL_LEN     (256)
+#define MAST_SOCKET_GSO_MAX_SEGMENTS (64)
+#define MAST_SOCKET_GSO_MAX_LEN     (65000)
+#define MAST_SOCKET_MAX_SOURCES     (8)
+#define MAST_SOCKET_BUSY_POLL_USEC  (50)
+
+// Packet capture ring: 64 blocks of 256KB, retired after 1ms if not full
+#define MAST_CAPTURE_BLOCK_SIZE     (1 << 18)
+#define MAST_CAPTURE_BLOCK_COUNT    (64)
+#define MAST_CAPTURE_FRAME_SIZE     (2048)
+#define MAST_CAPTURE_BLOCK_TIMEOUT  (1)
+
+// io_uring receive: a pool of provided buffers, one datagram in each
+#define MAST_URING_QUEUE_DEPTH      (8)
+#define MAST_URING_BUFFER_COUNT     (256)
+#define MAST_URING_BUFFER_SIZE      (2048)
+
+typedef enum {
+    MAST_SOURCE_FILTER_NONE,
+    MAST_SOURCE_FILTER_INCLUDE,   // Only receive from the listed sources
+    MAST_SOURCE_FILTER_EXCLUDE    // Receive from any source except those listed
+} mast_source_filter_mode;
+
+typedef struct
+{
+    int mode;
+    int count;
+    char addresses[MAST_SOCKET_MAX_SOURCES][INET6_ADDRSTRLEN];
+} mast_source_filter_t;
+
+typedef struct
+{
+    struct sockaddr_storage group;
+    int source_filter_mode;
+    int source_count;
+    struct sockaddr_storage sources[MAST_SOCKET_MAX_SOURCES];
+} mast_socket_group_t;
+
 typedef struct
 {
     int fd;
@@ -62,25 +103,449 @@ typedef struct
         struct ip_mreq imr;
     };
 
+    // Multicast groups joined, kept so they can be joined again if the interface comes back
+    char ifname[IFNAMSIZ];
+    mast_socket_group_t *groups;
+    int group_count;
+
+    // Set once a second group is joined with mast_socket_join_group()
+    int pktinfo;
+
+    // UDP Generic Receive Offload: coalesced datagrams waiting to be split
+    uint8_t *gro_buffer;
+    unsigned int gro_len;
+    unsigned int gro_offset;
+    unsigned int gro_segment;
+    uint64_t gro_arrival_ns;
+    uint64_t gro_arrival_hw_ns;
+    struct sockaddr_storage gro_local_addr;
+
+    // Set when an event loop is waiting for the socket to become readable
+    int event_driven;
+
+    // Send runs of equal sized datagrams using UDP Segmentation Offload
+    int gso;
+
+    // Memory-mapped AF_PACKET ring, used instead of reading from fd
+    struct mast_capture_s *capture;
+
+    // io_uring with a multishot recvmsg, used instead of reading from fd
+    struct mast_uring_s *uring;
+
+    // NIC timestamping configuration to put back on close, if we changed it
+    int hw_timestamps;
+    int hw_saved_tx_type;
+    int hw_saved_rx_filter;
+
+    // Counters
+    uint64_t packet_count;
+    uint64_t syscall_count;
+
+    // Receive buffer statistics, updated by mast_socket_update_stats()
+    int recv_buffer_size;
+    uint32_t kernel_drops;      // Total packets dropped by the kernel
+    uint32_t queue_bytes;       // Bytes waiting in the receive queue
+    uint32_t queue_peak_bytes;
+
 } mast_socket_t;
 
+typedef struct
+{
+    void *data;
+    unsigned int len;   // Size of buffer before receiving, length of datagram after
+
+    uint64_t arrival_ns;      // Kernel receive time (CLOCK_REALTIME), or 0 if unknown
+    uint64_t arrival_hw_ns;   // Raw NIC hardware receive time, or 0 if unavailable
+
+    // Destination of a received datagram, or AF_UNSPEC unless IP_PKTINFO is enabled
+    struct sockaddr_storage local_addr;
+
+    // Where to send the datagram, or NULL to use the socket's destination
+    const struct sockaddr_storage *dest_addr;
+} mast_socket_datagram_t;
+
 
 int mast_socket_open_recv(mast_socket_t* sock, const char* address, const char* port, const char *ifname);
+int mast_socket_open_recv_filtered(mast_socket_t* sock, const char* address, const char* port, const char *ifname, const mast_source_filter_t *filter);
 int mast_socket_open_send(mast_socket_t* sock, const char* address, const char* port, const char *ifname);
+
+// Join another group on a socket bound to the wildcard address, and report
+// the destination address of each datagram received
+int mast_socket_join_group(mast_socket_t* sock, const char* address, const mast_source_filter_t *filter);
 int mast_socket_recv(mast_socket_t* sock, void* data, unsigned int len);
+int mast_socket_recv_batch(mast_socket_t* sock, mast_socket_datagram_t* datagrams, int count);
+int mast_socket_enable_gro(mast_socket_t* sock);
+int mast_socket_enable_busy_poll(mast_socket_t* sock, int usecs);
 int mast_socket_send(mast_socket_t* sock, void* data, unsigned int len);
+int mast_socket_send_batch(mast_socket_t* sock, mast_socket_datagram_t* datagrams, int count);
+int mast_socket_enable_gso(mast_socket_t* sock);
+int mast_socket_set_recv_buffer(mast_socket_t* sock, int size);
+int mast_socket_update_stats(mast_socket_t* sock);
+int mast_socket_enable_capture(mast_socket_t* sock);
+int mast_socket_enable_uring(mast_socket_t* sock);
+int mast_socket_recv_fd(mast_socket_t* sock);
+
+// Ask the NIC to timestamp every received packet; this changes the whole
+// interface (not just this socket) until the socket is closed
+int mast_socket_enable_hw_timestamps(mast_socket_t* sock);
+
+// Look the interface up again and join all the groups again
+int mast_socket_rejoin(mast_socket_t* sock);
 void mast_socket_close(mast_socket_t* sock);
 
+// Parse an Ethernet frame and find the UDP payload sent to dest; frame_dest may be NULL
+int mast_capture_parse_frame(const uint8_t *frame, unsigned int frame_len, const struct sockaddr_storage *dest, uint8_t **payload, unsigned int *payload_len, struct sockaddr_storage *frame_dest);
+
+// Received payloads point into the ring and are valid until the next receive
+int mast_capture_open(mast_socket_t *sock);
+int mast_capture_recv_batch(mast_socket_t *sock, mast_socket_datagram_t *datagrams, int count);
+int mast_capture_fd(mast_socket_t *sock);
+int mast_capture_update_stats(mast_socket_t *sock);
+void mast_capture_close(mast_socket_t *sock);
+
+// Extract receive timestamps and drop counts from the control messages of a received datagram
+void mast_socket_parse_control(mast_socket_t* sock, struct msghdr* msg, mast_socket_datagram_t* datagram);
+
+// Received payloads point into provided buffers and are valid until the next receive
+int mast_uring_open(mast_socket_t *sock);
+int mast_uring_recv_batch(mast_socket_t *sock, mast_socket_datagram_t *datagrams, int count);
+int mast_uring_fd(mast_socket_t *sock);
+void mast_uring_close(mast_socket_t *sock);
+
+
+// ------- Network Interfaces ---------
+
+#define MAST_INTERFACE_MIN_SIZE         (16)
+#define MAST_INTERFACE_NETLINK_BUFFER   (32768)
+
+typedef struct
+{
+    char name[IFNAMSIZ];            // Empty if the slot is unused
+    unsigned int index;             // 0 if the interface doesn't exist any more
+    unsigned int flags;             // IFF_UP, IFF_RUNNING, IFF_LOOPBACK etc.
+    struct sockaddr_storage addr4;  // AF_UNSPEC if there is no IPv4 address
+    struct sockaddr_storage addr6;  // A global address is preferred to a link-local one
+    int came_back;                  // Became usable since the last mast_interface_process()
+} mast_interface_t;
+
+// Find an interface by name, loading the table the first time
+const mast_interface_t* mast_interface_lookup(const char *name);
+
+// Choose a running interface with an address that isn't loopback or point-to-point
+const mast_interface_t* mast_interface_choose(sa_family_t family);
+
+// Find an interface in the table without loading it
+const mast_interface_t* mast_interface_get(const char *name);
+
+// Update the table from netlink messages; returns the number of interfaces that came back
+int mast_interface_parse_netlink(const void *buffer, size_t len);
+
+// File descriptor that becomes readable when interfaces change, or -1 if not monitored
+int mast_interface_monitor_fd();
+
+// Read interface changes and re-join groups on sockets whose interface came back
+void mast_interface_process();
+int mast_interface_watch_socket(mast_socket_t *sock);
+void mast_interface_unwatch_socket(mast_socket_t *sock);
+void mast_interface_free();
+
+
+// ------- Destination Address Demultiplexing ---------
+
+#define MAST_DEMUX_MIN_SIZE     (16)
+#define MAST_DEMUX_MAX_KEY      (17)    // Address family and an IPv6 address
+
+typedef struct
+{
+    uint8_t key[MAST_DEMUX_MAX_KEY];
+    void *value;        // NULL if the slot is empty
+} mast_demux_entry_t;
+
+// Open addressing hash table, keyed on a fixed number of bytes.
+// Only pointers are stored, so the state for each value stays where it is when the table grows.
+typedef struct
+{
+    mast_demux_entry_t *entries;
+    unsigned int size;
+    unsigned int count;
+    unsigned int key_size;
+} mast_demux_table_t;
+
+// Keyed on destination address
+typedef mast_demux_table_t mast_demux_t;
+
+int mast_demux_init(mast_demux_t *demux, unsigned int capacity);
+int mast_demux_add(mast_demux_t *demux, const struct sockaddr_storage *addr, void *session);
+void* mast_demux_lookup(mast_demux_t *demux, const struct sockaddr_storage *addr);
+void mast_demux_free(mast_demux_t *demux);
+
+// Keyed on RTP SSRC and Payload Type
+typedef mast_demux_table_t mast_source_demux_t;
+
+int mast_source_demux_init(mast_source_demux_t *demux, unsigned int capacity);
+int mast_source_demux_add(mast_source_demux_t *demux, uint32_t ssrc, uint8_t payload_type, void *source);
+void* mast_source_demux_lookup(mast_source_demux_t *demux, uint32_t ssrc, uint8_t payload_type);
+void mast_source_demux_free(mast_source_demux_t *demux);
+
+
+// ------- Event Loop ---------
+
+#define MAST_LOOP_MAX_EVENTS    (32)
+
+typedef void (*mast_loop_callback)(void *user_data);
+
+typedef struct
+{
+    int epoll_fd;
+    int busy_poll;    // Spin waiting for events rather than sleeping
+    int watching_interfaces;
+    struct mast_loop_source_s *sources;
+} mast_loop_t;
+
+// Creates the loop and routes SIGTERM/SIGINT/SIGHUP through it
+int mast_loop_init(mast_loop_t *loop);
+int mast_loop_add_socket(mast_loop_t *loop, mast_socket_t *sock, mast_loop_callback callback, void *user_data);
+int mast_loop_add_timer(mast_loop_t *loop, unsigned int period_ms, mast_loop_callback callback, void *user_data);
+void mast_loop_enable_busy_poll(mast_loop_t *loop);
+int mast_loop_run(mast_loop_t *loop);
+void mast_loop_close(mast_loop_t *loop);
+
+
+// ------- Vector Kernels ---------
+
+// Whether this CPU can run kernels that use each instruction set
+int mast_cpu_any();
+int mast_cpu_sse41();
+int mast_cpu_avx2();
+int mast_cpu_neon();
+
+// Tables of kernels are arrays of structs that start with these fields, in order of preference
+typedef struct {
+    const char *name;
+    int (*supported)();
+} mast_kernel_t;
+
+// Entries of a table that this CPU can run, best first; NULL after the last one
+const void* mast_kernel_get(const void *table, size_t count, size_t size, int index);
+const void* mast_kernel_lookup(const void *table, size_t count, size_t size, const char *name);
+
+
+// ------- Sample Format Conversion ---------
+
+// Integer samples are left-justified 32-bit; floating point samples are -1.0 to 1.0
+typedef struct {
+    const char *name;
+    int (*supported)();
+    int encoding;
+    int sample_bytes;
+    void (*decode)(const uint8_t *payload, int samples, int32_t *output);
+    void (*encode)(const int32_t *input, int samples, uint8_t *payload);
+    void (*to_float)(const int32_t *input, int count, float *output);
+    void (*from_float)(const float *input, int count, int32_t *output);
+} mast_codec_t;
+
+// Implementations of an encoding supported by this CPU, best first; NULL after the last one
+const mast_codec_t* mast_codec_get(int encoding, int index);
+
+// The best implementation of an encoding, or NULL (with an error) if it isn't supported
+const mast_codec_t* mast_codec_lookup(int encoding);
+
+// These return the number of frames/samples decoded, or the number of bytes encoded
+int mast_codec_decode_float(const mast_codec_t *codec, const uint8_t *payload, int samples, float *output);
+int mast_codec_encode_float(const mast_codec_t *codec, const float *input, int samples, uint8_t *payload);
+int mast_codec_decode_planar(const mast_codec_t *codec, const uint8_t *payload, int frames, int channels, int32_t **planes);
+int mast_codec_decode_planar_float(const mast_codec_t *codec, const uint8_t *payload, int frames, int channels, float **planes);
+int mast_codec_encode_planar(const mast_codec_t *codec, const int32_t * const *planes, int frames, int channels, uint8_t *payload);
+int mast_codec_encode_planar_float(const mast_codec_t *codec, const float * const *planes, int frames, int channels, uint8_t *payload);
+
 
 // ------- Audio Peak measurement ---------
 
 #define MAST_POWER_TO_DB(power)    (20.0f * log10f(power))
 
-void mast_peak_init(int channels);
-float mast_peak_read_and_reset(int channel);
-float mast_peak_read_and_reset_all();
-void mast_peak_process_l16(uint8_t* payload, int payload_length);
-void mast_peak_process_l24(uint8_t* payload, int payload_length);
+// Updates peaks[] with the highest magnitude seen on each channel (L24 is scaled to 32-bits)
+typedef void (*mast_peak_kernel_func_t)(const uint8_t *payload, int samples, int channels, uint32_t *peaks);
+
+// True-peak is measured by oversampling 4x with a 48-tap polyphase FIR filter (ITU-R BS.1770-4 Annex 2)
+#define MAST_TRUE_PEAK_PHASES      (4)
+#define MAST_TRUE_PEAK_TAPS        (12)     // In each phase
+#define MAST_TRUE_PEAK_LANES       (8)      // Channels are filtered in groups of this many
+
+// Updates peaks[] with the highest magnitude of the oversampled signal in each lane
+// input has TAPS-1 frames of history before the frames to filter, each of stride (a multiple of LANES) samples
+typedef void (*mast_true_peak_kernel_func_t)(const float *input, int frames, int stride, float *peaks);
+
+typedef struct {
+    const char *name;
+    int (*supported)();
+    mast_peak_kernel_func_t l16;
+    mast_peak_kernel_func_t l24;
+    mast_true_peak_kernel_func_t true_peak;
+} mast_peak_kernel_t;
+
+// Kernels supported by this CPU, best first; NULL after the last one
+const mast_peak_kernel_t* mast_peak_kernel_get(int index);
+const mast_peak_kernel_t* mast_peak_kernel_lookup(const char *name);
+
+// Peak meter for one stream; may be read and reset from a different thread to the one writing
+typedef struct {
+    int channel_count;
+    const mast_peak_kernel_t *kernel;
+
+    // Highest magnitude on each channel since the last read, scaled to 32-bits
+    uint32_t magnitudes[MAST_MAX_CHANNEL_COUNT];
+
+    // In true-peak mode, the last few samples of each channel are kept for the filter
+    int true_peak;
+    float history[(MAST_TRUE_PEAK_TAPS - 1) * MAST_MAX_CHANNEL_COUNT];
+} mast_peak_t;
+
+void mast_peak_init(mast_peak_t *peak, int channels);
+int mast_peak_set_kernel(mast_peak_t *peak, const char *name);
+const char* mast_peak_kernel_name(mast_peak_t *peak);
+void mast_peak_set_true_peak(mast_peak_t *peak, int enabled);
+float mast_peak_read_and_reset(mast_peak_t *peak, int channel);
+float mast_peak_read_and_reset_all(mast_peak_t *peak);
+void mast_peak_process_l16(mast_peak_t *peak, uint8_t* payload, int payload_length);
+void mast_peak_process_l24(mast_peak_t *peak, uint8_t* payload, int payload_length);
+void mast_peak_process_int32(mast_peak_t *peak, const int32_t *samples, int count);
+
+// Process a payload in any encoding that there is a codec for
+void mast_peak_process(mast_peak_t *peak, const mast_codec_t *codec, uint8_t* payload, int payload_length);
+
+
+// ------- Loudness measurement ---------
+
+// EBU R128 / ITU-R BS.1770-4: measured in 100ms steps
+#define MAST_LOUDNESS_STEP_MS           (100)
+#define MAST_LOUDNESS_MOMENTARY_STEPS   (4)         // 400ms
+#define MAST_LOUDNESS_SHORT_TERM_STEPS  (30)        // 3s
+
+// Gating blocks are kept for this long; after that the oldest are forgotten
+#define MAST_LOUDNESS_MAX_BLOCKS        (24 * 60 * 60 * (1000 / MAST_LOUDNESS_STEP_MS))
+
+#define MAST_LOUDNESS_LANES             (8)         // Channels are filtered in groups of this many
+#define MAST_POWER_TO_LUFS(power)       (-0.691f + 10.0f * log10f(power))
+
+// Two biquads (K-weighting), with the state of each lane stored after each other
+typedef struct {
+    float b0, b1, b2, a1, a2;
+} mast_biquad_t;
+
+// Applies the filters to input (frames of stride samples), adding the sum of squares of each lane to energy[]
+typedef void (*mast_loudness_kernel_func_t)(const mast_biquad_t *filters, float *state, const float *input, int frames, int stride, float *energy);
+
+typedef struct {
+    const char *name;
+    int (*supported)();
+    mast_loudness_kernel_func_t k_weight;
+} mast_loudness_kernel_t;
+
+// Kernels supported by this CPU, best first; NULL after the last one
+const mast_loudness_kernel_t* mast_loudness_kernel_get(int index);
+const mast_loudness_kernel_t* mast_loudness_kernel_lookup(const char *name);
+
+// Histogram of gating blocks above the absolute gate, in 0.1 LU steps up to +10 LUFS
+#define MAST_LOUDNESS_ABSOLUTE_GATE     (-70.0f)
+#define MAST_LOUDNESS_HISTOGRAM_BINS    (800)
+
+// A ring of the weighted mean square of gating blocks, so reading doesn't depend on their number
+typedef struct {
+    float *powers;
+    uint32_t size;
+    uint32_t count;
+    uint32_t next;
+
+    uint32_t histogram[MAST_LOUDNESS_HISTOGRAM_BINS];
+    double histogram_power[MAST_LOUDNESS_HISTOGRAM_BINS];
+} mast_loudness_blocks_t;
+
+int mast_loudness_blocks_init(mast_loudness_blocks_t *blocks, uint32_t size);
+void mast_loudness_blocks_add(mast_loudness_blocks_t *blocks, float power);
+void mast_loudness_blocks_clear(mast_loudness_blocks_t *blocks);
+void mast_loudness_blocks_free(mast_loudness_blocks_t *blocks);
+
+// Loudness meter for one stream; must be read from the same thread that processes audio
+typedef struct {
+    int channel_count;
+    int stride;
+    int step_frames;
+    const mast_loudness_kernel_t *kernel;
+
+    mast_biquad_t filters[2];
+    float state[4 * MAST_MAX_CHANNEL_COUNT];
+    float weights[MAST_MAX_CHANNEL_COUNT];
+
+    // Energy of each channel in the step so far
+    double energy[MAST_MAX_CHANNEL_COUNT];
+    int frames;
+
+    // Weighted mean square of the most recent steps
+    float steps[MAST_LOUDNESS_SHORT_TERM_STEPS];
+    uint64_t step_count;
+
+    mast_loudness_blocks_t momentary_blocks;    // For integrated loudness
+    mast_loudness_blocks_t short_term_blocks;   // For loudness range
+} mast_loudness_t;
+
+int mast_loudness_init(mast_loudness_t *loudness, int channels, int sample_rate);
+int mast_loudness_set_kernel(mast_loudness_t *loudness, const char *name);
+void mast_loudness_reset(mast_loudness_t *loudness);
+void mast_loudness_free(mast_loudness_t *loudness);
+
+// Samples are interleaved and left-justified
+void mast_loudness_process_int32(mast_loudness_t *loudness, const int32_t *samples, int count);
+void mast_loudness_process(mast_loudness_t *loudness, const mast_codec_t *codec, uint8_t* payload, int payload_length);
+
+// In LUFS, or -INFINITY if there isn't enough audio yet
+float mast_loudness_momentary(mast_loudness_t *loudness);
+float mast_loudness_short_term(mast_loudness_t *loudness);
+float mast_loudness_integrated(mast_loudness_t *loudness);
+
+// In LU
+float mast_loudness_range(mast_loudness_t *loudness);
+
+
+// ------- Shared Memory Meter Export ---------
+
+#define MAST_METER_SHM_DEFAULT_NAME     "/mast-meter"
+#define MAST_METER_SHM_MAGIC            (0x4D415354)    // "MAST"
+#define MAST_METER_SHM_VERSION          (1)
+#define MAST_METER_SHM_HOLD_MS          (1600)
+#define MAST_METER_SHM_READ_TRIES       (1000)
+
+// Layout of the shared memory segment, written by one meter and read by any number of other processes
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;                  // Of this structure
+    uint32_t sequence;              // Seqlock: odd while an update is being written
+
+    uint32_t channel_count;
+    uint32_t sample_rate;
+    uint32_t true_peak;             // Peaks are in dBTP rather than dBFS
+    uint32_t reserved;
+    uint64_t update_count;
+    uint64_t update_ns;             // Unix time of the last update
+
+    float peak[MAST_MAX_CHANNEL_COUNT];         // Highest level since the previous update, in dB
+    float hold[MAST_MAX_CHANNEL_COUNT];         // Highest level in the last MAST_METER_SHM_HOLD_MS
+    uint64_t hold_ns[MAST_MAX_CHANNEL_COUNT];   // Unix time each hold value was reached
+} mast_meter_shm_t;
+
+// Writer: creates (or replaces) the named segment
+mast_meter_shm_t* mast_meter_shm_create(const char *name, int channel_count, int sample_rate, int true_peak);
+
+// Publish the peak of each channel; does not make any system calls
+void mast_meter_shm_update(mast_meter_shm_t *shm, const float *peaks, uint64_t now_ns);
+void mast_meter_shm_destroy(mast_meter_shm_t *shm, const char *name);
+
+// Reader: maps an existing segment read-only
+mast_meter_shm_t* mast_meter_shm_open(const char *name);
+
+// Copy a consistent snapshot without blocking the writer; returns -1 if it kept changing
+int mast_meter_shm_read(const mast_meter_shm_t *shm, mast_meter_shm_t *snapshot);
+void mast_meter_shm_close(mast_meter_shm_t *shm);
 
 
 // ------- SAP packet handling ---------
@@ -138,6 +603,9 @@ typedef struct
 
     char ptp_gmid[24];         // a=ts-refclk
     uint64_t clock_offset;     // a=mediaclk
+    int has_clock_offset;      // a=mediaclk:direct was given
+
+    mast_source_filter_t source_filter;  // a=source-filter
 } mast_sdp_t;
 
 
@@ -158,6 +626,12 @@ void mast_sdp_set_encoding_name(mast_sdp_t *sdp, const char* encoding_name);
 
 #define RTP_MAX_PAYLOAD     (1440)
 #define RTP_HEADER_LENGTH   (12)
+#define RTP_VERSION         (2)
+
+// RFC 8285 header extension profiles
+#define RTP_EXTENSION_ONE_BYTE          (0xBEDE)
+#define RTP_EXTENSION_TWO_BYTE          (0x1000)
+#define RTP_EXTENSION_TWO_BYTE_MASK     (0xFFF0)
 
 typedef struct
 {
@@ -175,23 +649,357 @@ typedef struct
     uint16_t payload_length;
     uint8_t *payload;
 
+    // Header extension, if there is one
+    uint16_t extension_profile;
+    uint16_t extension_length;  // In bytes, not including the 4 byte extension header
+    uint8_t *extension_data;
+
+    uint64_t arrival_ns;
+    uint64_t arrival_hw_ns;
+    struct sockaddr_storage dest_addr;
+
+    // Set for packets allocated from a mast_packet_pool_t
+    struct mast_packet_pool_s *pool;
+    uint32_t refcount;
+
     uint16_t length;
     uint8_t buffer[1500];
 
 } mast_rtp_packet_t;
 
+// An element of an RFC 8285 header extension
+typedef struct
+{
+    uint8_t id;
+    uint8_t length;
+    const uint8_t *data;
+} mast_rtp_extension_t;
+
+// Returns -1 if the packet is not a valid RTP packet
 int mast_rtp_parse( mast_rtp_packet_t* packet );
+
+// Parse a packet held outside of packet->buffer; payload will point into data
+int mast_rtp_parse_data( mast_rtp_packet_t* packet, uint8_t* data, uint16_t length );
+
+// Parse the buffers of count packets; valid packets are moved to the start of the array
+// (keeping their order) and the number of valid packets is returned
+int mast_rtp_parse_batch( mast_rtp_packet_t** packets, int count );
+
+// Find up to max elements in the header extension; returns the number found or -1 if malformed
+int mast_rtp_extensions( const mast_rtp_packet_t* packet, mast_rtp_extension_t* elements, int max );
 int mast_rtp_recv( mast_socket_t* socket, mast_rtp_packet_t* packet );
 
+// Receive up to count packets; returns the number of valid packets received
+int mast_rtp_recv_batch( mast_socket_t* socket, mast_rtp_packet_t* packets, int count );
+
+// Receive up to count packets from the pool, each holding one reference
+int mast_rtp_recv_pooled( mast_socket_t* socket, struct mast_packet_pool_s* pool, mast_rtp_packet_t** packets, int count );
+
+// Send the buffers of up to count packets; returns the number sent
+int mast_rtp_send_batch( mast_socket_t* socket, mast_rtp_packet_t* packets, int count );
+
 // Return the duration of a packet in microseconds
 int mast_rtp_packet_duration(mast_rtp_packet_t* packet, mast_sdp_t* sdp);
 
 
 
+// ------- Packet Buffer Pool ---------
+
+#define MAST_PACKET_POOL_SIZE           (512)
+#define MAST_PACKET_POOL_ALIGN          (64)
+#define MAST_PACKET_POOL_HUGEPAGE_SIZE  (2 * 1024 * 1024)
+
+typedef struct mast_packet_pool_s mast_packet_pool_t;
+
+mast_packet_pool_t* mast_packet_pool_create(unsigned int count);
+void mast_packet_pool_free(mast_packet_pool_t *pool);
+
+// Returns a packet with one reference, or NULL if the pool is empty
+// Safe to call from any thread
+mast_rtp_packet_t* mast_packet_alloc(mast_packet_pool_t *pool);
+void mast_packet_ref(mast_rtp_packet_t *packet);
+
+// The packet goes back to the pool when the last reference is dropped
+void mast_packet_unref(mast_rtp_packet_t *packet);
+
+unsigned int mast_packet_pool_available(mast_packet_pool_t *pool);
+unsigned int mast_packet_pool_exhausted(mast_packet_pool_t *pool);
+
+
+
+// ------- Reception Statistics ---------
+
+#define MAST_STATS_MAX_SOURCES  (32)    // Must be a power of two
+#define MAST_STATS_SEQ_WINDOW   (128)   // Sequence numbers remembered, to spot duplicates
+
+typedef struct
+{
+    int in_use;
+    uint32_t ssrc;
+    uint8_t payload_type;
+
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t received;          // Packets counted towards loss (not duplicates)
+    uint64_t duplicates;
+    uint64_t reordered;
+    uint64_t invalid;           // Sequence number jumped too far
+    uint64_t resyncs;
+
+    // Sequence number state, from RFC 3550 A.1
+    uint16_t max_seq;
+    uint32_t cycles;
+    uint32_t base_seq;
+    uint32_t bad_seq;
+    uint64_t seen[MAST_STATS_SEQ_WINDOW / 64];
+
+    // Loss during the last interval, from RFC 3550 A.3
+    uint64_t expected_prior;
+    uint64_t received_prior;
+    uint8_t fraction_lost;      // Fixed point, out of 256
+
+    // Interarrival jitter, from RFC 3550 A.8
+    int has_transit;
+    int32_t transit;
+    uint32_t jitter;            // In timestamp units, scaled by 16
+
+    uint64_t last_arrival_ns;
+
+    // From the most recent RTCP Sender Report
+    uint64_t sr_count;
+    uint64_t sr_ntp;            // NTP time (32.32 fixed point)
+    uint32_t sr_rtp_timestamp;  // RTP timestamp corresponding to sr_ntp
+    uint32_t sr_packet_count;
+    uint32_t sr_octet_count;
+    uint64_t sr_arrival_ns;
+} mast_stats_source_t;
+
+typedef struct
+{
+    int clock_rate;
+    unsigned int count;
+    mast_stats_source_t sources[MAST_STATS_MAX_SOURCES];
+    uint64_t untracked;         // Packets from sources that didn't fit in the table
+} mast_stats_t;
+
+void mast_stats_init(mast_stats_t *stats, int clock_rate);
+
+// Returns the source that the packet was counted against, or NULL if the table is full
+mast_stats_source_t* mast_stats_add(mast_stats_t *stats, mast_rtp_packet_t *packet);
+mast_stats_source_t* mast_stats_lookup(mast_stats_t *stats, uint32_t ssrc);
+
+// Lookup a source, adding it if it isn't in the table yet
+mast_stats_source_t* mast_stats_get(mast_stats_t *stats, uint32_t ssrc);
+
+uint64_t mast_stats_expected(const mast_stats_source_t *source);
+int64_t mast_stats_lost(const mast_stats_source_t *source);
+
+// Calculates the fraction lost since the previous call, and starts a new interval
+uint8_t mast_stats_interval(mast_stats_source_t *source);
+
+// Returns the interarrival jitter, in timestamp units
+uint32_t mast_stats_jitter(const mast_stats_source_t *source);
+
+// Both of these start a new interval for each source
+void mast_stats_print(mast_stats_t *stats, FILE *stream);
+void mast_stats_print_json(mast_stats_t *stats, FILE *stream);
+
+
+// ------- RTCP packet handling ---------
+
+#define RTCP_PT_SR              (200)
+#define RTCP_PT_RR              (201)
+#define RTCP_PT_SDES            (202)
+#define RTCP_PT_BYE             (203)
+#define RTCP_SDES_CNAME         (1)
+#define RTCP_MAX_REPORT_BLOCKS  (31)
+#define RTCP_MAX_LENGTH         (1500)
+#define RTCP_REPORT_INTERVAL    (5)     // Seconds between Receiver Reports
+
+// Parse a compound RTCP packet, storing any Sender Reports against their source;
+// returns the number of Sender Reports found, or -1 if the packet is invalid
+int mast_rtcp_parse(mast_stats_t *stats, const uint8_t *data, int length, uint64_t arrival_ns);
+
+// Convert an RTP timestamp to NTP time, using the last Sender Report from the source
+int mast_rtcp_rtp_to_ntp(const mast_stats_source_t *source, uint32_t timestamp, int clock_rate, uint64_t *ntp);
+
+// Build a compound Receiver Report and SDES CNAME packet; returns its length in bytes
+int mast_rtcp_build_rr(mast_stats_t *stats, uint32_t ssrc, const char *cname, uint8_t *buffer, int buffer_len, uint64_t now_ns);
+
+
+
+// ------- Jitter Buffer ---------
+
+#define MAST_JITTER_SLOTS           (128)
+#define MAST_JITTER_MAX_DEPTH       (MAST_JITTER_SLOTS / 2)
+#define MAST_JITTER_DEFAULT_DEPTH   (4)
+
+typedef struct
+{
+    // Packets waiting to be released, indexed by sequence number
+    mast_rtp_packet_t *slots[MAST_JITTER_SLOTS];
+    int depth;                  // Number of packet times to wait for a missing packet
+    int count;
+
+    int started;
+    int flushing;
+    uint32_t ssrc;
+    uint16_t next_sequence;     // Next sequence number to be released
+    uint16_t newest_sequence;
+    int released_any;
+    uint32_t last_timestamp;    // Timestamp of the last packet released
+    int consecutive_late;
+
+    // First packet of a new stream, waiting for the old one to be released
+    mast_rtp_packet_t *restart;
+
+    // Counters
+    uint64_t received;
+    uint64_t released;
+    uint64_t late;              // Arrived after its place in the sequence had passed
+    uint64_t duplicate;
+    uint64_t lost;              // Never arrived
+    uint64_t resets;            // Sender changed SSRC or jumped in sequence
+} mast_jitter_t;
+
+void mast_jitter_init(mast_jitter_t *jitter, int depth);
+
+// Takes over the caller's reference to the packet; returns -1 if it was dropped
+int mast_jitter_add(mast_jitter_t *jitter, mast_rtp_packet_t *packet);
+
+// Returns the next packet in order (and its reference), or NULL if it is too early
+mast_rtp_packet_t* mast_jitter_pop(mast_jitter_t *jitter);
+
+// Returns the oldest packet waiting, without waiting for any missing before it
+mast_rtp_packet_t* mast_jitter_pop_early(mast_jitter_t *jitter);
+
+// Returns the oldest packet waiting if it arrived at least timeout_ns ago, so
+// that packets aren't held forever when a stream pauses or stops
+mast_rtp_packet_t* mast_jitter_pop_expired(mast_jitter_t *jitter, uint64_t now_ns, uint64_t timeout_ns);
+
+// Release everything still waiting, without waiting for missing packets
+void mast_jitter_flush(mast_jitter_t *jitter);
+void mast_jitter_free(mast_jitter_t *jitter);
+
+
+
+// ------- Low Latency Receiving ---------
+
+#define MAST_REALTIME_PRIORITY      (50)
+#define MAST_REALTIME_STACK_SIZE    (256 * 1024)
+
+// Bucket n counts latencies from 2^n up to 2^(n+1) nanoseconds
+#define MAST_LATENCY_BUCKETS        (32)
+
+typedef struct
+{
+    uint64_t buckets[MAST_LATENCY_BUCKETS];
+    uint64_t count;
+    uint64_t unknown;       // Packets without a kernel receive timestamp
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+} mast_latency_t;
+
+// Pin the calling thread to a CPU, run it under SCHED_FIFO and lock all memory
+int mast_realtime_enable(int cpu);
+
+// Touch every page of a buffer, so that using it later won't page fault
+void mast_prefault(void *buffer, size_t len);
+
+void mast_latency_init(mast_latency_t *latency);
+void mast_latency_add(mast_latency_t *latency, uint64_t latency_ns);
+
+// Record the time from the kernel receiving a packet until now
+void mast_latency_add_packet(mast_latency_t *latency, const mast_rtp_packet_t *packet);
+
+// Returns the upper bound of the bucket containing the given percentile (at most the maximum)
+uint64_t mast_latency_percentile(const mast_latency_t *latency, double percentile);
+void mast_latency_print(const mast_latency_t *latency);
+
+
+// ------- Media Clock ---------
+
+// Seconds that TAI is ahead of UTC (since the leap second at the start of 2017)
+#define MAST_TAI_UTC_OFFSET     (37)
+
+typedef struct
+{
+    int clock_rate;
+    uint32_t clock_offset;      // RTP timestamp at the PTP epoch
+    int direct;                 // Offset came from a=mediaclk:direct (RFC 7273)
+    int started;
+    uint32_t last_timestamp;
+    uint64_t extended;          // Media clock ticks since the PTP epoch, of the last timestamp
+} mast_clock_t;
+
+void mast_clock_init(mast_clock_t *media_clock, mast_sdp_t *sdp);
+
+// Returns the number of media clock ticks since the PTP epoch (1970-01-01 TAI)
+uint64_t mast_clock_extend(mast_clock_t *media_clock, uint32_t timestamp, uint64_t arrival_ns);
+
+uint64_t mast_clock_to_tai_ns(const mast_clock_t *media_clock, uint64_t extended);
+uint64_t mast_clock_to_utc_ns(const mast_clock_t *media_clock, uint64_t extended);
+
+
 // ------- Audio File Writing ---------
 
-SNDFILE *mast_writer_open(const char* format, mast_sdp_t *sdp);
-void mast_writer_write(SNDFILE *file, uint8_t* payload, int payload_length);
+SNDFILE *mast_writer_open(const char* format, mast_sdp_t *sdp, uint64_t utc_ns);
+void mast_writer_write(SNDFILE *file, const mast_codec_t *codec, uint8_t* payload, int payload_length);
+
+
+// ------- Gap Filling ---------
+
+// Gaps longer than this are treated as the stream restarting
+#define MAST_GAP_MAX_DURATION   (10)
+
+typedef enum {
+    MAST_GAP_NONE,      // Count gaps but don't fill them
+    MAST_GAP_ZERO,      // Fill with silence
+    MAST_GAP_REPEAT,    // Fill by repeating the last packet
+    MAST_GAP_MODE_MAX
+} mast_gap_mode_t;
+
+typedef struct
+{
+    int mode;
+    int frame_size;             // Bytes per frame (sample size x channels)
+    uint8_t silence;            // Byte value of a silent sample
+    uint32_t max_frames;
+
+    int started;
+    uint32_t ssrc;
+    uint32_t next_timestamp;    // Timestamp expected for the next packet
+
+    uint8_t last_payload[RTP_MAX_PAYLOAD];
+    int last_length;
+    int repeat_offset;
+
+    // Statistics
+    uint64_t frames_received;
+    uint64_t frames_inserted;
+    uint64_t gaps;
+    uint32_t largest_gap;       // In frames
+    uint64_t overlaps;          // Timestamp went backwards
+    uint64_t frames_dropped;    // Overlapping audio that was already written
+    uint64_t resyncs;           // Timestamp jumped too far to fill
+} mast_gap_t;
+
+int mast_gap_mode_lookup(const char* name);
+const char* mast_gap_mode_name(int mode);
+
+void mast_gap_init(mast_gap_t *gap, mast_sdp_t *sdp, int mode);
+
+// Returns the number of frames that need to be inserted before this packet,
+// or minus the number of frames at its start that were already written
+int64_t mast_gap_check(mast_gap_t *gap, mast_rtp_packet_t *packet);
+
+// Fills buffer with up to a packet's worth of the missing frames; returns number of bytes
+int mast_gap_conceal(mast_gap_t *gap, uint8_t *buffer, int64_t frames);
+
+// Keep a copy of the packet's audio, in case it needs repeating
+void mast_gap_remember(mast_gap_t *gap, mast_rtp_packet_t *packet);
+void mast_gap_print(mast_gap_t *gap);
 
 
 // ------- Utilities ---------
@@ -245,4 +1053,20 @@ int mast_directory_exists(const char* path);
 const char* mast_encoding_name(int encoding);
 int mast_encoding_lookup(const char* name);
 
+// Number of bytes each sample takes in an RTP payload (0 if not a fixed size)
+int mast_encoding_sample_bytes(int encoding);
+
+// Byte value for a silent sample
+uint8_t mast_encoding_silence(int encoding);
+
+// Seconds between 1900 (NTP epoch) and 1970 (Unix epoch)
+#define MAST_NTP_UNIX_OFFSET    (2208988800ULL)
+
+// Convert between NTP time (32.32 fixed point) and nanoseconds since 1970
+uint64_t mast_ntp_to_unix_ns(uint64_t ntp);
+uint64_t mast_unix_ns_to_ntp(uint64_t unix_ns);
+
+// Format nanoseconds since 1970 as an ISO 8601 date and time in UTC
+void mast_unix_ns_to_iso8601(uint64_t unix_ns, char *buffer, size_t buffer_len);
+
 #endif
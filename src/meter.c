@@ -12,25 +12,58 @@
 #include <unistd.h>
 #include <signal.h>
 #include <math.h>
+#include <time.h>
 
 #include "mast.h"
 #include "bytestoint.h"
 
+#define MAX_SOURCES  (16)
+
 enum meter_modes {
     METER_MODE_DPM,
-    METER_MODE_DB_ARRAY
+    METER_MODE_DB_ARRAY,
+    METER_MODE_LOUDNESS,
+    METER_MODE_SHM
 };
 
+// State for each sender (SSRC and Payload Type) in the group
+typedef struct
+{
+    uint32_t ssrc;
+    uint8_t payload_type;
+    int metered;
+} meter_source_t;
+
 // Globals
 const char * ifname = NULL;
+int use_capture = FALSE;
+int use_uring = FALSE;
+int use_hw_timestamps = FALSE;
+int recv_buffer_size = 0;
+int low_latency_cpu = -1;
+int show_latency = FALSE;
+mast_latency_t latency;
+mast_stats_t stats;
 mast_sdp_t sdp;
+mast_peak_t peak;
+mast_loudness_t loudness;
+mast_meter_shm_t *meter_shm = NULL;
+const char *shm_name = MAST_METER_SHM_DEFAULT_NAME;
+const mast_codec_t *codec = NULL;
 int period = 125;  // Update every 125ms
 int console_width = 79;
 int mode = METER_MODE_DPM;
+int true_peak = FALSE;
 
 int dpeak = 0;
 int dtime = 0;
 int decay_len = 0;
+int first_packet = TRUE;
+
+mast_packet_pool_t *pool = NULL;
+mast_source_demux_t sources_demux;
+meter_source_t *sources[MAX_SOURCES];
+int source_count = 0;
 
 
 static void usage()
@@ -45,12 +78,22 @@ static void usage()
     fprintf(stderr, "   -e <encoding>  Encoding (default %s)\n", mast_encoding_name(MAST_DEFAULT_ENCODING));
     fprintf(stderr, "   -c <channels>  Channel Count (default %d)\n", MAST_DEFAULT_CHANNEL_COUNT);
     fprintf(stderr, "   -P <milisecs>  Update period (default %dms)\n", period);
+    fprintf(stderr, "   -o <name>      Shared memory name for shm mode (default %s)\n", shm_name);
+    fprintf(stderr, "   -T             Measure true-peak (dBTP) rather than sample peak\n");
+    fprintf(stderr, "   -b <bytes>     Socket receive buffer size\n");
+    fprintf(stderr, "   -C             Receive from a memory-mapped packet capture ring\n");
+    fprintf(stderr, "   -U             Receive using io_uring\n");
+    fprintf(stderr, "   -N             Enable NIC hardware timestamps (changes the whole interface)\n");
+    fprintf(stderr, "   -L <cpu>       Low latency mode: busy poll at real-time priority on a CPU\n");
+    fprintf(stderr, "   -H             Display a receive latency histogram on exit\n");
     fprintf(stderr, "   -v             Verbose Logging\n");
     fprintf(stderr, "   -q             Quiet Logging\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Modes:\n");
     fprintf(stderr, "   dpm            Console Digital Peak Meter\n");
     fprintf(stderr, "   array          Array of dB values\n");
+    fprintf(stderr, "   loudness       EBU R128 loudness (LUFS) and loudness range\n");
+    fprintf(stderr, "   shm            Peak and hold levels published to POSIX shared memory\n");
 
     exit(EXIT_FAILURE);
 }
@@ -63,6 +106,10 @@ static int parse_meter_mode(const char* str)
         mode = METER_MODE_DPM;
     } else if (strcmp("array", str) == 0) {
         mode = METER_MODE_DB_ARRAY;
+    } else if (strcmp("loudness", str) == 0) {
+        mode = METER_MODE_LOUDNESS;
+    } else if (strcmp("shm", str) == 0) {
+        mode = METER_MODE_SHM;
     } else {
         mast_error("Unknown meter mode: %s", str);
         usage();
@@ -76,7 +123,7 @@ static void parse_opts(int argc, char **argv)
     int ch;
 
     // Parse the options/switches
-    while ((ch = getopt(argc, argv, "m:a:p:i:r:f:c:vq?h")) != -1) {
+    while ((ch = getopt(argc, argv, "m:a:p:i:r:f:c:P:o:b:TCUNL:Hvq?h")) != -1) {
         switch (ch) {
         case 'm':
             mode = parse_meter_mode(optarg);
@@ -100,6 +147,37 @@ static void parse_opts(int argc, char **argv)
         case 'c':
             sdp.channel_count = atoi(optarg);
             break;
+        case 'P':
+            period = atoi(optarg);
+            if (period < 1) {
+                mast_error("Invalid update period: %s", optarg);
+                usage();
+            }
+            break;
+        case 'o':
+            shm_name = optarg;
+            break;
+        case 'b':
+            recv_buffer_size = atoi(optarg);
+            break;
+        case 'T':
+            true_peak = TRUE;
+            break;
+        case 'C':
+            use_capture = TRUE;
+            break;
+        case 'U':
+            use_uring = TRUE;
+            break;
+        case 'N':
+            use_hw_timestamps = TRUE;
+            break;
+        case 'L':
+            low_latency_cpu = atoi(optarg);
+            break;
+        case 'H':
+            show_latency = TRUE;
+            break;
         case 'v':
             verbose = TRUE;
             break;
@@ -167,7 +245,7 @@ static int iec_26818_scale(float db, int width) {
 
 static void display_console_peak_meter(int width)
 {
-    float db = mast_peak_read_and_reset_all();
+    float db = mast_peak_read_and_reset_all(&peak);
     int size = iec_26818_scale(db, width);
     int i;
 
@@ -251,15 +329,44 @@ static void display_peak_db_array(int channel_count)
     for(channel=0; channel<channel_count; channel++) {
         if (channel != 0)
             printf(", ");
-        db = mast_peak_read_and_reset(channel);
+        db = mast_peak_read_and_reset(&peak, channel);
         printf("%3.3f", db);
     }
     printf("]\n");
 }
 
+static void display_loudness()
+{
+    printf("M: %6.1f  S: %6.1f  I: %6.1f LUFS  LRA: %4.1f LU\n",
+           mast_loudness_momentary(&loudness),
+           mast_loudness_short_term(&loudness),
+           mast_loudness_integrated(&loudness),
+           mast_loudness_range(&loudness));
+}
+
+static uint64_t realtime_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static void publish_peak_shm(int channel_count)
+{
+    float peaks[MAST_MAX_CHANNEL_COUNT];
+    int channel;
+
+    for(channel=0; channel<channel_count && channel<MAST_MAX_CHANNEL_COUNT; channel++) {
+        peaks[channel] = mast_peak_read_and_reset(&peak, channel);
+    }
+
+    mast_meter_shm_update(meter_shm, peaks, realtime_ns());
+}
+
 static void init_meter(int channel_count)
 {
-    mast_peak_init(channel_count);
+    mast_peak_init(&peak, channel_count);
+    mast_peak_set_true_peak(&peak, true_peak);
 
     switch(mode) {
     case METER_MODE_DPM:
@@ -271,6 +378,12 @@ static void init_meter(int channel_count)
     case METER_MODE_DB_ARRAY:
         // No initialisation required
         break;
+    case METER_MODE_LOUDNESS:
+        mast_loudness_init(&loudness, channel_count, sdp.sample_rate);
+        break;
+    case METER_MODE_SHM:
+        meter_shm = mast_meter_shm_create(shm_name, channel_count, sdp.sample_rate, true_peak);
+        break;
     }
 }
 
@@ -283,19 +396,131 @@ static void display_meter(int channel_count)
     case METER_MODE_DB_ARRAY:
         display_peak_db_array(channel_count);
         break;
+    case METER_MODE_LOUDNESS:
+        display_loudness();
+        break;
+    case METER_MODE_SHM:
+        if (meter_shm)
+            publish_peak_shm(channel_count);
+        break;
+    }
+}
+
+static meter_source_t* add_source(mast_rtp_packet_t *packet)
+{
+    meter_source_t *source;
+
+    if (source_count >= MAX_SOURCES)
+        return NULL;
+
+    source = calloc(1, sizeof(meter_source_t));
+    if (source == NULL) {
+        mast_error("Failed to allocate memory for source");
+        return NULL;
+    }
+
+    source->ssrc = packet->ssrc;
+    source->payload_type = packet->payload_type;
+
+    if (mast_source_demux_add(&sources_demux, packet->ssrc, packet->payload_type, source)) {
+        free(source);
+        return NULL;
+    }
+    sources[source_count++] = source;
+
+    if (!first_packet) {
+        mast_info("Not metering additional source: SSRC 0x%8.8x, Payload Type %u",
+                  source->ssrc, source->payload_type);
+        return source;
+    }
+
+    // Is the Payload Type what we were expecting?
+    if (sdp.payload_type == -1) {
+        mast_info("Payload type of first packet: %d", packet->payload_type);
+        mast_sdp_set_payload_type(&sdp, packet->payload_type);
+        stats.clock_rate = sdp.sample_rate;
+    } else if (sdp.payload_type != packet->payload_type) {
+        mast_warn("Ignoring source with unexpected Payload Type: %d", packet->payload_type);
+        return source;
+    }
+
+    codec = mast_codec_lookup(sdp.encoding);
+    if (codec == NULL) {
+        mast_warn("Ignoring source with unsupported encoding: %s", mast_encoding_name(sdp.encoding));
+        return source;
+    }
+
+    mast_info("Metering source: SSRC 0x%8.8x", source->ssrc);
+    source->metered = TRUE;
+    init_meter(sdp.channel_count);
+    first_packet = FALSE;
+
+    return source;
+}
+
+static void receive_packets(void *user_data)
+{
+    mast_socket_t *sock = user_data;
+    mast_rtp_packet_t *packets[MAST_SOCKET_MAX_BATCH];
+    int count, i;
+
+    count = mast_rtp_recv_pooled(sock, pool, packets, MAST_SOCKET_MAX_BATCH);
+    if (count < 0) {
+        running = FALSE;
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        mast_rtp_packet_t *packet = packets[i];
+        meter_source_t *source;
+
+        mast_stats_add(&stats, packet);
+        if (show_latency)
+            mast_latency_add_packet(&latency, packet);
+
+        source = mast_source_demux_lookup(&sources_demux, packet->ssrc, packet->payload_type);
+        if (source == NULL)
+            source = add_source(packet);
+
+        // Only one source is metered, rather than mixing them all together
+        if (source && source->metered) {
+            if (mode == METER_MODE_LOUDNESS) {
+                mast_loudness_process(&loudness, codec, packet->payload, packet->payload_length);
+            } else {
+                mast_peak_process(&peak, codec, packet->payload, packet->payload_length);
+            }
+        }
+        mast_packet_unref(packet);
+    }
+}
+
+static void display_timer(void *user_data)
+{
+    if (!first_packet) {
+        display_meter(sdp.channel_count);
     }
 }
 
 int main(int argc, char *argv[])
 {
     mast_socket_t sock;
-    int result;
-    unsigned int time = 0;
-    int first_packet = TRUE;
+    mast_loop_t loop;
+    int result, i;
 
     mast_sdp_set_defaults(&sdp);
     parse_opts(argc, argv);
-    setup_signal_hander();
+
+    result = mast_loop_init(&loop);
+    if (result) {
+        return EXIT_FAILURE;
+    }
+
+    // Every packet is written into memory that was allocated up front
+    pool = mast_packet_pool_create(MAST_PACKET_POOL_SIZE);
+    if (pool == NULL) {
+        mast_loop_close(&loop);
+        return EXIT_FAILURE;
+    }
 
     mast_info(
         "Receiving: %s [%s/%d/%d]",
@@ -303,44 +528,75 @@ int main(int argc, char *argv[])
         mast_encoding_name(sdp.encoding), sdp.sample_rate, sdp.channel_count
     );
 
-    result = mast_socket_open_recv(&sock, sdp.address, sdp.port, ifname);
+    result = mast_socket_open_recv_filtered(&sock, sdp.address, sdp.port, ifname, &sdp.source_filter);
     if (result) {
+        mast_loop_close(&loop);
         return EXIT_FAILURE;
     }
 
+    if (recv_buffer_size > 0) {
+        mast_socket_set_recv_buffer(&sock, recv_buffer_size);
+    }
 
-    // Make STDOUT unbuffered
-    setbuf(stdout, NULL);
+    if (use_capture && mast_socket_enable_capture(&sock)) {
+        mast_socket_close(&sock);
+        mast_loop_close(&loop);
+        return EXIT_FAILURE;
+    }
 
-    while(running) {
-        mast_rtp_packet_t packet;
+    if (use_uring && mast_socket_enable_uring(&sock)) {
+        mast_socket_close(&sock);
+        mast_loop_close(&loop);
+        return EXIT_FAILURE;
+    }
 
-        int result = mast_rtp_recv(&sock, &packet);
-        if (result < 0) break;
+    // Not fatal: the kernel's software timestamps are used instead
+    if (use_hw_timestamps) {
+        mast_socket_enable_hw_timestamps(&sock);
+    }
 
-        if (first_packet) {
-            // Is the Payload Type what we were expecting?
-            if (sdp.payload_type == -1) {
-                mast_info("Payload type of first packet: %d", packet.payload_type);
-                mast_sdp_set_payload_type(&sdp, packet.payload_type);
-            } else if (sdp.payload_type != packet.payload_type) {
-                mast_warn("Received unexpected Payload Type: %d", packet.payload_type);
-            }
+    if (low_latency_cpu >= 0) {
+        mast_socket_enable_busy_poll(&sock, MAST_SOCKET_BUSY_POLL_USEC);
+        mast_loop_enable_busy_poll(&loop);
+        mast_realtime_enable(low_latency_cpu);
+    }
 
-            init_meter(sdp.channel_count);
-            first_packet = FALSE;
-        }
+    mast_latency_init(&latency);
+    mast_stats_init(&stats, sdp.sample_rate);
 
-        mast_peak_process_l24(packet.payload, packet.payload_length);
+    if (mast_source_demux_init(&sources_demux, MAX_SOURCES)) {
+        mast_socket_close(&sock);
+        mast_loop_close(&loop);
+        return EXIT_FAILURE;
+    }
 
-        time += mast_rtp_packet_duration(&packet, &sdp);
-        if (time > (period * 1000)) {
-            display_meter(sdp.channel_count);
-            time = 0;
-        }
+    // Make STDOUT unbuffered
+    setbuf(stdout, NULL);
+
+    mast_loop_add_socket(&loop, &sock, receive_packets, &sock);
+    mast_loop_add_timer(&loop, period, display_timer, NULL);
+    mast_loop_run(&loop);
+
+    if (show_latency) {
+        mast_latency_print(&latency);
+    }
+
+    if (!quiet) {
+        mast_stats_print(&stats, stderr);
     }
 
     mast_socket_close(&sock);
+    mast_loop_close(&loop);
+    mast_packet_pool_free(pool);
+
+    for (i = 0; i < source_count; i++) {
+        free(sources[i]);
+    }
+    mast_source_demux_free(&sources_demux);
+    mast_loudness_free(&loudness);
+    if (meter_shm) {
+        mast_meter_shm_destroy(meter_shm, shm_name);
+    }
 
     return exit_code;
 }
@@ -0,0 +1,240 @@
+/*
+
+  meter_shm.c
+
+  Publishing meter readings in a POSIX shared memory segment, so that
+  any number of local processes (such as dashboards) can read them.
+
+  There is a single writer, which is never held up by the readers: a
+  sequence number (seqlock) is made odd before the readings change and
+  even again afterwards. A reader copies the readings and then checks
+  that the sequence number was even and didn't change while it did,
+  otherwise it tries again. Neither side makes any system calls once
+  the segment is mapped.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "config.h"
+#include "mast.h"
+
+#include <math.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(HAVE_SHM_OPEN) && defined(HAVE_SYS_MMAN_H)
+#define HAVE_POSIX_SHM
+#endif
+
+
+// Every field that changes is accessed atomically, as it may be read at the same time
+#define STORE(field, value)     do { __typeof__(field) _v = (value); __atomic_store(&(field), &_v, __ATOMIC_RELAXED); } while (0)
+#define LOAD(dest, field)       __atomic_load(&(field), &(dest), __ATOMIC_RELAXED)
+
+
+static uint32_t _begin_write(mast_meter_shm_t *shm)
+{
+    uint32_t sequence = __atomic_load_n(&shm->sequence, __ATOMIC_RELAXED);
+
+    // Odd, so readers know to try again; ordered before any of the changes
+    sequence |= 1;
+    __atomic_store_n(&shm->sequence, sequence, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    return sequence;
+}
+
+static void _end_write(mast_meter_shm_t *shm, uint32_t sequence)
+{
+    __atomic_store_n(&shm->sequence, sequence + 1, __ATOMIC_RELEASE);
+}
+
+mast_meter_shm_t* mast_meter_shm_create(const char *name, int channel_count, int sample_rate, int true_peak)
+{
+#ifdef HAVE_POSIX_SHM
+    mast_meter_shm_t *shm;
+    uint32_t sequence;
+    int fd, channel;
+
+    if (channel_count > MAST_MAX_CHANNEL_COUNT)
+        channel_count = MAST_MAX_CHANNEL_COUNT;
+
+    fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        mast_error("Failed to open shared memory %s: %s", name, strerror(errno));
+        return NULL;
+    }
+
+    if (ftruncate(fd, sizeof(mast_meter_shm_t))) {
+        mast_error("Failed to set the size of shared memory %s: %s", name, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    shm = mmap(NULL, sizeof(mast_meter_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        mast_error("Failed to map shared memory %s: %s", name, strerror(errno));
+        return NULL;
+    }
+
+    // Readers may still have the segment mapped from a previous run
+    sequence = _begin_write(shm);
+    STORE(shm->magic, MAST_METER_SHM_MAGIC);
+    STORE(shm->version, MAST_METER_SHM_VERSION);
+    STORE(shm->size, sizeof(mast_meter_shm_t));
+    STORE(shm->channel_count, channel_count);
+    STORE(shm->sample_rate, sample_rate);
+    STORE(shm->true_peak, true_peak ? 1 : 0);
+    STORE(shm->update_count, 0);
+    STORE(shm->update_ns, 0);
+    for (channel = 0; channel < MAST_MAX_CHANNEL_COUNT; channel++) {
+        STORE(shm->peak[channel], -INFINITY);
+        STORE(shm->hold[channel], -INFINITY);
+        STORE(shm->hold_ns[channel], 0);
+    }
+    _end_write(shm, sequence);
+
+    mast_info("Publishing meter readings to shared memory: %s", name);
+    return shm;
+#else
+    mast_error("Shared memory is not supported on this platform");
+    return NULL;
+#endif
+}
+
+void mast_meter_shm_update(mast_meter_shm_t *shm, const float *peaks, uint64_t now_ns)
+{
+    uint64_t hold_len = (uint64_t)MAST_METER_SHM_HOLD_MS * 1000000;
+    uint32_t sequence;
+    int channel;
+
+    sequence = _begin_write(shm);
+
+    // Only this process writes, so it can read back its own values without care
+    for (channel = 0; channel < (int)shm->channel_count; channel++) {
+        STORE(shm->peak[channel], peaks[channel]);
+
+        // Hold the highest level, until it is too old
+        if (!(peaks[channel] < shm->hold[channel]) || now_ns - shm->hold_ns[channel] > hold_len) {
+            STORE(shm->hold[channel], peaks[channel]);
+            STORE(shm->hold_ns[channel], now_ns);
+        }
+    }
+    STORE(shm->update_ns, now_ns);
+    STORE(shm->update_count, shm->update_count + 1);
+
+    _end_write(shm, sequence);
+}
+
+void mast_meter_shm_destroy(mast_meter_shm_t *shm, const char *name)
+{
+#ifdef HAVE_POSIX_SHM
+    munmap(shm, sizeof(mast_meter_shm_t));
+    shm_unlink(name);
+#endif
+}
+
+mast_meter_shm_t* mast_meter_shm_open(const char *name)
+{
+#ifdef HAVE_POSIX_SHM
+    mast_meter_shm_t *shm;
+    struct stat st;
+    int fd;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        mast_error("Failed to open shared memory %s: %s", name, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(mast_meter_shm_t)) {
+        mast_error("Shared memory %s is not a meter", name);
+        close(fd);
+        return NULL;
+    }
+
+    shm = mmap(NULL, sizeof(mast_meter_shm_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        mast_error("Failed to map shared memory %s: %s", name, strerror(errno));
+        return NULL;
+    }
+
+    if (shm->magic != MAST_METER_SHM_MAGIC || shm->version != MAST_METER_SHM_VERSION) {
+        mast_error("Shared memory %s is not a version %d meter", name, MAST_METER_SHM_VERSION);
+        munmap(shm, sizeof(mast_meter_shm_t));
+        return NULL;
+    }
+
+    return shm;
+#else
+    mast_error("Shared memory is not supported on this platform");
+    return NULL;
+#endif
+}
+
+static void _copy(mast_meter_shm_t *dest, const mast_meter_shm_t *src)
+{
+    int channel;
+
+    LOAD(dest->magic, src->magic);
+    LOAD(dest->version, src->version);
+    LOAD(dest->size, src->size);
+    LOAD(dest->channel_count, src->channel_count);
+    LOAD(dest->sample_rate, src->sample_rate);
+    LOAD(dest->true_peak, src->true_peak);
+    LOAD(dest->update_count, src->update_count);
+    LOAD(dest->update_ns, src->update_ns);
+    dest->reserved = 0;
+
+    for (channel = 0; channel < MAST_MAX_CHANNEL_COUNT; channel++) {
+        LOAD(dest->peak[channel], src->peak[channel]);
+        LOAD(dest->hold[channel], src->hold[channel]);
+        LOAD(dest->hold_ns[channel], src->hold_ns[channel]);
+    }
+}
+
+int mast_meter_shm_read(const mast_meter_shm_t *shm, mast_meter_shm_t *snapshot)
+{
+    int tries;
+
+    for (tries = 0; tries < MAST_METER_SHM_READ_TRIES; tries++) {
+        uint32_t before = __atomic_load_n(&shm->sequence, __ATOMIC_ACQUIRE);
+
+        // An update is being written
+        if (before & 1)
+            continue;
+
+        _copy(snapshot, shm);
+
+        // Check that nothing changed while copying
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->sequence, __ATOMIC_RELAXED) == before) {
+            snapshot->sequence = before;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+void mast_meter_shm_close(mast_meter_shm_t *shm)
+{
+#ifdef HAVE_POSIX_SHM
+    munmap((void*)shm, sizeof(mast_meter_shm_t));
+#endif
+}
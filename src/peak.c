@@ -7,123 +7,244 @@
 */
 
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #include "mast.h"
 #include "bytestoint.h"
 
+// Size of the buffer that samples are copied into, after the history, for the true-peak filter
+#define TRUE_PEAK_WORK_SAMPLES     (4096)
 
-// Globals
-static int channel_count = 0;
 
-// Peak value for each channel in dB
-static float peaks[MAST_MAX_CHANNEL_COUNT];
+int mast_peak_set_kernel(mast_peak_t *peak, const char *name)
+{
+    const mast_peak_kernel_t *found = mast_peak_kernel_lookup(name);
+
+    if (found == NULL) {
+        mast_warn("Peak kernel is not available: %s", name);
+        return -1;
+    }
 
+    peak->kernel = found;
+    return 0;
+}
 
-void mast_peak_init(int channels)
+const char* mast_peak_kernel_name(mast_peak_t *peak)
 {
-    int channel;
+    return peak->kernel ? peak->kernel->name : NULL;
+}
 
-    channel_count = channels;
-    for(channel=0; channel<MAST_MAX_CHANNEL_COUNT; channel++) {
-        peaks[channel] = -INFINITY;
+void mast_peak_set_true_peak(mast_peak_t *peak, int enabled)
+{
+    peak->true_peak = enabled;
+    memset(peak->history, 0, sizeof(peak->history));
+}
+
+void mast_peak_init(mast_peak_t *peak, int channels)
+{
+    memset(peak, 0, sizeof(mast_peak_t));
+
+    peak->kernel = mast_peak_kernel_get(0);
+    mast_debug("Using %s peak kernel", peak->kernel->name);
+
+    if (channels > MAST_MAX_CHANNEL_COUNT) {
+        mast_warn("Only measuring the peaks of the first %d channels", MAST_MAX_CHANNEL_COUNT);
+        channels = MAST_MAX_CHANNEL_COUNT;
     }
+
+    peak->channel_count = channels;
+}
+
+// Convert a magnitude (scaled to 32-bits) to decibels; zero is -INFINITY
+static float magnitude_to_db(uint32_t magnitude)
+{
+    return MAST_POWER_TO_DB((float)magnitude / 0x80000000);
 }
 
-float mast_peak_read_and_reset(int channel)
+float mast_peak_read_and_reset(mast_peak_t *peak, int channel)
 {
-    float value = peaks[channel];
-    peaks[channel] = -INFINITY;
+    // Read and reset in one step, so nothing written in between is lost
+    uint32_t magnitude = __atomic_exchange_n(&peak->magnitudes[channel], 0, __ATOMIC_RELAXED);
 
-    return value;
+    return magnitude_to_db(magnitude);
 }
 
-float mast_peak_read_and_reset_all()
+float mast_peak_read_and_reset_all(mast_peak_t *peak)
 {
-    float peak = -INFINITY;
+    uint32_t highest = 0;
     int channel;
 
-    for(channel=0; channel<channel_count; channel++) {
-        if (peak < peaks[channel]) {
-            peak = peaks[channel];
+    for(channel=0; channel<peak->channel_count; channel++) {
+        uint32_t magnitude = __atomic_exchange_n(&peak->magnitudes[channel], 0, __ATOMIC_RELAXED);
+        if (highest < magnitude) {
+            highest = magnitude;
         }
-        peaks[channel] = -INFINITY;
     }
 
-    return peak;
+    return magnitude_to_db(highest);
 }
 
-void mast_peak_process_l16(uint8_t* payload, int payload_length)
+// Raise the shared peak values, without losing a reset from another thread
+static void update(mast_peak_t *peak, const uint32_t *packet_peaks, int shift)
 {
-    int16_t peaks_int[MAST_MAX_CHANNEL_COUNT];
-    int channel = 0;
-    int byte;
+    int channel;
 
-    if (payload_length % 2 != 0) {
-        mast_warn("payload length is not a multiple of 2");
-    }
+    for(channel=0; channel<peak->channel_count; channel++) {
+        uint32_t magnitude = packet_peaks[channel] << shift;
+        uint32_t current = __atomic_load_n(&peak->magnitudes[channel], __ATOMIC_RELAXED);
 
-    for(channel=0; channel < channel_count; channel++) {
-        peaks_int[channel] = 0;
+        while (magnitude > current) {
+            if (__atomic_compare_exchange_n(&peak->magnitudes[channel], &current, magnitude,
+                                            TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
     }
+}
 
-    // Convert samples to 16-bit integers and find highest value for each channel
-    channel = 0;
-    for(byte=0; byte < payload_length; byte += 2) {
-        int16_t i = abs(bytesToInt16(&payload[byte]));
-        if (i > peaks_int[channel]) {
-            peaks_int[channel] = i;
+static void process(mast_peak_t *peak, mast_peak_kernel_func_t func, uint8_t* payload, int samples, int shift)
+{
+    uint32_t packet_peaks[MAST_MAX_CHANNEL_COUNT];
+
+    if (peak->channel_count <= 0)
+        return;
+
+    memset(packet_peaks, 0, sizeof(packet_peaks[0]) * peak->channel_count);
+    func(payload, samples, peak->channel_count, packet_peaks);
+    update(peak, packet_peaks, shift);
+}
+
+// Channels are padded out to a whole number of kernel lanes
+static int true_peak_stride(int channels)
+{
+    return (channels + MAST_TRUE_PEAK_LANES - 1) & ~(MAST_TRUE_PEAK_LANES - 1);
+}
+
+static void process_true_peak(mast_peak_t *peak, const int32_t *samples, int frames)
+{
+    float work[TRUE_PEAK_WORK_SAMPLES];
+    float peaks[MAST_MAX_CHANNEL_COUNT];
+    uint32_t packet_peaks[MAST_MAX_CHANNEL_COUNT];
+    int channels = peak->channel_count;
+    int stride = true_peak_stride(channels);
+    int history_len = (MAST_TRUE_PEAK_TAPS - 1) * stride;
+    int chunk_frames = (TRUE_PEAK_WORK_SAMPLES - history_len) / stride;
+    int done, count, frame, channel;
+
+    // The padding lanes are never written, so they stay silent
+    if (stride != channels)
+        memset(work, 0, sizeof(work));
+    memset(peaks, 0, sizeof(peaks[0]) * stride);
+    memcpy(work, peak->history, sizeof(float) * history_len);
+
+    for (done = 0; done < frames; done += count) {
+        count = frames - done;
+        if (count > chunk_frames)
+            count = chunk_frames;
+
+        for (frame = 0; frame < count; frame++) {
+            const int32_t *input = &samples[(done + frame) * channels];
+            float *output = &work[history_len + frame * stride];
+            for (channel = 0; channel < channels; channel++)
+                output[channel] = (float)input[channel] * (1.0f / 2147483648.0f);
         }
 
-        // Move on to the next channel
-        channel++;
-        if (channel >= channel_count)
-            channel = 0;
+        peak->kernel->true_peak(work, count, stride, peaks);
+
+        // The newest samples are the history for the next chunk
+        memmove(work, &work[count * stride], sizeof(float) * history_len);
     }
 
-    // Convert peak integers to floating-point decibels
-    for(channel=0; channel<channel_count; channel++) {
-        float db = MAST_POWER_TO_DB((float)peaks_int[channel] / 0x8000);
-        if (db > peaks[channel]) {
-            peaks[channel] = db;
+    memcpy(peak->history, work, sizeof(float) * history_len);
+
+    // Scaled to 32-bits; there is headroom for overs of up to +6dB
+    for (channel = 0; channel < channels; channel++) {
+        if (peaks[channel] >= 2.0f) {
+            packet_peaks[channel] = UINT32_MAX;
+        } else {
+            packet_peaks[channel] = (uint32_t)(peaks[channel] * 2147483648.0f);
         }
     }
+
+    update(peak, packet_peaks, 0);
 }
 
-void mast_peak_process_l24(uint8_t* payload, int payload_length)
+void mast_peak_process_l16(mast_peak_t *peak, uint8_t* payload, int payload_length)
 {
-    int peaks_int[MAST_MAX_CHANNEL_COUNT];
-    int channel = 0;
-    int byte;
+    if (payload_length % 2 != 0) {
+        mast_warn("payload length is not a multiple of 2");
+    }
+
+    if (peak->true_peak) {
+        mast_peak_process(peak, mast_codec_get(MAST_ENCODING_L16, 0), payload, payload_length);
+        return;
+    }
+
+    process(peak, peak->kernel->l16, payload, payload_length / 2, 16);
+}
 
+void mast_peak_process_l24(mast_peak_t *peak, uint8_t* payload, int payload_length)
+{
     if (payload_length % 3 != 0) {
         mast_warn("payload length is not a multiple of 3");
     }
 
-    for(channel=0; channel < channel_count; channel++) {
-        peaks_int[channel] = 0;
+    if (peak->true_peak) {
+        mast_peak_process(peak, mast_codec_get(MAST_ENCODING_L24, 0), payload, payload_length);
+        return;
+    }
+
+    process(peak, peak->kernel->l24, payload, payload_length / 3, 0);
+}
+
+void mast_peak_process_int32(mast_peak_t *peak, const int32_t *samples, int count)
+{
+    uint32_t packet_peaks[MAST_MAX_CHANNEL_COUNT];
+    int channel = 0;
+    int i;
+
+    if (peak->channel_count <= 0)
+        return;
+
+    if (peak->true_peak) {
+        process_true_peak(peak, samples, count / peak->channel_count);
+        return;
     }
 
-    // Convert samples to 32-bit integers and find highest value for each channel
-    channel = 0;
-    for(byte=0; byte < payload_length; byte += 3) {
-        int i = abs(bytesToInt24(&payload[byte]));
-        if (i > peaks_int[channel]) {
-            peaks_int[channel] = i;
+    memset(packet_peaks, 0, sizeof(packet_peaks[0]) * peak->channel_count);
+    for(i=0; i < count; i++) {
+        uint32_t magnitude = samples[i] < 0 ? -(uint32_t)samples[i] : (uint32_t)samples[i];
+        if (magnitude > packet_peaks[channel]) {
+            packet_peaks[channel] = magnitude;
         }
 
         // Move on to the next channel
-        channel++;
-        if (channel >= channel_count)
+        if (++channel >= peak->channel_count)
             channel = 0;
     }
 
-    // Convert peak integers to floating-point decibels
-    for(channel=0; channel<channel_count; channel++) {
-        float db = MAST_POWER_TO_DB((float)peaks_int[channel] / 0x80000000);
-        if (db > peaks[channel]) {
-            peaks[channel] = db;
+    update(peak, packet_peaks, 0);
+}
+
+void mast_peak_process(mast_peak_t *peak, const mast_codec_t *codec, uint8_t* payload, int payload_length)
+{
+    int32_t samples[RTP_MAX_PAYLOAD];
+    int count;
+
+    // The sample peak kernels work directly on the common linear encodings
+    if (!peak->true_peak) {
+        if (codec->encoding == MAST_ENCODING_L16) {
+            mast_peak_process_l16(peak, payload, payload_length);
+            return;
+        } else if (codec->encoding == MAST_ENCODING_L24) {
+            mast_peak_process_l24(peak, payload, payload_length);
+            return;
         }
     }
-}
 
+    count = payload_length / codec->sample_bytes;
+    if (count > RTP_MAX_PAYLOAD)
+        count = RTP_MAX_PAYLOAD;
+    codec->decode(payload, count, samples);
+    mast_peak_process_int32(peak, samples, count);
+}
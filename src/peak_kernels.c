@@ -0,0 +1,519 @@
+/*
+
+  peak_kernels.c
+
+  Kernels that find the highest absolute sample value of each channel
+  in a payload of interleaved big-endian L16 or L24 audio. The vector
+  versions byte-swap a register full of samples at a time; because the
+  channel of each lane repeats every few registers, they keep one
+  running maximum for each register position in that cycle and only
+  sort the lanes into channels at the end.
+
+  The true-peak kernels run the ITU-R BS.1770 oversampling filter on
+  floating point samples. Each lane of a register is a different
+  channel, so a group of channels is filtered together with the same
+  instructions as a single channel would be.
+
+  The kernel is chosen at run time, from the ones that the CPU supports.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "config.h"
+#include "mast.h"
+#include "bytestoint.h"
+#include "kernels.h"
+
+#include <math.h>
+#include <string.h>
+
+
+static void _peak_l16_from(const uint8_t *payload, int start, int samples, int channels, uint32_t *peaks)
+{
+    int channel = start % channels;
+    int i;
+
+    for (i = start; i < samples; i++) {
+        int32_t value = bytesToInt16(&payload[i * 2]);
+        uint32_t magnitude = value < 0 ? -value : value;
+        if (magnitude > peaks[channel])
+            peaks[channel] = magnitude;
+
+        // Move on to the next channel
+        if (++channel >= channels)
+            channel = 0;
+    }
+}
+
+static void _peak_l24_from(const uint8_t *payload, int start, int samples, int channels, uint32_t *peaks)
+{
+    int channel = start % channels;
+    int i;
+
+    for (i = start; i < samples; i++) {
+        // Scaled up to 32-bits, so full scale negative is 0x80000000
+        int32_t value = bytesToInt24(&payload[i * 3]);
+        uint32_t magnitude = value < 0 ? -(uint32_t)value : (uint32_t)value;
+        if (magnitude > peaks[channel])
+            peaks[channel] = magnitude;
+
+        if (++channel >= channels)
+            channel = 0;
+    }
+}
+
+static void _peak_l16_scalar(const uint8_t *payload, int samples, int channels, uint32_t *peaks)
+{
+    _peak_l16_from(payload, 0, samples, channels, peaks);
+}
+
+static void _peak_l24_scalar(const uint8_t *payload, int samples, int channels, uint32_t *peaks)
+{
+    _peak_l24_from(payload, 0, samples, channels, peaks);
+}
+
+// ITU-R BS.1770-4 Annex 2: coefficients of each phase of the 4x oversampling filter
+static const float true_peak_coefficients[MAST_TRUE_PEAK_PHASES][MAST_TRUE_PEAK_TAPS] = {
+    {
+        0.0017089843750f, 0.0109863281250f, -0.0196533203125f, 0.0332031250000f,
+        -0.0594482421875f, 0.1373291015625f, 0.9721679687500f, -0.1022949218750f,
+        0.0476074218750f, -0.0266113281250f, 0.0148925781250f, -0.0083007812500f
+    },
+    {
+        -0.0291748046875f, 0.0292968750000f, -0.0517578125000f, 0.0891113281250f,
+        -0.1665039062500f, 0.4650878906250f, 0.7797851562500f, -0.2003173828125f,
+        0.1015625000000f, -0.0582275390625f, 0.0330810546875f, -0.0189208984375f
+    },
+    {
+        -0.0189208984375f, 0.0330810546875f, -0.0582275390625f, 0.1015625000000f,
+        -0.2003173828125f, 0.7797851562500f, 0.4650878906250f, -0.1665039062500f,
+        0.0891113281250f, -0.0517578125000f, 0.0292968750000f, -0.0291748046875f
+    },
+    {
+        -0.0083007812500f, 0.0148925781250f, -0.0266113281250f, 0.0476074218750f,
+        -0.1022949218750f, 0.9721679687500f, 0.1373291015625f, -0.0594482421875f,
+        0.0332031250000f, -0.0196533203125f, 0.0109863281250f, 0.0017089843750f
+    }
+};
+
+static void _true_peak_scalar(const float *input, int frames, int stride, float *peaks)
+{
+    int frame, lane, phase, tap;
+
+    for (frame = 0; frame < frames; frame++) {
+        // Tap 0 is the newest sample
+        const float *newest = &input[(frame + MAST_TRUE_PEAK_TAPS - 1) * stride];
+
+        for (lane = 0; lane < stride; lane++) {
+            for (phase = 0; phase < MAST_TRUE_PEAK_PHASES; phase++) {
+                float sum = 0.0f;
+
+                for (tap = 0; tap < MAST_TRUE_PEAK_TAPS; tap++)
+                    sum += true_peak_coefficients[phase][tap] * newest[lane - tap * stride];
+
+                sum = fabsf(sum);
+                if (sum > peaks[lane])
+                    peaks[lane] = sum;
+            }
+        }
+    }
+}
+
+#if defined(HAVE_X86_KERNELS) || defined(HAVE_NEON_KERNELS)
+
+// Number of registers before the channel of each lane repeats
+static int _period(int channels, int lanes)
+{
+    int a = channels, b = lanes;
+
+    while (b) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return channels / a;
+}
+
+// Sort the lanes of the running maximums into channels
+static void _gather_u16(const uint16_t *lanes, int lane_count, int period, int channels, uint32_t *peaks)
+{
+    int i;
+
+    for (i = 0; i < period * lane_count; i++) {
+        int channel = i % channels;
+        if (lanes[i] > peaks[channel])
+            peaks[channel] = lanes[i];
+    }
+}
+
+static void _gather_u32(const uint32_t *lanes, int lane_count, int period, int channels, uint32_t *peaks)
+{
+    int i;
+
+    for (i = 0; i < period * lane_count; i++) {
+        int channel = i % channels;
+        if (lanes[i] > peaks[channel])
+            peaks[channel] = lanes[i];
+    }
+}
+
+#endif
+
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("sse4.1")))
+static void _peak_l16_sse41(const uint8_t *payload, int samples, int channels, uint32_t *peaks)
+{
+    const __m128i swap = _mm_set_epi8(14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+    __m128i acc[MAST_MAX_CHANNEL_COUNT];
+    uint16_t lanes[MAST_MAX_CHANNEL_COUNT * 8];
+    int period = _period(channels, 8);
+    int vectors = samples / 8;
+    int i, p = 0;
+
+    // Not worth it unless each running maximum sees a few registers
+    if (vectors < period * 2) {
+        _peak_l16_scalar(payload, samples, channels, peaks);
+        return;
+    }
+
+    for (i = 0; i < period; i++)
+        acc[i] = _mm_setzero_si128();
+
+    for (i = 0; i < vectors; i++) {
+        __m128i x = _mm_loadu_si128((const __m128i*)&payload[i * 16]);
+        // abs(-32768) stays 0x8000, which is right when treated as unsigned
+        x = _mm_abs_epi16(_mm_shuffle_epi8(x, swap));
+        acc[p] = _mm_max_epu16(acc[p], x);
+        if (++p == period)
+            p = 0;
+    }
+
+    for (i = 0; i < period; i++)
+        _mm_storeu_si128((__m128i*)&lanes[i * 8], acc[i]);
+    _gather_u16(lanes, 8, period, channels, peaks);
+    _peak_l16_from(payload, vectors * 8, samples, channels, peaks);
+}
+
+__attribute__((target("sse4.1")))
+static void _peak_l24_sse41(const uint8_t *payload, int samples, int channels, uint32_t *peaks)
+{
+    // Three bytes of each sample into the top of a 32-bit lane
+    const __m128i shuffle = _mm_set_epi8(9, 10, 11, -1, 6, 7, 8, -1, 3, 4, 5, -1, 0, 1, 2, -1);
+    __m128i acc[MAST_MAX_CHANNEL_COUNT];
+    uint32_t lanes[MAST_MAX_CHANNEL_COUNT * 4];
+    int period = _period(channels, 4);
+    int bytes = samples * 3;
+    int vectors = samples / 4;
+    int i, p = 0;
+
+    // Each load of 16 bytes only uses 12 of them; don't read past the end
+    if (bytes < 16) {
+        vectors = 0;
+    } else if (vectors > (bytes - 4) / 12) {
+        vectors = (bytes - 4) / 12;
+    }
+
+    if (vectors < period * 2) {
+        _peak_l24_scalar(payload, samples, channels, peaks);
+        return;
+    }
+
+    for (i = 0; i < period; i++)
+        acc[i] = _mm_setzero_si128();
+
+    for (i = 0; i < vectors; i++) {
+        __m128i x = _mm_loadu_si128((const __m128i*)&payload[i * 12]);
+        x = _mm_abs_epi32(_mm_shuffle_epi8(x, shuffle));
+        acc[p] = _mm_max_epu32(acc[p], x);
+        if (++p == period)
+            p = 0;
+    }
+
+    for (i = 0; i < period; i++)
+        _mm_storeu_si128((__m128i*)&lanes[i * 4], acc[i]);
+    _gather_u32(lanes, 4, period, channels, peaks);
+    _peak_l24_from(payload, vectors * 4, samples, channels, peaks);
+}
+
+__attribute__((target("avx2")))
+static void _peak_l16_avx2(const uint8_t *payload, int samples, int channels, uint32_t *peaks)
+{
+    const __m256i swap = _mm256_set_epi8(
+                             14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1,
+                             14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+    __m256i acc[MAST_MAX_CHANNEL_COUNT];
+    uint16_t lanes[MAST_MAX_CHANNEL_COUNT * 16];
+    int period = _period(channels, 16);
+    int vectors = samples / 16;
+    int i, p = 0;
+
+    if (vectors < period * 2) {
+        _peak_l16_sse41(payload, samples, channels, peaks);
+        return;
+    }
+
+    for (i = 0; i < period; i++)
+        acc[i] = _mm256_setzero_si256();
+
+    for (i = 0; i < vectors; i++) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)&payload[i * 32]);
+        x = _mm256_abs_epi16(_mm256_shuffle_epi8(x, swap));
+        acc[p] = _mm256_max_epu16(acc[p], x);
+        if (++p == period)
+            p = 0;
+    }
+
+    for (i = 0; i < period; i++)
+        _mm256_storeu_si256((__m256i*)&lanes[i * 16], acc[i]);
+    _gather_u16(lanes, 16, period, channels, peaks);
+    _peak_l16_from(payload, vectors * 16, samples, channels, peaks);
+}
+
+__attribute__((target("avx2")))
+static void _peak_l24_avx2(const uint8_t *payload, int samples, int channels, uint32_t *peaks)
+{
+    // The shuffle works within each 128-bit half, so load each half separately
+    const __m256i shuffle = _mm256_set_epi8(
+                                9, 10, 11, -1, 6, 7, 8, -1, 3, 4, 5, -1, 0, 1, 2, -1,
+                                9, 10, 11, -1, 6, 7, 8, -1, 3, 4, 5, -1, 0, 1, 2, -1);
+    __m256i acc[MAST_MAX_CHANNEL_COUNT];
+    uint32_t lanes[MAST_MAX_CHANNEL_COUNT * 8];
+    int period = _period(channels, 8);
+    int bytes = samples * 3;
+    int vectors = samples / 8;
+    int i, p = 0;
+
+    // Eight samples are 24 bytes, but the second load reads up to byte 28
+    if (bytes < 28) {
+        vectors = 0;
+    } else if (vectors > (bytes - 4) / 24) {
+        vectors = (bytes - 4) / 24;
+    }
+
+    if (vectors < period * 2) {
+        _peak_l24_sse41(payload, samples, channels, peaks);
+        return;
+    }
+
+    for (i = 0; i < period; i++)
+        acc[i] = _mm256_setzero_si256();
+
+    for (i = 0; i < vectors; i++) {
+        __m128i lo = _mm_loadu_si128((const __m128i*)&payload[i * 24]);
+        __m128i hi = _mm_loadu_si128((const __m128i*)&payload[i * 24 + 12]);
+        __m256i x = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        x = _mm256_abs_epi32(_mm256_shuffle_epi8(x, shuffle));
+        acc[p] = _mm256_max_epu32(acc[p], x);
+        if (++p == period)
+            p = 0;
+    }
+
+    for (i = 0; i < period; i++)
+        _mm256_storeu_si256((__m256i*)&lanes[i * 8], acc[i]);
+    _gather_u32(lanes, 8, period, channels, peaks);
+    _peak_l24_from(payload, vectors * 8, samples, channels, peaks);
+}
+
+__attribute__((target("sse4.1")))
+static void _true_peak_sse41(const float *input, int frames, int stride, float *peaks)
+{
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    int lane, frame, tap;
+
+    // Four channels at a time, keeping their peaks in a register
+    for (lane = 0; lane < stride; lane += 4) {
+        __m128 peak = _mm_loadu_ps(&peaks[lane]);
+
+        for (frame = 0; frame < frames; frame++) {
+            const float *newest = &input[(frame + MAST_TRUE_PEAK_TAPS - 1) * stride + lane];
+            __m128 y0 = _mm_setzero_ps(), y1 = _mm_setzero_ps();
+            __m128 y2 = _mm_setzero_ps(), y3 = _mm_setzero_ps();
+
+            for (tap = 0; tap < MAST_TRUE_PEAK_TAPS; tap++) {
+                __m128 x = _mm_loadu_ps(newest - tap * stride);
+                y0 = _mm_add_ps(y0, _mm_mul_ps(_mm_set1_ps(true_peak_coefficients[0][tap]), x));
+                y1 = _mm_add_ps(y1, _mm_mul_ps(_mm_set1_ps(true_peak_coefficients[1][tap]), x));
+                y2 = _mm_add_ps(y2, _mm_mul_ps(_mm_set1_ps(true_peak_coefficients[2][tap]), x));
+                y3 = _mm_add_ps(y3, _mm_mul_ps(_mm_set1_ps(true_peak_coefficients[3][tap]), x));
+            }
+
+            peak = _mm_max_ps(peak, _mm_andnot_ps(sign, y0));
+            peak = _mm_max_ps(peak, _mm_andnot_ps(sign, y1));
+            peak = _mm_max_ps(peak, _mm_andnot_ps(sign, y2));
+            peak = _mm_max_ps(peak, _mm_andnot_ps(sign, y3));
+        }
+
+        _mm_storeu_ps(&peaks[lane], peak);
+    }
+}
+
+__attribute__((target("avx2")))
+static void _true_peak_avx2(const float *input, int frames, int stride, float *peaks)
+{
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    int lane, frame, tap;
+
+    for (lane = 0; lane < stride; lane += 8) {
+        __m256 peak = _mm256_loadu_ps(&peaks[lane]);
+
+        for (frame = 0; frame < frames; frame++) {
+            const float *newest = &input[(frame + MAST_TRUE_PEAK_TAPS - 1) * stride + lane];
+            __m256 y0 = _mm256_setzero_ps(), y1 = _mm256_setzero_ps();
+            __m256 y2 = _mm256_setzero_ps(), y3 = _mm256_setzero_ps();
+
+                    for (tap = 0; tap < MAST_TRUE_PEAK_TAPS; tap++) {
+                __m256 x = _mm256_loadu_ps(newest - tap * stride);
+                y0 = _mm256_add_ps(y0, _mm256_mul_ps(_mm256_broadcast_ss(&true_peak_coefficients[0][tap]), x));
+                y1 = _mm256_add_ps(y1, _mm256_mul_ps(_mm256_broadcast_ss(&true_peak_coefficients[1][tap]), x));
+                y2 = _mm256_add_ps(y2, _mm256_mul_ps(_mm256_broadcast_ss(&true_peak_coefficients[2][tap]), x));
+                y3 = _mm256_add_ps(y3, _mm256_mul_ps(_mm256_broadcast_ss(&true_peak_coefficients[3][tap]), x));
+            }
+
+            peak = _mm256_max_ps(peak, _mm256_andnot_ps(sign, y0));
+            peak = _mm256_max_ps(peak, _mm256_andnot_ps(sign, y1));
+            peak = _mm256_max_ps(peak, _mm256_andnot_ps(sign, y2));
+            peak = _mm256_max_ps(peak, _mm256_andnot_ps(sign, y3));
+        }
+
+        _mm256_storeu_ps(&peaks[lane], peak);
+    }
+}
+
+#endif
+
+
+#ifdef HAVE_NEON_KERNELS
+
+static void _peak_l16_neon(const uint8_t *payload, int samples, int channels, uint32_t *peaks)
+{
+    uint16x8_t acc[MAST_MAX_CHANNEL_COUNT];
+    uint16_t lanes[MAST_MAX_CHANNEL_COUNT * 8];
+    int period = _period(channels, 8);
+    int vectors = samples / 8;
+    int i, p = 0;
+
+    if (vectors < period * 2) {
+        _peak_l16_scalar(payload, samples, channels, peaks);
+        return;
+    }
+
+    for (i = 0; i < period; i++)
+        acc[i] = vdupq_n_u16(0);
+
+    for (i = 0; i < vectors; i++) {
+        int16x8_t x = vreinterpretq_s16_u8(vrev16q_u8(vld1q_u8(&payload[i * 16])));
+        acc[p] = vmaxq_u16(acc[p], vreinterpretq_u16_s16(vabsq_s16(x)));
+        if (++p == period)
+            p = 0;
+    }
+
+    for (i = 0; i < period; i++)
+        vst1q_u16(&lanes[i * 8], acc[i]);
+    _gather_u16(lanes, 8, period, channels, peaks);
+    _peak_l16_from(payload, vectors * 8, samples, channels, peaks);
+}
+
+static void _peak_l24_neon(const uint8_t *payload, int samples, int channels, uint32_t *peaks)
+{
+    // Out of range indexes give zero
+    static const uint8_t shuffle_bytes[16] = {
+        255, 2, 1, 0, 255, 5, 4, 3, 255, 8, 7, 6, 255, 11, 10, 9
+    };
+    const uint8x16_t shuffle = vld1q_u8(shuffle_bytes);
+    uint32x4_t acc[MAST_MAX_CHANNEL_COUNT];
+    uint32_t lanes[MAST_MAX_CHANNEL_COUNT * 4];
+    int period = _period(channels, 4);
+    int bytes = samples * 3;
+    int vectors = samples / 4;
+    int i, p = 0;
+
+    if (bytes < 16) {
+        vectors = 0;
+    } else if (vectors > (bytes - 4) / 12) {
+        vectors = (bytes - 4) / 12;
+    }
+
+    if (vectors < period * 2) {
+        _peak_l24_scalar(payload, samples, channels, peaks);
+        return;
+    }
+
+    for (i = 0; i < period; i++)
+        acc[i] = vdupq_n_u32(0);
+
+    for (i = 0; i < vectors; i++) {
+        int32x4_t x = vreinterpretq_s32_u8(vqtbl1q_u8(vld1q_u8(&payload[i * 12]), shuffle));
+        acc[p] = vmaxq_u32(acc[p], vreinterpretq_u32_s32(vabsq_s32(x)));
+        if (++p == period)
+            p = 0;
+    }
+
+    for (i = 0; i < period; i++)
+        vst1q_u32(&lanes[i * 4], acc[i]);
+    _gather_u32(lanes, 4, period, channels, peaks);
+    _peak_l24_from(payload, vectors * 4, samples, channels, peaks);
+}
+
+static void _true_peak_neon(const float *input, int frames, int stride, float *peaks)
+{
+    int lane, frame, tap;
+
+    for (lane = 0; lane < stride; lane += 4) {
+        float32x4_t peak = vld1q_f32(&peaks[lane]);
+
+        for (frame = 0; frame < frames; frame++) {
+            const float *newest = &input[(frame + MAST_TRUE_PEAK_TAPS - 1) * stride + lane];
+            float32x4_t y0 = vdupq_n_f32(0.0f), y1 = vdupq_n_f32(0.0f);
+            float32x4_t y2 = vdupq_n_f32(0.0f), y3 = vdupq_n_f32(0.0f);
+
+            for (tap = 0; tap < MAST_TRUE_PEAK_TAPS; tap++) {
+                float32x4_t x = vld1q_f32(newest - tap * stride);
+                y0 = vaddq_f32(y0, vmulq_n_f32(x, true_peak_coefficients[0][tap]));
+                y1 = vaddq_f32(y1, vmulq_n_f32(x, true_peak_coefficients[1][tap]));
+                y2 = vaddq_f32(y2, vmulq_n_f32(x, true_peak_coefficients[2][tap]));
+                y3 = vaddq_f32(y3, vmulq_n_f32(x, true_peak_coefficients[3][tap]));
+            }
+
+            peak = vmaxq_f32(peak, vabsq_f32(y0));
+            peak = vmaxq_f32(peak, vabsq_f32(y1));
+            peak = vmaxq_f32(peak, vabsq_f32(y2));
+            peak = vmaxq_f32(peak, vabsq_f32(y3));
+        }
+
+        vst1q_f32(&peaks[lane], peak);
+    }
+}
+
+#endif
+
+
+// In order of preference
+static const mast_peak_kernel_t kernels[] = {
+#ifdef HAVE_X86_KERNELS
+    { "avx2", mast_cpu_avx2, _peak_l16_avx2, _peak_l24_avx2, _true_peak_avx2 },
+    { "sse4.1", mast_cpu_sse41, _peak_l16_sse41, _peak_l24_sse41, _true_peak_sse41 },
+#endif
+#ifdef HAVE_NEON_KERNELS
+    { "neon", mast_cpu_neon, _peak_l16_neon, _peak_l24_neon, _true_peak_neon },
+#endif
+    { "scalar", mast_cpu_any, _peak_l16_scalar, _peak_l24_scalar, _true_peak_scalar },
+};
+
+#define KERNEL_COUNT    (sizeof(kernels) / sizeof(kernels[0]))
+
+
+const mast_peak_kernel_t* mast_peak_kernel_get(int index)
+{
+    return mast_kernel_get(kernels, KERNEL_COUNT, sizeof(kernels[0]), index);
+}
+
+const mast_peak_kernel_t* mast_peak_kernel_lookup(const char *name)
+{
+    return mast_kernel_lookup(kernels, KERNEL_COUNT, sizeof(kernels[0]), name);
+}
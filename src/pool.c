@@ -0,0 +1,222 @@
+/*
+
+  pool.c
+
+  Pool of preallocated RTP packets with reference counting, so that
+  a received packet can be passed between stages (and threads)
+  without copying it, and without allocating memory per packet.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "config.h"
+#include "mast.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+// The free list head holds a slot number (plus one, so zero means empty)
+// in the low 32 bits and a counter in the high 32 bits, which stops a
+// compare-and-swap succeeding if the list changed and changed back (ABA)
+#define POOL_HEAD_SLOT(head)    ((uint32_t)((head) & 0xFFFFFFFF))
+#define POOL_HEAD_TAG(head)     ((uint32_t)((head) >> 32))
+#define POOL_HEAD(tag, slot)    (((uint64_t)(tag) << 32) | (uint32_t)(slot))
+
+struct mast_packet_pool_s
+{
+    uint8_t *memory;
+    size_t memory_len;
+    int hugepages;      // Memory was mapped using MAP_HUGETLB
+    int mapped;         // Memory was mapped, rather than allocated with malloc
+
+    size_t slot_size;
+    unsigned int count;
+
+    uint32_t *next;     // Next free slot (plus one) for each slot
+    uint64_t head;
+
+    unsigned int exhausted;
+};
+
+
+static size_t _round_up(size_t len, size_t multiple)
+{
+    return ((len + multiple - 1) / multiple) * multiple;
+}
+
+static int _allocate_memory(mast_packet_pool_t *pool, size_t len)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+    void *memory;
+
+#ifdef MAP_HUGETLB
+    // Needs huge pages reserved in /proc/sys/vm/nr_hugepages
+    pool->memory_len = _round_up(len, MAST_PACKET_POOL_HUGEPAGE_SIZE);
+    memory = mmap(NULL, pool->memory_len, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (memory != MAP_FAILED) {
+        mast_debug("Packet pool is using huge pages");
+        pool->memory = memory;
+        pool->hugepages = TRUE;
+        pool->mapped = TRUE;
+        return 0;
+    }
+    mast_debug("Huge pages not available for packet pool: %s", strerror(errno));
+#endif
+
+    pool->memory_len = len;
+    memory = mmap(NULL, pool->memory_len, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+        // Transparent huge pages are the next best thing
+        madvise(memory, pool->memory_len, MADV_HUGEPAGE);
+#endif
+        pool->memory = memory;
+        pool->mapped = TRUE;
+        return 0;
+    }
+#endif
+
+    pool->memory_len = len;
+    if (posix_memalign((void**)&pool->memory, MAST_PACKET_POOL_ALIGN, len)) {
+        pool->memory = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+mast_packet_pool_t* mast_packet_pool_create(unsigned int count)
+{
+    mast_packet_pool_t *pool;
+    unsigned int i;
+
+    pool = calloc(1, sizeof(mast_packet_pool_t));
+    if (pool == NULL) {
+        mast_error("Failed to allocate memory for packet pool");
+        return NULL;
+    }
+
+    pool->count = count;
+    pool->slot_size = _round_up(sizeof(mast_rtp_packet_t), MAST_PACKET_POOL_ALIGN);
+    pool->next = calloc(count, sizeof(uint32_t));
+    if (pool->next == NULL || _allocate_memory(pool, pool->slot_size * count)) {
+        mast_error("Failed to allocate memory for packet pool");
+        free(pool->next);
+        free(pool);
+        return NULL;
+    }
+
+    // Writing to every slot now means no page faults later
+    for (i = 0; i < count; i++) {
+        mast_rtp_packet_t *packet = (mast_rtp_packet_t*)(pool->memory + (i * pool->slot_size));
+        memset(packet, 0, pool->slot_size);
+        packet->pool = pool;
+        pool->next[i] = (i + 1 < count) ? i + 2 : 0;
+    }
+    pool->head = POOL_HEAD(0, count > 0 ? 1 : 0);
+
+    mast_debug("Created pool of %u packets (%u bytes each)", count, (unsigned int)pool->slot_size);
+
+    return pool;
+}
+
+mast_rtp_packet_t* mast_packet_alloc(mast_packet_pool_t *pool)
+{
+    uint64_t head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+    uint64_t new_head;
+    uint32_t slot;
+
+    do {
+        slot = POOL_HEAD_SLOT(head);
+        if (slot == 0) {
+            __atomic_fetch_add(&pool->exhausted, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+
+        // If another thread takes this slot first, the tag will have changed
+        new_head = POOL_HEAD(POOL_HEAD_TAG(head) + 1,
+                             __atomic_load_n(&pool->next[slot - 1], __ATOMIC_RELAXED));
+    } while (!__atomic_compare_exchange_n(&pool->head, &head, new_head, TRUE,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    {
+        mast_rtp_packet_t *packet = (mast_rtp_packet_t*)(pool->memory + ((slot - 1) * pool->slot_size));
+        __atomic_store_n(&packet->refcount, 1, __ATOMIC_RELAXED);
+        return packet;
+    }
+}
+
+void mast_packet_ref(mast_rtp_packet_t *packet)
+{
+    if (packet->pool)
+        __atomic_fetch_add(&packet->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void mast_packet_unref(mast_rtp_packet_t *packet)
+{
+    mast_packet_pool_t *pool = packet->pool;
+    uint64_t head, new_head;
+    uint32_t slot;
+
+    // Packets that weren't allocated from a pool aren't counted
+    if (pool == NULL)
+        return;
+
+    if (__atomic_fetch_sub(&packet->refcount, 1, __ATOMIC_ACQ_REL) != 1)
+        return;
+
+    slot = (((uint8_t*)packet - pool->memory) / pool->slot_size) + 1;
+    head = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+    do {
+        __atomic_store_n(&pool->next[slot - 1], POOL_HEAD_SLOT(head), __ATOMIC_RELAXED);
+        new_head = POOL_HEAD(POOL_HEAD_TAG(head) + 1, slot);
+    } while (!__atomic_compare_exchange_n(&pool->head, &head, new_head, TRUE,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+unsigned int mast_packet_pool_available(mast_packet_pool_t *pool)
+{
+    uint32_t slot = POOL_HEAD_SLOT(__atomic_load_n(&pool->head, __ATOMIC_ACQUIRE));
+    unsigned int available = 0;
+
+    // Only accurate when no other thread is using the pool
+    while (slot != 0 && available < pool->count) {
+        slot = pool->next[slot - 1];
+        available++;
+    }
+
+    return available;
+}
+
+unsigned int mast_packet_pool_exhausted(mast_packet_pool_t *pool)
+{
+    return __atomic_load_n(&pool->exhausted, __ATOMIC_RELAXED);
+}
+
+void mast_packet_pool_free(mast_packet_pool_t *pool)
+{
+    if (pool == NULL)
+        return;
+
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+    if (pool->mapped) {
+        munmap(pool->memory, pool->memory_len);
+    } else
+#endif
+    {
+        free(pool->memory);
+    }
+
+    free(pool->next);
+    free(pool);
+}
@@ -0,0 +1,136 @@
+/*
+
+  realtime.c
+
+  Settings for receiving with the lowest possible latency: the
+  receiving thread is pinned to one CPU, given a real-time scheduling
+  priority and all of its memory is locked so it can't be paged out.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "config.h"
+#include "mast.h"
+
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SCHED_H
+#include <sched.h>
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+
+static int _set_affinity(int cpu)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus)) {
+        mast_warn("Failed to pin to CPU %d: %s", cpu, strerror(errno));
+        return -1;
+    }
+
+    mast_debug("Pinned to CPU %d", cpu);
+    return 0;
+#else
+    mast_warn("Setting CPU affinity is not supported on this platform");
+    return -1;
+#endif
+}
+
+static int _set_scheduler()
+{
+#ifdef HAVE_SCHED_SETSCHEDULER
+    struct sched_param param;
+
+    // Needs CAP_SYS_NICE or a high enough RLIMIT_RTPRIO
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = MAST_REALTIME_PRIORITY;
+    if (sched_setscheduler(0, SCHED_FIFO, &param)) {
+        mast_warn("Failed to set SCHED_FIFO scheduling: %s", strerror(errno));
+        return -1;
+    }
+
+    mast_debug("Using SCHED_FIFO scheduling at priority %d", param.sched_priority);
+    return 0;
+#else
+    mast_warn("Real-time scheduling is not supported on this platform");
+    return -1;
+#endif
+}
+
+static int _lock_memory()
+{
+#ifdef HAVE_MLOCKALL
+    // Lock what is mapped now and anything mapped later
+    if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+        mast_warn("Failed to lock memory: %s", strerror(errno));
+        return -1;
+    }
+
+    mast_debug("Locked process memory");
+    return 0;
+#else
+    mast_warn("Locking memory is not supported on this platform");
+    return -1;
+#endif
+}
+
+static void _prefault_stack()
+{
+    uint8_t stack[MAST_REALTIME_STACK_SIZE];
+
+    // Grow the stack now, rather than in the middle of receiving a packet
+    mast_prefault(stack, sizeof(stack));
+}
+
+int mast_realtime_enable(int cpu)
+{
+    int retval = 0;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+        mast_warn("Only one CPU is available, busy polling will starve other processes");
+#endif
+
+    // Carry on if any of these fail, the others still help
+    if (cpu >= 0 && _set_affinity(cpu))
+        retval = -1;
+    if (_set_scheduler())
+        retval = -1;
+    if (_lock_memory())
+        retval = -1;
+
+    _prefault_stack();
+
+    return retval;
+}
+
+void mast_prefault(void *buffer, size_t len)
+{
+    volatile uint8_t *bytes = buffer;
+    size_t page_size = 4096;
+    size_t i;
+
+#ifdef _SC_PAGESIZE
+    page_size = sysconf(_SC_PAGESIZE);
+#endif
+
+    // Write to each page, so that copy-on-write pages get copied too
+    for (i = 0; i < len; i += page_size) {
+        bytes[i] = bytes[i];
+    }
+}
@@ -11,15 +11,56 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
 
 #include "mast.h"
 
 #define SYNC_TO_DISC_PERIOD  (10)
+#define MAX_SOURCES          (16)
+#define JITTER_TIMER_PERIOD  (5)
+
+// State for each sender (SSRC and Payload Type) in the group
+typedef struct
+{
+    uint32_t ssrc;
+    uint8_t payload_type;
+    int ignored;
+    mast_sdp_t sdp;
+    mast_jitter_t jitter;
+    uint64_t jitter_timeout_ns; // Longest a packet waits for ones missing before it
+    mast_gap_t gap;
+    mast_clock_t media_clock;
+    const mast_codec_t *codec;
+    SNDFILE *file;
+    uint32_t first_timestamp;   // Of the first sample in the file
+    int start_reported;         // Wall clock time of the first sample is known
+} recorder_source_t;
 
 // Globals
 const char * ifname = NULL;
+int use_capture = FALSE;
+int use_uring = FALSE;
+int use_hw_timestamps = FALSE;
+int recv_buffer_size = 0;
+int low_latency_cpu = -1;
+int show_latency = FALSE;
+mast_latency_t latency;
+mast_stats_t stats;
+int jitter_depth = MAST_JITTER_DEFAULT_DEPTH;
+int gap_mode = MAST_GAP_ZERO;
 const char* filename = "recording-%Y%m%d-%H%M%S.wav";
 mast_sdp_t sdp;
+mast_packet_pool_t *pool = NULL;
+mast_source_demux_t sources_demux;
+recorder_source_t *sources[MAX_SOURCES];
+int source_count = 0;
+uint64_t untracked_packets = 0;
+int use_rtcp = FALSE;
+int send_reports = FALSE;
+mast_socket_t rtcp_sock;
+mast_socket_t rtcp_send_sock;
+uint32_t reporter_ssrc = 0;
+char cname[256];
 
 static void usage()
 {
@@ -32,6 +73,16 @@ static void usage()
     fprintf(stderr, "   -r <rate>      Sample Rate (default %d)\n", MAST_DEFAULT_SAMPLE_RATE);
     fprintf(stderr, "   -e <encoding>  Encoding (default %s)\n", mast_encoding_name(MAST_DEFAULT_ENCODING));
     fprintf(stderr, "   -c <channels>  Channel Count (default %d)\n", MAST_DEFAULT_CHANNEL_COUNT);
+    fprintf(stderr, "   -b <bytes>     Socket receive buffer size\n");
+    fprintf(stderr, "   -g <mode>      Fill missing audio with: none, zero or repeat (default %s)\n", mast_gap_mode_name(MAST_GAP_ZERO));
+    fprintf(stderr, "   -j <ptimes>    Packet times to wait for out of order packets (default %d)\n", MAST_JITTER_DEFAULT_DEPTH);
+    fprintf(stderr, "   -R             Receive RTCP Sender Reports (on port + 1)\n");
+    fprintf(stderr, "   -s             Receive RTCP and send Receiver Reports\n");
+    fprintf(stderr, "   -C             Receive from a memory-mapped packet capture ring\n");
+    fprintf(stderr, "   -U             Receive using io_uring\n");
+    fprintf(stderr, "   -N             Enable NIC hardware timestamps (changes the whole interface)\n");
+    fprintf(stderr, "   -L <cpu>       Low latency mode: busy poll at real-time priority on a CPU\n");
+    fprintf(stderr, "   -H             Display a receive latency histogram on exit\n");
     fprintf(stderr, "   -v             Verbose Logging\n");
     fprintf(stderr, "   -q             Quiet Logging\n");
 
@@ -43,7 +94,7 @@ static void parse_opts(int argc, char **argv)
     int ch;
 
     // Parse the options/switches
-    while ((ch = getopt(argc, argv, "o:a:p:i:r:f:c:vq?h")) != -1) {
+    while ((ch = getopt(argc, argv, "o:a:p:i:r:f:c:b:g:j:RsCUNL:Hvq?h")) != -1) {
         switch (ch) {
         case 'o':
             filename = optarg;
@@ -67,6 +118,38 @@ static void parse_opts(int argc, char **argv)
         case 'c':
             sdp.channel_count = atoi(optarg);
             break;
+        case 'b':
+            recv_buffer_size = atoi(optarg);
+            break;
+        case 'g':
+            gap_mode = mast_gap_mode_lookup(optarg);
+            if (gap_mode < 0) mast_error("Invalid gap filling mode: %s", optarg);
+            break;
+        case 'j':
+            jitter_depth = atoi(optarg);
+            break;
+        case 'R':
+            use_rtcp = TRUE;
+            break;
+        case 's':
+            use_rtcp = TRUE;
+            send_reports = TRUE;
+            break;
+        case 'C':
+            use_capture = TRUE;
+            break;
+        case 'U':
+            use_uring = TRUE;
+            break;
+        case 'N':
+            use_hw_timestamps = TRUE;
+            break;
+        case 'L':
+            low_latency_cpu = atoi(optarg);
+            break;
+        case 'H':
+            show_latency = TRUE;
+            break;
         case 'v':
             verbose = TRUE;
             break;
@@ -113,16 +196,422 @@ static int sync_sndfile(SNDFILE *sndfile)
 }
 
 
+static void source_filename(recorder_source_t *source, char *buffer, size_t buffer_len)
+{
+    const char *ext = strrchr(filename, '.');
+    const char *slash = strrchr(filename, '/');
+
+    if (source == sources[0]) {
+        snprintf(buffer, buffer_len, "%s", filename);
+        return;
+    }
+
+    // Other senders get their SSRC and Payload Type added before the file extension
+    if (ext == NULL || (slash && ext < slash))
+        ext = filename + strlen(filename);
+
+    snprintf(buffer, buffer_len, "%.*s-%8.8x-%u%s",
+             (int)(ext - filename), filename, source->ssrc, source->payload_type, ext);
+}
+
+static recorder_source_t* add_source(mast_rtp_packet_t *packet)
+{
+    recorder_source_t *source;
+    int duration;
+
+    if (source_count >= MAX_SOURCES) {
+        untracked_packets++;
+        return NULL;
+    }
+
+    source = calloc(1, sizeof(recorder_source_t));
+    if (source == NULL) {
+        mast_error("Failed to allocate memory for source");
+        return NULL;
+    }
+
+    source->ssrc = packet->ssrc;
+    source->payload_type = packet->payload_type;
+    source->sdp = sdp;
+    mast_jitter_init(&source->jitter, jitter_depth);
+
+    if (mast_source_demux_add(&sources_demux, packet->ssrc, packet->payload_type, source)) {
+        free(source);
+        return NULL;
+    }
+    sources[source_count++] = source;
+
+    mast_info("New source: SSRC 0x%8.8x, Payload Type %u", source->ssrc, source->payload_type);
+
+    // Is the Payload Type what we were expecting?
+    if (sdp.payload_type == -1) {
+        mast_info("Payload type of first packet: %d", packet->payload_type);
+        mast_sdp_set_payload_type(&sdp, packet->payload_type);
+        source->sdp = sdp;
+        stats.clock_rate = sdp.sample_rate;
+    } else if (sdp.payload_type != packet->payload_type) {
+        if (packet->payload_type == 10 || packet->payload_type == 11) {
+            mast_sdp_set_payload_type(&source->sdp, packet->payload_type);
+        } else {
+            mast_warn("Ignoring source with unexpected Payload Type: %d", packet->payload_type);
+            source->ignored = TRUE;
+        }
+    }
+
+    mast_clock_init(&source->media_clock, &source->sdp);
+
+    // Wait as long as the packets that fill the jitter buffer would take to arrive
+    duration = mast_rtp_packet_duration(packet, &source->sdp);
+    if (duration <= 0)
+        duration = 1000;
+    source->jitter_timeout_ns = (uint64_t)source->jitter.depth * duration * 1000;
+
+    source->codec = mast_codec_get(source->sdp.encoding, 0);
+    if (source->codec == NULL && !source->ignored) {
+        mast_warn("Ignoring source with unsupported encoding: %s", mast_encoding_name(source->sdp.encoding));
+        source->ignored = TRUE;
+    }
+
+    return source;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+// Use the sender's RTCP reports to find the wall clock time that the recording started
+static void report_start_time(recorder_source_t *source)
+{
+    mast_stats_source_t *stats_source = mast_stats_lookup(&stats, source->ssrc);
+    char when[40], comment[128];
+    uint64_t ntp;
+
+    if (!source->file || source->start_reported || stats_source == NULL)
+        return;
+
+    if (mast_rtcp_rtp_to_ntp(stats_source, source->first_timestamp, source->sdp.sample_rate, &ntp))
+        return;
+
+    mast_unix_ns_to_iso8601(mast_ntp_to_unix_ns(ntp), when, sizeof(when));
+    snprintf(comment, sizeof(comment), "First sample (RTP timestamp %u) at %s",
+             source->first_timestamp, when);
+
+    mast_info("SSRC 0x%8.8x: %s", source->ssrc, comment);
+    sf_set_string(source->file, SF_STR_COMMENT, comment);
+    source->start_reported = TRUE;
+}
+
+static int write_packet(recorder_source_t *source, mast_rtp_packet_t *packet)
+{
+    mast_gap_t *gap = &source->gap;
+    uint64_t ticks;
+
+    mast_debug("RTP packet ssrc=%x ts=%lu seq=%u", packet->ssrc, packet->timestamp, packet->sequence);
+
+    // Kept up to date for every packet, so that timestamp wraps are followed
+    ticks = mast_clock_extend(&source->media_clock, packet->timestamp, packet->arrival_ns);
+
+    if (!source->file) {
+        char path[MAST_MAX_FILEPATH_LEN];
+        uint64_t utc_ns = mast_clock_to_utc_ns(&source->media_clock, ticks);
+
+        source_filename(source, path, sizeof(path));
+        source->file = mast_writer_open(path, &source->sdp, utc_ns);
+        mast_gap_init(gap, &source->sdp, gap_mode);
+        source->first_timestamp = packet->timestamp;
+        report_start_time(source);
+    }
+
+    if (source->file) {
+        int64_t missing = mast_gap_check(gap, packet);
+        int skip = 0;
+
+        // Keep the file in step with the sender's media clock
+        while (missing > 0) {
+            uint8_t fill[RTP_MAX_PAYLOAD];
+            int len = mast_gap_conceal(gap, fill, missing);
+            if (len <= 0)
+                break;
+            mast_writer_write(source->file, source->codec, fill, len);
+            missing -= len / gap->frame_size;
+        }
+
+        // Audio that overlaps what has already been written would shift everything after it
+        if (missing < 0)
+            skip = -missing * gap->frame_size;
+        if (skip < packet->payload_length)
+            mast_writer_write(source->file, source->codec, packet->payload + skip, packet->payload_length - skip);
+        mast_gap_remember(gap, packet);
+    } else {
+        mast_error("Failed to open output file");
+        source->ignored = TRUE;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Enough packets for every source's jitter buffer to be full, plus a batch being received
+static unsigned int packet_pool_size()
+{
+    int depth = jitter_depth;
+    unsigned int size;
+
+    if (depth < 0)
+        depth = 0;
+    else if (depth > MAST_JITTER_MAX_DEPTH)
+        depth = MAST_JITTER_MAX_DEPTH;
+
+    // Each jitter buffer can also hold the first packet of a restarted stream
+    size = MAX_SOURCES * (depth + 2) + MAST_SOCKET_MAX_BATCH;
+    if (size < MAST_PACKET_POOL_SIZE)
+        size = MAST_PACKET_POOL_SIZE;
+
+    return size;
+}
+
+// Jitter buffers only give packets back when new ones arrive, so make room
+// by releasing the oldest packet from the fullest one
+static void release_oldest_packet()
+{
+    recorder_source_t *fullest = NULL;
+    mast_rtp_packet_t *packet;
+    int i;
+
+    for (i = 0; i < source_count; i++) {
+        if (fullest == NULL || sources[i]->jitter.count > fullest->jitter.count)
+            fullest = sources[i];
+    }
+
+    if (fullest == NULL)
+        return;
+
+    packet = mast_jitter_pop_early(&fullest->jitter);
+    if (packet) {
+        mast_debug("Packet pool is empty; releasing a packet early");
+        if (!fullest->ignored)
+            write_packet(fullest, packet);
+        mast_packet_unref(packet);
+    }
+}
+
+static void receive_packets(void *user_data)
+{
+    mast_socket_t *sock = user_data;
+    mast_rtp_packet_t *packets[MAST_SOCKET_MAX_BATCH];
+    int count, i;
+
+    count = mast_rtp_recv_pooled(sock, pool, packets, MAST_SOCKET_MAX_BATCH);
+    if (count < 0) {
+        running = FALSE;
+        return;
+    } else if (count == 0 && mast_packet_pool_available(pool) == 0) {
+        release_oldest_packet();
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        recorder_source_t *source;
+        mast_rtp_packet_t *packet;
+
+        // The jitter buffer needs to know how long each packet has been waiting
+        if (packets[i]->arrival_ns == 0)
+            packets[i]->arrival_ns = now_ns();
+
+        mast_stats_add(&stats, packets[i]);
+        if (show_latency)
+            mast_latency_add_packet(&latency, packets[i]);
+
+        source = mast_source_demux_lookup(&sources_demux, packets[i]->ssrc, packets[i]->payload_type);
+        if (source == NULL)
+            source = add_source(packets[i]);
+
+        if (source == NULL || source->ignored) {
+            mast_packet_unref(packets[i]);
+            continue;
+        }
+
+        mast_jitter_add(&source->jitter, packets[i]);
+        while ((packet = mast_jitter_pop(&source->jitter))) {
+            if (!source->ignored)
+                write_packet(source, packet);
+            mast_packet_unref(packet);
+        }
+    }
+}
+
+// Packets are otherwise only released when newer ones arrive
+static void jitter_timer(void *user_data)
+{
+    uint64_t now = now_ns();
+    mast_rtp_packet_t *packet;
+    int i;
+
+    for (i = 0; i < source_count; i++) {
+        recorder_source_t *source = sources[i];
+
+        while ((packet = mast_jitter_pop_expired(&source->jitter, now, source->jitter_timeout_ns))) {
+            if (!source->ignored)
+                write_packet(source, packet);
+            mast_packet_unref(packet);
+        }
+    }
+}
+
+static void receive_rtcp(void *user_data)
+{
+    mast_socket_t *sock = user_data;
+    uint8_t buffer[RTCP_MAX_LENGTH];
+    mast_socket_datagram_t datagram;
+    int i;
+
+    datagram.data = buffer;
+    datagram.len = sizeof(buffer);
+    if (mast_socket_recv_batch(sock, &datagram, 1) < 1)
+        return;
+
+    if (datagram.arrival_ns == 0)
+        datagram.arrival_ns = now_ns();
+
+    if (mast_rtcp_parse(&stats, datagram.data, datagram.len, datagram.arrival_ns) > 0) {
+        for (i = 0; i < source_count; i++) {
+            report_start_time(sources[i]);
+        }
+    }
+}
+
+static void send_receiver_report(void *user_data)
+{
+    uint8_t buffer[RTCP_MAX_LENGTH];
+    int len;
+
+    len = mast_rtcp_build_rr(&stats, reporter_ssrc, cname, buffer, sizeof(buffer), now_ns());
+    if (len > 0) {
+        mast_socket_send(&rtcp_send_sock, buffer, len);
+    }
+}
+
+static int open_rtcp(mast_loop_t *loop)
+{
+    char rtcp_port[NI_MAXSERV];
+    char hostname[128] = "localhost";
+
+    // RTCP is sent to the same group, on the next port up
+    snprintf(rtcp_port, sizeof(rtcp_port), "%d", atoi(sdp.port) + 1);
+
+    if (mast_socket_open_recv_filtered(&rtcp_sock, sdp.address, rtcp_port, ifname, &sdp.source_filter))
+        return -1;
+    mast_loop_add_socket(loop, &rtcp_sock, receive_rtcp, &rtcp_sock);
+
+    if (send_reports) {
+        if (mast_socket_open_send(&rtcp_send_sock, sdp.address, rtcp_port, ifname))
+            return -1;
+
+        gethostname(hostname, sizeof(hostname) - 1);
+        snprintf(cname, sizeof(cname), "mast-recorder@%s", hostname);
+        srand(time(NULL) ^ getpid());
+        reporter_ssrc = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+
+        mast_loop_add_timer(loop, RTCP_REPORT_INTERVAL * 1000, send_receiver_report, NULL);
+    }
+
+    return 0;
+}
+
+static void report_jitter()
+{
+    static uint64_t last_late = 0, last_duplicate = 0, last_lost = 0;
+    uint64_t late = 0, duplicate = 0, lost = 0;
+    int i;
+
+    for (i = 0; i < source_count; i++) {
+        late += sources[i]->jitter.late;
+        duplicate += sources[i]->jitter.duplicate;
+        lost += sources[i]->jitter.lost;
+    }
+
+    if (late != last_late || duplicate != last_duplicate || lost != last_lost) {
+        mast_warn(
+            "Packets late: %lu, duplicate: %lu, lost: %lu",
+            (unsigned long)(late - last_late),
+            (unsigned long)(duplicate - last_duplicate),
+            (unsigned long)(lost - last_lost)
+        );
+        last_late = late;
+        last_duplicate = duplicate;
+        last_lost = lost;
+    }
+}
+
+static void close_source(recorder_source_t *source)
+{
+    mast_rtp_packet_t *packet;
+
+    // Write whatever is still waiting for missing packets
+    mast_jitter_flush(&source->jitter);
+    while ((packet = mast_jitter_pop(&source->jitter))) {
+        if (source->file)
+            write_packet(source, packet);
+        mast_packet_unref(packet);
+    }
+    mast_jitter_free(&source->jitter);
+
+    if (source->file) {
+        mast_gap_print(&source->gap);
+        sf_close(source->file);
+    }
+}
+
+static void sync_timer(void *user_data)
+{
+    mast_socket_t *sock = user_data;
+    static uint32_t last_drops = 0;
+    int i;
+
+    for (i = 0; i < source_count; i++) {
+        if (sources[i]->file) {
+            mast_debug("Syncing file to disc");
+            sync_sndfile(sources[i]->file);
+        }
+    }
+
+    // Syncing can stall us for long enough that the receive buffer overflows
+    mast_socket_update_stats(sock);
+    if (sock->kernel_drops != last_drops) {
+        mast_warn(
+            "Kernel dropped %u packets (queue peak %u of %d bytes)",
+            sock->kernel_drops - last_drops, sock->queue_peak_bytes, sock->recv_buffer_size
+        );
+        last_drops = sock->kernel_drops;
+    }
+
+    report_jitter();
+}
+
+
 int main(int argc, char *argv[])
 {
-    SNDFILE * file = NULL;
-    unsigned int time = 0;
     mast_socket_t sock;
-    int result;
+    mast_loop_t loop;
+    int result, i;
 
     mast_sdp_set_defaults(&sdp);
     parse_opts(argc, argv);
-    setup_signal_hander();
+
+    result = mast_loop_init(&loop);
+    if (result) {
+        return EXIT_FAILURE;
+    }
+
+    // Every packet is written into memory that was allocated up front
+    pool = mast_packet_pool_create(packet_pool_size());
+    if (pool == NULL) {
+        mast_loop_close(&loop);
+        return EXIT_FAILURE;
+    }
 
     mast_info(
         "Recording: %s [%s/%d/%d]",
@@ -130,50 +619,90 @@ int main(int argc, char *argv[])
         mast_encoding_name(sdp.encoding), sdp.sample_rate, sdp.channel_count
     );
 
-    result = mast_socket_open_recv(&sock, sdp.address, sdp.port, ifname);
+    result = mast_socket_open_recv_filtered(&sock, sdp.address, sdp.port, ifname, &sdp.source_filter);
     if (result) {
+        mast_loop_close(&loop);
         return EXIT_FAILURE;
     }
 
-    while(running) {
-        mast_rtp_packet_t packet;
+    if (recv_buffer_size > 0) {
+        mast_socket_set_recv_buffer(&sock, recv_buffer_size);
+    }
 
-        int result = mast_rtp_recv(&sock, &packet);
-        if (result < 0) break;
+    if (use_capture && mast_socket_enable_capture(&sock)) {
+        mast_socket_close(&sock);
+        mast_loop_close(&loop);
+        return EXIT_FAILURE;
+    }
 
-        // Is the Payload Type what we were expecting?
-        if (sdp.payload_type == -1) {
-            mast_info("Payload type of first packet: %d", packet.payload_type);
-            mast_sdp_set_payload_type(&sdp, packet.payload_type);
-        } else if (sdp.payload_type != packet.payload_type) {
-            mast_warn("Received unexpected Payload Type: %d", packet.payload_type);
-        }
+    if (use_uring && mast_socket_enable_uring(&sock)) {
+        mast_socket_close(&sock);
+        mast_loop_close(&loop);
+        return EXIT_FAILURE;
+    }
 
-        mast_debug("RTP packet ts=%lu seq=%u", packet.timestamp, packet.sequence);
+    // Not fatal: the kernel's software timestamps are used instead
+    if (use_hw_timestamps) {
+        mast_socket_enable_hw_timestamps(&sock);
+    }
 
-        if (!file) {
-            file = mast_writer_open(filename, &sdp);
-        }
+    if (low_latency_cpu >= 0) {
+        mast_socket_enable_busy_poll(&sock, MAST_SOCKET_BUSY_POLL_USEC);
+        mast_loop_enable_busy_poll(&loop);
+        mast_realtime_enable(low_latency_cpu);
+    }
 
-        if (file) {
-            mast_writer_write(file, packet.payload, packet.payload_length);
-        } else {
-            mast_error("Failed to open output file");
-        }
+    mast_latency_init(&latency);
+    mast_stats_init(&stats, sdp.sample_rate);
+    if (mast_source_demux_init(&sources_demux, MAX_SOURCES)) {
+        mast_socket_close(&sock);
+        mast_loop_close(&loop);
+        return EXIT_FAILURE;
+    }
 
-        time += mast_rtp_packet_duration(&packet, &sdp);
-        if (time > (SYNC_TO_DISC_PERIOD * 1000000)) {
-            mast_debug("Syncing file to disc");
-            sync_sndfile(file);
-            time = 0;
-        }
+    mast_loop_add_socket(&loop, &sock, receive_packets, &sock);
+    mast_loop_add_timer(&loop, SYNC_TO_DISC_PERIOD * 1000, sync_timer, &sock);
+    mast_loop_add_timer(&loop, JITTER_TIMER_PERIOD, jitter_timer, NULL);
+
+    if (use_rtcp && open_rtcp(&loop)) {
+        mast_socket_close(&sock);
+        mast_loop_close(&loop);
+        return EXIT_FAILURE;
     }
 
-    if (file) {
-        sf_close(file);
+    mast_loop_run(&loop);
+
+    for (i = 0; i < source_count; i++) {
+        close_source(sources[i]);
+    }
+    report_jitter();
+
+    if (untracked_packets) {
+        mast_warn("Ignored %lu packets from too many sources", (unsigned long)untracked_packets);
     }
 
+    if (show_latency) {
+        mast_latency_print(&latency);
+    }
+
+    if (!quiet) {
+        mast_stats_print(&stats, stderr);
+    }
+
+    if (use_rtcp) {
+        mast_socket_close(&rtcp_sock);
+    }
+    if (send_reports) {
+        mast_socket_close(&rtcp_send_sock);
+    }
     mast_socket_close(&sock);
+    mast_loop_close(&loop);
+    mast_packet_pool_free(pool);
+
+    for (i = 0; i < source_count; i++) {
+        free(sources[i]);
+    }
+    mast_source_demux_free(&sources_demux);
 
     return exit_code;
 }
@@ -0,0 +1,206 @@
+/*
+
+  rtcp.c
+
+  Parsing of RTCP Sender Reports, to map the RTP timestamps of each
+  source onto wall clock (NTP) time, and generation of RTCP Receiver
+  Reports from the reception statistics (RFC 3550 section 6).
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "config.h"
+#include "mast.h"
+#include "bytestoint.h"
+
+#include <string.h>
+
+
+#define RTCP_HEADER_LENGTH      (4)
+#define RTCP_SR_LENGTH          (28)
+#define RTCP_REPORT_BLOCK_LEN   (24)
+
+
+static void _write_uint16(uint8_t *buffer, uint16_t value)
+{
+    buffer[0] = (value >> 8) & 0xFF;
+    buffer[1] = value & 0xFF;
+}
+
+static void _write_uint32(uint8_t *buffer, uint32_t value)
+{
+    buffer[0] = (value >> 24) & 0xFF;
+    buffer[1] = (value >> 16) & 0xFF;
+    buffer[2] = (value >> 8) & 0xFF;
+    buffer[3] = value & 0xFF;
+}
+
+static void _parse_sender_report(mast_stats_t *stats, const uint8_t *data, uint64_t arrival_ns)
+{
+    uint32_t ssrc = bytesToUInt32(&data[4]);
+    mast_stats_source_t *source = mast_stats_get(stats, ssrc);
+
+    if (source == NULL) {
+        stats->untracked++;
+        return;
+    }
+
+    source->sr_ntp = ((uint64_t)bytesToUInt32(&data[8]) << 32) | bytesToUInt32(&data[12]);
+    source->sr_rtp_timestamp = bytesToUInt32(&data[16]);
+    source->sr_packet_count = bytesToUInt32(&data[20]);
+    source->sr_octet_count = bytesToUInt32(&data[24]);
+    source->sr_arrival_ns = arrival_ns;
+    source->sr_count++;
+
+    mast_debug("RTCP Sender Report: ssrc=%8.8x rtp=%u", ssrc, source->sr_rtp_timestamp);
+}
+
+// Check that a compound packet is made up of whole, valid RTCP packets
+static int _validate(const uint8_t *data, int length)
+{
+    int pos = 0;
+
+    if (length < RTCP_HEADER_LENGTH)
+        return FALSE;
+
+    while (pos + RTCP_HEADER_LENGTH <= length) {
+        uint8_t version = data[pos] >> 6;
+        int packet_len = (bytesToUInt16(&data[pos + 2]) + 1) * 4;
+
+        if (version != RTP_VERSION || pos + packet_len > length)
+            return FALSE;
+
+        pos += packet_len;
+    }
+
+    return pos == length;
+}
+
+int mast_rtcp_parse(mast_stats_t *stats, const uint8_t *data, int length, uint64_t arrival_ns)
+{
+    int sender_reports = 0;
+    int pos = 0;
+
+    if (!_validate(data, length)) {
+        mast_debug("Invalid RTCP packet");
+        return -1;
+    }
+
+    // A compound packet is a number of RTCP packets, one after another
+    while (pos < length) {
+        const uint8_t *packet = &data[pos];
+        int packet_len = (bytesToUInt16(&packet[2]) + 1) * 4;
+
+        if (packet[1] == RTCP_PT_SR && packet_len >= RTCP_SR_LENGTH) {
+            _parse_sender_report(stats, packet, arrival_ns);
+            sender_reports++;
+        }
+
+        pos += packet_len;
+    }
+
+    return sender_reports;
+}
+
+int mast_rtcp_rtp_to_ntp(const mast_stats_source_t *source, uint32_t timestamp, int clock_rate, uint64_t *ntp)
+{
+    int64_t offset;
+
+    if (source->sr_count == 0 || clock_rate <= 0)
+        return -1;
+
+    // Timestamps either side of the report, allowing for wrapping
+    offset = (int32_t)(timestamp - source->sr_rtp_timestamp);
+    if (offset >= 0) {
+        *ntp = source->sr_ntp + (((uint64_t)offset << 32) / clock_rate);
+    } else {
+        *ntp = source->sr_ntp - (((uint64_t)(-offset) << 32) / clock_rate);
+    }
+
+    return 0;
+}
+
+static int _write_report_block(mast_stats_source_t *source, uint8_t *buffer, uint64_t now_ns)
+{
+    int64_t lost = mast_stats_lost(source);
+    uint32_t lsr = 0, dlsr = 0;
+
+    mast_stats_interval(source);
+
+    // Cumulative number lost is a signed 24-bit number
+    if (lost > 0x7FFFFF) {
+        lost = 0x7FFFFF;
+    } else if (lost < -0x800000) {
+        lost = -0x800000;
+    }
+
+    if (source->sr_count) {
+        // Middle 32 bits of the NTP timestamp, and the delay since then in 1/65536 seconds
+        lsr = (source->sr_ntp >> 16) & 0xFFFFFFFF;
+        if (now_ns > source->sr_arrival_ns)
+            dlsr = ((now_ns - source->sr_arrival_ns) << 16) / 1000000000;
+    }
+
+    _write_uint32(&buffer[0], source->ssrc);
+    buffer[4] = source->fraction_lost;
+    buffer[5] = (lost >> 16) & 0xFF;
+    buffer[6] = (lost >> 8) & 0xFF;
+    buffer[7] = lost & 0xFF;
+    _write_uint32(&buffer[8], source->cycles + source->max_seq);
+    _write_uint32(&buffer[12], mast_stats_jitter(source));
+    _write_uint32(&buffer[16], lsr);
+    _write_uint32(&buffer[20], dlsr);
+
+    return RTCP_REPORT_BLOCK_LEN;
+}
+
+int mast_rtcp_build_rr(mast_stats_t *stats, uint32_t ssrc, const char *cname, uint8_t *buffer, int buffer_len, uint64_t now_ns)
+{
+    int cname_len = strlen(cname);
+    int sdes_len, len = 8;
+    int count = 0;
+    int i;
+
+    if (cname_len > 255)
+        cname_len = 255;
+
+    // SSRC, CNAME item and at least one null byte, padded to a 32-bit boundary
+    sdes_len = ((RTCP_HEADER_LENGTH + 4 + 2 + cname_len + 1) + 3) & ~3;
+
+    if (buffer_len < 8 + sdes_len)
+        return -1;
+
+    // Receiver Report, with a block for each source heard from
+    for (i = 0; i < MAST_STATS_MAX_SOURCES && count < RTCP_MAX_REPORT_BLOCKS; i++) {
+        mast_stats_source_t *source = &stats->sources[i];
+
+        if (!source->in_use || source->received == 0)
+            continue;
+        if (len + RTCP_REPORT_BLOCK_LEN + sdes_len > buffer_len)
+            break;
+
+        len += _write_report_block(source, &buffer[len], now_ns);
+        count++;
+    }
+
+    buffer[0] = (RTP_VERSION << 6) | count;
+    buffer[1] = RTCP_PT_RR;
+    _write_uint16(&buffer[2], (len / 4) - 1);
+    _write_uint32(&buffer[4], ssrc);
+
+    // Source Description, with our canonical name
+    memset(&buffer[len], 0, sdes_len);
+    buffer[len] = (RTP_VERSION << 6) | 1;
+    buffer[len + 1] = RTCP_PT_SDES;
+    _write_uint16(&buffer[len + 2], (sdes_len / 4) - 1);
+    _write_uint32(&buffer[len + 4], ssrc);
+    buffer[len + 8] = RTCP_SDES_CNAME;
+    buffer[len + 9] = cname_len;
+    memcpy(&buffer[len + 10], cname, cname_len);
+    len += sdes_len;
+
+    return len;
+}
@@ -7,6 +7,7 @@
 */
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "config.h"
 #include "bytestoint.h"
@@ -15,56 +16,298 @@
 
 #define bitMask(byte, mask, shift) ((byte & (mask << shift)) >> shift)
 
-int mast_rtp_parse( mast_rtp_packet_t* packet )
+int mast_rtp_parse_data( mast_rtp_packet_t* packet, uint8_t* data, uint16_t length )
 {
     int header_len = RTP_HEADER_LENGTH;
+    int padding_len = 0;
+    int extension_len = 0;
+
+    packet->length = length;
+    packet->payload = NULL;
+    packet->payload_length = 0;
+    packet->extension_profile = 0;
+    packet->extension_length = 0;
+    packet->extension_data = NULL;
+
+    if (length < RTP_HEADER_LENGTH)
+        return -1;
 
     // Byte 1
-    packet->version = bitMask(packet->buffer[0], 0x02, 6);
-    packet->padding = bitMask(packet->buffer[0], 0x01, 5);
-    packet->extension = bitMask(packet->buffer[0], 0x01, 4);
-    packet->csrc_count = bitMask(packet->buffer[0], 0x0F, 0);
+    packet->version = bitMask(data[0], 0x03, 6);
+    packet->padding = bitMask(data[0], 0x01, 5);
+    packet->extension = bitMask(data[0], 0x01, 4);
+    packet->csrc_count = bitMask(data[0], 0x0F, 0);
+
+    if (packet->version != RTP_VERSION)
+        return -1;
 
     // Byte 2
-    packet->marker = bitMask(packet->buffer[1], 0x01, 7);
-    packet->payload_type = bitMask(packet->buffer[1], 0x7F, 0);
+    packet->marker = bitMask(data[1], 0x01, 7);
+    packet->payload_type = bitMask(data[1], 0x7F, 0);
 
     // Bytes 3 and 4
-    packet->sequence = bytesToUInt16(&packet->buffer[2]);
+    packet->sequence = bytesToUInt16(&data[2]);
 
     // Bytes 5-8
-    packet->timestamp = bytesToUInt32(&packet->buffer[4]);
+    packet->timestamp = bytesToUInt32(&data[4]);
 
     // Bytes 9-12
-    packet->ssrc = bytesToUInt32(&packet->buffer[8]);
+    packet->ssrc = bytesToUInt32(&data[8]);
 
-    // Calculate the size of the payload
-    // FIXME: skip over header extension
+    // Skip over the list of contributing sources
     header_len += (packet->csrc_count * 4);
-    packet->payload_length = packet->length - header_len;
-    packet->payload = packet->buffer + header_len;
+    if (header_len > length)
+        return -1;
+
+    // Skip over the header extension
+    if (packet->extension) {
+        if (header_len + 4 > length)
+            return -1;
+
+        // Up to 256kB long, so it doesn't fit in extension_length until checked
+        extension_len = bytesToUInt16(&data[header_len + 2]) * 4;
+        if (header_len + 4 + extension_len > length)
+            return -1;
+
+        packet->extension_profile = bytesToUInt16(&data[header_len]);
+        packet->extension_length = extension_len;
+        packet->extension_data = data + header_len + 4;
+        header_len += 4 + extension_len;
+    }
+
+    // The last byte of padding says how many bytes of padding there are
+    if (packet->padding) {
+        padding_len = data[length - 1];
+        if (padding_len == 0 || padding_len > length - header_len)
+            return -1;
+    }
 
-    // FIXME: Remove padding from payload_length
+    packet->payload_length = length - header_len - padding_len;
+    packet->payload = data + header_len;
 
     // Success
     return 0;
 }
 
 
-int mast_rtp_recv( mast_socket_t* socket, mast_rtp_packet_t* packet )
+int mast_rtp_parse( mast_rtp_packet_t* packet )
+{
+    return mast_rtp_parse_data(packet, packet->buffer, packet->length);
+}
+
+int mast_rtp_parse_batch( mast_rtp_packet_t** packets, int count )
+{
+    int valid = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        mast_rtp_packet_t *packet = packets[i];
+
+        if (mast_rtp_parse_data(packet, packet->buffer, packet->length) == 0) {
+            // Keep the valid packets at the start of the array, in order
+            if (valid != i) {
+                packets[i] = packets[valid];
+                packets[valid] = packet;
+            }
+            valid++;
+        }
+    }
+
+    return valid;
+}
+
+int mast_rtp_extensions( const mast_rtp_packet_t* packet, mast_rtp_extension_t* elements, int max )
 {
-    int len = mast_socket_recv(socket, &packet->buffer, sizeof(packet->buffer));
+    const uint8_t *data = packet->extension_data;
+    int len = packet->extension_length;
+    int count = 0;
+    int pos = 0;
+
+    if (data == NULL)
+        return 0;
+
+    if (packet->extension_profile == RTP_EXTENSION_ONE_BYTE) {
+        while (pos < len && count < max) {
+            uint8_t id = data[pos] >> 4;
+            uint8_t element_len = (data[pos] & 0x0F) + 1;
+
+            if (data[pos] == 0) {
+                // Padding between elements
+                pos++;
+                continue;
+            } else if (id == 15) {
+                // Stop processing the rest of the header
+                break;
+            } else if (pos + 1 + element_len > len) {
+                return -1;
+            }
+
+            elements[count].id = id;
+            elements[count].length = element_len;
+            elements[count].data = &data[pos + 1];
+            count++;
+            pos += 1 + element_len;
+        }
+    } else if ((packet->extension_profile & RTP_EXTENSION_TWO_BYTE_MASK) == RTP_EXTENSION_TWO_BYTE) {
+        while (pos < len && count < max) {
+            uint8_t element_len;
+
+            if (data[pos] == 0) {
+                pos++;
+                continue;
+            } else if (pos + 2 > len) {
+                return -1;
+            }
 
+            element_len = data[pos + 1];
+            if (pos + 2 + element_len > len)
+                return -1;
+
+            elements[count].id = data[pos];
+            elements[count].length = element_len;
+            elements[count].data = &data[pos + 2];
+            count++;
+            pos += 2 + element_len;
+        }
+    } else {
+        // Not an RFC 8285 header extension
+        return -1;
+    }
+
+    return count;
+}
+
+
+int mast_rtp_recv( mast_socket_t* socket, mast_rtp_packet_t* packet )
+{
     // Failure or too short to be an RTP packet?
-    if (len <= RTP_HEADER_LENGTH) return -1;
+    if (mast_rtp_recv_batch(socket, packet, 1) < 1) return -1;
 
-    packet->length = len;
+    return 0;
+}
+
+int mast_rtp_recv_batch( mast_socket_t* socket, mast_rtp_packet_t* packets, int count )
+{
+    mast_socket_datagram_t datagrams[MAST_SOCKET_MAX_BATCH];
+    int received, valid = 0;
+    int i;
+
+    if (count > MAST_SOCKET_MAX_BATCH)
+        count = MAST_SOCKET_MAX_BATCH;
+
+    for (i = 0; i < count; i++) {
+        datagrams[i].data = packets[i].buffer;
+        datagrams[i].len = sizeof(packets[i].buffer);
+    }
+
+    received = mast_socket_recv_batch(socket, datagrams, count);
+    if (received < 0) return received;
+
+    for (i = 0; i < received; i++) {
+        // Skip over anything too short to be an RTP packet
+        if (datagrams[i].len <= RTP_HEADER_LENGTH) continue;
+
+        // Keep the valid packets at the start of the array
+        if (datagrams[i].data == packets[i].buffer && valid != i) {
+            memcpy(packets[valid].buffer, packets[i].buffer, datagrams[i].len);
+            datagrams[i].data = packets[valid].buffer;
+        }
 
-    return mast_rtp_parse(packet);
+        // Capture backends leave the data where it is, so parse it in place
+        packets[valid].arrival_ns = datagrams[i].arrival_ns;
+        packets[valid].arrival_hw_ns = datagrams[i].arrival_hw_ns;
+        packets[valid].dest_addr = datagrams[i].local_addr;
+        if (mast_rtp_parse_data(&packets[valid], datagrams[i].data, datagrams[i].len) == 0)
+            valid++;
+    }
+
+    return valid;
+}
+
+int mast_rtp_recv_pooled( mast_socket_t* socket, mast_packet_pool_t* pool, mast_rtp_packet_t** packets, int count )
+{
+    mast_socket_datagram_t datagrams[MAST_SOCKET_MAX_BATCH];
+    int allocated, received, valid = 0, parsed;
+    int i;
+
+    if (count > MAST_SOCKET_MAX_BATCH)
+        count = MAST_SOCKET_MAX_BATCH;
+
+    for (allocated = 0; allocated < count; allocated++) {
+        packets[allocated] = mast_packet_alloc(pool);
+        if (packets[allocated] == NULL)
+            break;
+        datagrams[allocated].data = packets[allocated]->buffer;
+        datagrams[allocated].len = sizeof(packets[allocated]->buffer);
+    }
+
+    // Leave the datagrams queued until packets are given back
+    if (allocated == 0) {
+        mast_debug("Packet pool is empty");
+        return 0;
+    }
+
+    received = mast_socket_recv_batch(socket, datagrams, allocated);
+
+    for (i = 0; i < received; i++) {
+        mast_rtp_packet_t *packet = packets[i];
+
+        // Skip over anything too short to be an RTP packet
+        if (datagrams[i].len <= RTP_HEADER_LENGTH || datagrams[i].len > sizeof(packet->buffer)) {
+            mast_packet_unref(packet);
+            continue;
+        }
+
+        // Capture backends only lend us their buffers, so take a copy
+        if (datagrams[i].data != packet->buffer)
+            memcpy(packet->buffer, datagrams[i].data, datagrams[i].len);
+
+        packet->arrival_ns = datagrams[i].arrival_ns;
+        packet->arrival_hw_ns = datagrams[i].arrival_hw_ns;
+        packet->dest_addr = datagrams[i].local_addr;
+        packet->length = datagrams[i].len;
+        packets[valid++] = packet;
+    }
+
+    // Invalid packets are moved to the end
+    parsed = mast_rtp_parse_batch(packets, valid);
+    for (i = parsed; i < valid; i++) {
+        mast_packet_unref(packets[i]);
+    }
+
+    // Give back the packets that weren't needed
+    for (i = received > 0 ? received : 0; i < allocated; i++) {
+        mast_packet_unref(packets[i]);
+    }
+
+    return received < 0 ? received : parsed;
+}
+
+int mast_rtp_send_batch( mast_socket_t* socket, mast_rtp_packet_t* packets, int count )
+{
+    mast_socket_datagram_t datagrams[MAST_SOCKET_MAX_BATCH];
+    int i;
+
+    if (count > MAST_SOCKET_MAX_BATCH)
+        count = MAST_SOCKET_MAX_BATCH;
+
+    for (i = 0; i < count; i++) {
+        datagrams[i].data = packets[i].buffer;
+        datagrams[i].len = packets[i].length;
+        datagrams[i].dest_addr = NULL;
+    }
+
+    return mast_socket_send_batch(socket, datagrams, count);
 }
 
 int mast_rtp_packet_duration(mast_rtp_packet_t* packet, mast_sdp_t* sdp)
 {
-    int frames = ((packet->payload_length / (sdp->sample_size / 8)) / sdp->channel_count);
+    int sample_bytes = mast_encoding_sample_bytes(sdp->encoding);
+    int frames;
+
+    if (sample_bytes == 0 || sdp->channel_count == 0 || sdp->sample_rate == 0)
+        return 0;
+
+    frames = ((packet->payload_length / sample_bytes) / sdp->channel_count);
     return (frames * 1000000) / sdp->sample_rate;
 }
@@ -127,8 +127,9 @@ static void write_sdp_file(mast_sap_t *sap, const char *filepath)
     fclose(file);
 }
 
-static void receive_sap_packet(mast_socket_t *sock)
+static void receive_sap_packet(void *user_data)
 {
+    mast_socket_t *sock = user_data;
     uint8_t packet[2048];
     mast_sap_t sap;
     mast_sdp_t sdp;
@@ -179,21 +180,27 @@ static void receive_sap_packet(mast_socket_t *sock)
 int main(int argc, char *argv[])
 {
     mast_socket_t sock;
+    mast_loop_t loop;
     int result;
 
     parse_opts(argc, argv);
-    setup_signal_hander();
 
-    result = mast_socket_open_recv(&sock, address, port, ifname);
+    result = mast_loop_init(&loop);
     if (result) {
         return EXIT_FAILURE;
     }
 
-    while(running) {
-        receive_sap_packet(&sock);
+    result = mast_socket_open_recv(&sock, address, port, ifname);
+    if (result) {
+        mast_loop_close(&loop);
+        return EXIT_FAILURE;
     }
 
+    mast_loop_add_socket(&loop, &sock, receive_sap_packet, &sock);
+    mast_loop_run(&loop);
+
     mast_socket_close(&sock);
+    mast_loop_close(&loop);
 
     return exit_code;
 }
@@ -26,6 +26,9 @@ const char *ifname = NULL;
 const char *sdp_path = NULL;
 int publish_period = 10;
 
+mast_socket_t sock;
+char buffer[MAST_SDP_MAX_LEN];
+
 static void usage()
 {
     fprintf(stderr, "MAST SAP Server version %s\n\n", PACKAGE_VERSION);
@@ -88,15 +91,18 @@ static void parse_opts(int argc, char **argv)
     }
 }
 
+static void publish_timer(void *user_data)
+{
+    mast_sap_send_sdp_string(&sock, buffer, MAST_SAP_MESSAGE_ANNOUNCE);
+}
+
 int main(int argc, char *argv[])
 {
-    mast_socket_t sock;
-    char buffer[MAST_SDP_MAX_LEN];
+    mast_loop_t loop;
     mast_sdp_t sdp;
     int result;
 
     parse_opts(argc, argv);
-    setup_signal_hander();
 
     result = mast_read_file_string(sdp_path, buffer, sizeof(buffer));
     if (result) {
@@ -108,17 +114,24 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    result = mast_socket_open_send(&sock, address, port, ifname);
+    result = mast_loop_init(&loop);
     if (result) {
         return EXIT_FAILURE;
     }
 
-    while(running) {
-        mast_sap_send_sdp_string(&sock, buffer, MAST_SAP_MESSAGE_ANNOUNCE);
-        sleep(publish_period);
+    result = mast_socket_open_send(&sock, address, port, ifname);
+    if (result) {
+        mast_loop_close(&loop);
+        return EXIT_FAILURE;
     }
 
+    // Publish straight away and then periodically
+    publish_timer(NULL);
+    mast_loop_add_timer(&loop, publish_period * 1000, publish_timer, NULL);
+    mast_loop_run(&loop);
+
     mast_socket_close(&sock);
+    mast_loop_close(&loop);
 
     return exit_code;
 }
@@ -99,6 +99,69 @@ static void sdp_media_parse(mast_sdp_t *sdp, char* line, int line_num)
     }
 }
 
+// RFC 4570: a=source-filter: <mode> <nettype> <addrtype> <dest-address> <src-list>
+static void sdp_source_filter_parse(mast_sdp_t *sdp, char* line, int line_num)
+{
+    mast_source_filter_t *filter = &sdp->source_filter;
+    char *mode, *nettype, *addrtype, *dest, *src;
+    int filter_mode;
+
+    while (line && *line == ' ') line++;
+    mode = strsep(&line, " ");
+    nettype = strsep(&line, " ");
+    addrtype = strsep(&line, " ");
+    dest = strsep(&line, " ");
+
+    if (mode && strcmp(mode, "incl") == 0) {
+        filter_mode = MAST_SOURCE_FILTER_INCLUDE;
+    } else if (mode && strcmp(mode, "excl") == 0) {
+        filter_mode = MAST_SOURCE_FILTER_EXCLUDE;
+    } else {
+        mast_warn("Invalid source filter mode on line %d: %s", line_num, mode);
+        return;
+    }
+
+    if (nettype == NULL || strcmp(nettype, "IN") != 0) {
+        mast_warn("SDP source filter net type is not 'IN': %s", nettype);
+        return;
+    }
+
+    if (addrtype == NULL || (strcmp(addrtype, "IP4") != 0 && strcmp(addrtype, "IP6") != 0 && strcmp(addrtype, "*") != 0)) {
+        mast_warn("SDP source filter address type is not IP4/IP6: %s", addrtype);
+        return;
+    }
+
+    if (dest == NULL || line == NULL) {
+        mast_warn("Failed to parse source filter on line %d", line_num);
+        return;
+    }
+
+    // Only keep filters for our destination address
+    if (strcmp(dest, "*") != 0 && strlen(sdp->address) && strcmp(dest, sdp->address) != 0) {
+        mast_debug("Ignoring source filter for another destination: %s", dest);
+        return;
+    }
+
+    if (filter->mode != MAST_SOURCE_FILTER_NONE && filter->mode != filter_mode) {
+        mast_warn("Ignoring source filter with a different mode on line %d", line_num);
+        return;
+    }
+    filter->mode = filter_mode;
+
+    while ((src = strsep(&line, " "))) {
+        if (strlen(src) == 0)
+            continue;
+
+        if (filter->count >= MAST_SOCKET_MAX_SOURCES) {
+            mast_warn("Too many sources in source filter; ignoring %s", src);
+            continue;
+        }
+
+        strncpy(filter->addresses[filter->count], src, sizeof(filter->addresses[0])-1);
+        filter->count++;
+    }
+}
+
 static void sdp_attribute_parse(mast_sdp_t *sdp, char* line, int line_num)
 {
     char *attr = strsep(&line, ":");
@@ -146,10 +209,13 @@ static void sdp_attribute_parse(mast_sdp_t *sdp, char* line, int line_num)
         if (mediaclk_type && strcmp(mediaclk_type, "direct") == 0) {
             if (clock_offset) {
                 sdp->clock_offset = atoll(clock_offset);
+                sdp->has_clock_offset = TRUE;
             }
         } else {
             mast_warn("SDP Media Clock is not set to direct: %s", mediaclk_type);
         }
+    } else if (strcmp(attr, "source-filter") == 0) {
+        sdp_source_filter_parse(sdp, line, line_num);
     }
 }
 
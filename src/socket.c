@@ -26,14 +26,25 @@
 
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
-#include <ifaddrs.h>
 #include <net/if.h>
 #include <errno.h>
+#include <sys/ioctl.h>
+
+#ifdef HAVE_LINUX_NET_TSTAMP_H
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#endif
+
+#ifdef HAVE_LINUX_SOCK_DIAG_H
+#include <linux/sock_diag.h>
+#endif
 
 
 // Added to ensure compilation with KAME
@@ -140,85 +151,6 @@ static int _sockaddr_len(sa_family_t family)
     }
 }
 
-static int _get_interface_address(const char* ifname, sa_family_t family, struct sockaddr_storage* addr)
-{
-    struct ifaddrs *addrs, *cur;
-    int retval = -1;
-    int foundAddress = FALSE;
-
-    if (ifname == NULL || strlen(ifname) < 1) {
-        mast_error("No interface given");
-        return -1;
-    }
-
-    // Get a linked list of all the interfaces
-    retval = getifaddrs(&addrs);
-    if (retval < 0) {
-        return retval;
-    }
-
-    // Iterate through each of the interfaces
-    for(cur = addrs; cur; cur = cur->ifa_next)
-    {
-        if (cur->ifa_addr && cur->ifa_addr->sa_family == family) {
-            // FIXME: ignore link-local and temporary IPv6 addresses?
-            if (strcmp(cur->ifa_name, ifname) == 0) {
-                size_t addr_len = _sockaddr_len(cur->ifa_addr->sa_family);
-                if (addr_len > 0) {
-                    memcpy(addr, cur->ifa_addr, addr_len);
-                    foundAddress = TRUE;
-                }
-                break;
-            }
-        }
-    }
-
-    freeifaddrs(addrs);
-
-    return foundAddress ? 0 : -1;
-}
-
-
-static int _choose_best_interface(sa_family_t family, char* ifname)
-{
-    struct ifaddrs *addrs, *cur;
-    int retval = -1;
-
-    // Get a linked list of all the interfaces
-    retval = getifaddrs(&addrs);
-    if (retval < 0) {
-        return retval;
-    }
-
-    // Iterate through each of the interfaces
-    for(cur = addrs; cur; cur = cur->ifa_next)
-    {
-        // Check if address is for right family
-        if (cur->ifa_addr == NULL || cur->ifa_addr->sa_family != family)
-            continue;
-
-        // Ignore loopback and point-to-point network interfaces
-        if ((cur->ifa_flags & IFF_LOOPBACK) || (cur->ifa_flags & IFF_POINTOPOINT))
-            continue;
-
-        // Ignore interfaces that arn't up and running
-        if (!(cur->ifa_flags & IFF_RUNNING))
-            continue;
-
-        // FIXME: find a way to avoid Wifi interfaces
-        // FIXME: Could we prefer network interfaces that support IFCAP_AV?
-
-        // Found one!
-        retval = 0;
-        strncpy(ifname, cur->ifa_name, IFNAMSIZ-1);
-        break;
-    }
-
-    freeifaddrs(addrs);
-
-    return retval;
-}
-
 static void format_sockaddr(struct sockaddr_storage* ss, char *dst, socklen_t size)
 {
     switch (ss->ss_family) {
@@ -239,52 +171,52 @@ static void format_sockaddr(struct sockaddr_storage* ss, char *dst, socklen_t si
 
 static int _lookup_interface( mast_socket_t *sock, const char* ifname)
 {
-    char chosen_ifname[IFNAMSIZ];
+    const mast_interface_t *iface;
+    const struct sockaddr_storage *addr;
     char ipaddr[INET6_ADDRSTRLEN];
-    int retval = -1;
+    sa_family_t family = sock->dest_addr.ss_family;
 
     sock->if_index = 0;
 
     // Choose an interface, if none given
     if (ifname == NULL || strlen(ifname) == 0) {
-        retval = _choose_best_interface(sock->dest_addr.ss_family, chosen_ifname);
-        if (retval)
-            return retval;
-        ifname = chosen_ifname;
-    }
-
-    mast_debug("Looking up interface: %s", ifname);
-
-    // Check the interface exists, and store the interface index
-    sock->if_index = if_nametoindex(ifname);
-    if (sock->if_index == 0) {
-        if (errno == ENXIO) {
+        iface = mast_interface_choose(family);
+        if (iface == NULL)
+            return -1;
+    } else {
+        mast_debug("Looking up interface: %s", ifname);
+        iface = mast_interface_lookup(ifname);
+        if (iface == NULL) {
             mast_error("Network interface not found: %s", ifname);
             return -1;
-        } else {
-            mast_error("Error looking up interface: %s", strerror(errno));
         }
     }
 
+    // Store the interface name and index
+    memcpy(sock->ifname, iface->name, IFNAMSIZ);
+    sock->if_index = iface->index;
+
     // Get the address for the interface
-    retval = _get_interface_address(ifname, sock->dest_addr.ss_family, &sock->src_addr);
-    if (retval) {
+    addr = family == AF_INET6 ? &iface->addr6 : &iface->addr4;
+    if (addr->ss_family == family) {
+        memcpy(&sock->src_addr, addr, sizeof(struct sockaddr_storage));
+    } else {
         mast_warn("Failed to get address of network interface");
     }
 
     format_sockaddr(&sock->src_addr, ipaddr, sizeof(ipaddr));
-    mast_info("Using network interface: %s (%s)", ifname, ipaddr);
+    mast_info("Using network interface: %s (%s)", iface->name, ipaddr);
 
-    return retval;
+    return 0;
 }
 
-static void _set_imr(mast_socket_t *sock)
+static void _set_imr(mast_socket_t *sock, const struct sockaddr_storage *group)
 {
-    switch (sock->dest_addr.ss_family) {
+    switch (group->ss_family) {
     case AF_INET:
         memset(&sock->imr, 0, sizeof(sock->imr));
         memcpy(&sock->imr.imr_multiaddr,
-               &((struct sockaddr_in*)&sock->dest_addr)->sin_addr,
+               &((struct sockaddr_in*)group)->sin_addr,
                sizeof(struct in_addr));
 
         memcpy(&sock->imr.imr_interface,
@@ -295,7 +227,7 @@ static void _set_imr(mast_socket_t *sock)
     case AF_INET6:
         memset(&sock->imr6, 0, sizeof(sock->imr6));
         memcpy(&sock->imr6.ipv6mr_multiaddr,
-               &((struct sockaddr_in6*)&sock->dest_addr)->sin6_addr,
+               &((struct sockaddr_in6*)group)->sin6_addr,
                sizeof(struct in6_addr));
 
         sock->imr6.ipv6mr_interface = sock->if_index;
@@ -303,18 +235,18 @@ static void _set_imr(mast_socket_t *sock)
         break;
 
     default:
-        mast_error("Unknown socket address family: %d", sock->dest_addr.ss_family);
+        mast_error("Unknown socket address family: %d", group->ss_family);
         break;
     }
 }
 
-static int _join_group( mast_socket_t *sock )
+static int _join_group( mast_socket_t *sock, const struct sockaddr_storage *group )
 {
     int retval = -1;
 
-    _set_imr(sock);
+    _set_imr(sock, group);
 
-    switch (sock->dest_addr.ss_family) {
+    switch (group->ss_family) {
     case AF_INET:
         retval = setsockopt(sock->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
                             &sock->imr, sizeof(sock->imr));
@@ -330,32 +262,72 @@ static int _join_group( mast_socket_t *sock )
         break;
     }
 
-    if (retval == 0)
-        sock->joined_group = TRUE;
+    if (retval < 0 && errno == ENOBUFS)
+        mast_warn("Too many group memberships; see net.ipv4.igmp_max_memberships");
 
     return retval;
 }
 
 
-static int _leave_group( mast_socket_t* sock )
+static int _join_sources( mast_socket_t *sock, const struct sockaddr_storage *group, int mode, const struct sockaddr_storage *sources, int count )
+{
+#if defined(MCAST_JOIN_SOURCE_GROUP) && defined(MCAST_BLOCK_SOURCE)
+    struct group_source_req gsr;
+    int level = group->ss_family == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP;
+    int option, added = 0;
+    int i;
+
+    if (mode == MAST_SOURCE_FILTER_INCLUDE) {
+        option = MCAST_JOIN_SOURCE_GROUP;
+    } else {
+        // Excluded sources are blocked on top of an any-source membership
+        if (_join_group(sock, group))
+            return -1;
+        option = MCAST_BLOCK_SOURCE;
+    }
+
+    memset(&gsr, 0, sizeof(gsr));
+    gsr.gsr_interface = sock->if_index;
+    memcpy(&gsr.gsr_group, group, sizeof(gsr.gsr_group));
+
+    for (i = 0; i < count; i++) {
+        memcpy(&gsr.gsr_source, &sources[i], sizeof(gsr.gsr_source));
+        if (setsockopt(sock->fd, level, option, &gsr, sizeof(gsr))) {
+            mast_warn("%s failed: %s",
+                      option == MCAST_JOIN_SOURCE_GROUP ? "MCAST_JOIN_SOURCE_GROUP" : "MCAST_BLOCK_SOURCE",
+                      strerror(errno));
+        } else {
+            added++;
+        }
+    }
+
+    if (mode == MAST_SOURCE_FILTER_INCLUDE && added == 0)
+        return -1;
+
+    return 0;
+#else
+    mast_warn("Source-specific multicast is not supported on this platform; joining any-source");
+    return _join_group(sock, group);
+#endif
+}
+
+
+static int _leave_group( mast_socket_t* sock, const struct sockaddr_storage *group )
 {
     int retval = -1;
 
-    _set_imr(sock);
+    _set_imr(sock, group);
 
-    switch (sock->dest_addr.ss_family) {
+    // Leaving drops any source filters for the group too
+    switch (group->ss_family) {
     case AF_INET:
         retval = setsockopt(sock->fd, IPPROTO_IP, IP_DROP_MEMBERSHIP,
                             &(sock->imr), sizeof(sock->imr));
-        if (retval<0)
-            mast_warn("IP_DROP_MEMBERSHIP failed: %s", strerror(errno));
         break;
 
     case AF_INET6:
         retval = setsockopt(sock->fd, IPPROTO_IPV6, IPV6_DROP_MEMBERSHIP,
                             &(sock->imr6), sizeof(sock->imr6));
-        if (retval<0)
-            mast_warn("IPV6_DROP_MEMBERSHIP failed: %s", strerror(errno));
         break;
     }
 
@@ -367,7 +339,7 @@ static int _set_multicast_interface( mast_socket_t* sock )
 {
     int retval = -1;
 
-    _set_imr(sock);
+    _set_imr(sock, &sock->dest_addr);
 
     switch (sock->dest_addr.ss_family) {
     case AF_INET:
@@ -433,7 +405,334 @@ static int _set_multicast_loopback(mast_socket_t* sock, char loop )
 }
 
 
+int mast_socket_enable_hw_timestamps( mast_socket_t* sock )
+{
+#if defined(HAVE_LINUX_NET_TSTAMP_H) && defined(SIOCSHWTSTAMP)
+    struct hwtstamp_config config;
+    struct ifreq ifr;
+
+    if (sock->if_index == 0 || if_indextoname(sock->if_index, ifr.ifr_name) == NULL) {
+        mast_warn("Hardware timestamping needs a network interface");
+        return -1;
+    }
+
+    // Don't disturb a configuration made by another process (e.g. a PTP daemon)
+    memset(&config, 0, sizeof(config));
+    ifr.ifr_data = (void*)&config;
+    if (ioctl(sock->fd, SIOCGHWTSTAMP, &ifr) == 0 && config.rx_filter != HWTSTAMP_FILTER_NONE) {
+        mast_info("Hardware timestamping already enabled on %s", ifr.ifr_name);
+        return 0;
+    }
+
+    sock->hw_saved_tx_type = config.tx_type;
+    sock->hw_saved_rx_filter = config.rx_filter;
+
+    // Ask the NIC to timestamp every received packet (needs CAP_NET_ADMIN)
+    config.flags = 0;
+    config.rx_filter = HWTSTAMP_FILTER_ALL;
+
+    if (ioctl(sock->fd, SIOCSHWTSTAMP, &ifr)) {
+        mast_warn("Hardware timestamping not available on %s: %s", ifr.ifr_name, strerror(errno));
+        return -1;
+    }
+
+    mast_info("Enabled hardware timestamping on %s", ifr.ifr_name);
+    sock->hw_timestamps = TRUE;
+    return 0;
+#else
+    mast_warn("Hardware timestamping is not supported on this platform");
+    return -1;
+#endif
+}
+
+static void _restore_hw_timestamps( mast_socket_t* sock )
+{
+#if defined(HAVE_LINUX_NET_TSTAMP_H) && defined(SIOCSHWTSTAMP)
+    struct hwtstamp_config config;
+    struct ifreq ifr;
+
+    if (sock->if_index == 0 || if_indextoname(sock->if_index, ifr.ifr_name) == NULL)
+        return;
+
+    memset(&config, 0, sizeof(config));
+    config.tx_type = sock->hw_saved_tx_type;
+    config.rx_filter = sock->hw_saved_rx_filter;
+    ifr.ifr_data = (void*)&config;
+
+    if (ioctl(sock->fd, SIOCSHWTSTAMP, &ifr)) {
+        mast_warn("Failed to restore hardware timestamping on %s: %s", ifr.ifr_name, strerror(errno));
+    } else {
+        mast_debug("Restored hardware timestamping on %s", ifr.ifr_name);
+    }
+#endif
+    sock->hw_timestamps = FALSE;
+}
+
+static int _enable_timestamps( mast_socket_t* sock )
+{
+    int retval = -1;
+
+#if defined(SO_TIMESTAMPING) && defined(HAVE_LINUX_NET_TSTAMP_H)
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+                SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+
+    retval = setsockopt(sock->fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+    if (retval == 0)
+        return 0;
+    mast_debug("SO_TIMESTAMPING failed: %s", strerror(errno));
+#endif
+
+#ifdef SO_TIMESTAMPNS
+    {
+        int one = 1;
+        retval = setsockopt(sock->fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+        if (retval == 0)
+            return 0;
+        mast_debug("SO_TIMESTAMPNS failed: %s", strerror(errno));
+    }
+#endif
+
+#ifdef SO_TIMESTAMP
+    {
+        int one = 1;
+        retval = setsockopt(sock->fd, SOL_SOCKET, SO_TIMESTAMP, &one, sizeof(one));
+        if (retval < 0)
+            mast_warn("SO_TIMESTAMP failed: %s", strerror(errno));
+    }
+#endif
+
+    return retval;
+}
+
+static void _enable_drop_counter( mast_socket_t* sock )
+{
+#ifdef SO_RXQ_OVFL
+    int one = 1;
+
+    if (setsockopt(sock->fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one))) {
+        mast_debug("SO_RXQ_OVFL failed: %s", strerror(errno));
+    }
+#endif
+}
+
+static int _enable_pktinfo( mast_socket_t* sock )
+{
+    int one = 1;
+    int retval = -1;
+
+    switch (sock->dest_addr.ss_family) {
+#ifdef IP_PKTINFO
+    case AF_INET:
+        retval = setsockopt(sock->fd, IPPROTO_IP, IP_PKTINFO, &one, sizeof(one));
+        if (retval < 0)
+            mast_warn("IP_PKTINFO failed: %s", strerror(errno));
+        break;
+#endif
+
+#ifdef IPV6_RECVPKTINFO
+    case AF_INET6:
+        retval = setsockopt(sock->fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &one, sizeof(one));
+        if (retval < 0)
+            mast_warn("IPV6_RECVPKTINFO failed: %s", strerror(errno));
+        break;
+#endif
+
+    default:
+        mast_warn("Receiving the destination address is not supported on this platform");
+        break;
+    }
+
+    if (retval == 0)
+        sock->pktinfo = TRUE;
+
+    return retval;
+}
+
+static int _get_recv_buffer_size( mast_socket_t* sock )
+{
+    socklen_t len = sizeof(sock->recv_buffer_size);
+
+    return getsockopt(sock->fd, SOL_SOCKET, SO_RCVBUF, &sock->recv_buffer_size, &len);
+}
+
+static uint64_t _timespec_to_ns(const struct timespec *ts)
+{
+    return ((uint64_t)ts->tv_sec * 1000000000) + ts->tv_nsec;
+}
+
+// Copy the destination address out of an IP_PKTINFO / IPV6_PKTINFO message
+static int _parse_pktinfo( struct cmsghdr *cmsg, mast_socket_datagram_t* datagram )
+{
+#ifdef IP_PKTINFO
+    if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+        struct sockaddr_in *addr = (struct sockaddr_in*)&datagram->local_addr;
+        struct in_pktinfo info;
+        memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+        addr->sin_family = AF_INET;
+        addr->sin_addr = info.ipi_addr;
+        return 1;
+    }
+#endif
+
+#ifdef IPV6_RECVPKTINFO
+    if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
+        struct sockaddr_in6 *addr = (struct sockaddr_in6*)&datagram->local_addr;
+        struct in6_pktinfo info;
+        memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+        addr->sin6_family = AF_INET6;
+        addr->sin6_addr = info.ipi6_addr;
+        return 1;
+    }
+#endif
+
+    return 0;
+}
+
+// Extract the kernel receive timestamps, drop count and destination address from the control messages
+void mast_socket_parse_control( mast_socket_t* sock, struct msghdr* msg, mast_socket_datagram_t* datagram )
+{
+    struct cmsghdr *cmsg;
+
+    datagram->arrival_ns = 0;
+    datagram->arrival_hw_ns = 0;
+    datagram->local_addr.ss_family = AF_UNSPEC;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET) {
+            _parse_pktinfo(cmsg, datagram);
+            continue;
+        }
+
+#if defined(SO_TIMESTAMPING) && defined(HAVE_LINUX_NET_TSTAMP_H)
+        if (cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            // Software, deprecated and raw hardware timestamps
+            struct timespec ts[3];
+            memcpy(ts, CMSG_DATA(cmsg), sizeof(ts));
+            datagram->arrival_ns = _timespec_to_ns(&ts[0]);
+            datagram->arrival_hw_ns = _timespec_to_ns(&ts[2]);
+            continue;
+        }
+#endif
+
+#ifdef SO_TIMESTAMPNS
+        if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            datagram->arrival_ns = _timespec_to_ns(&ts);
+            continue;
+        }
+#endif
+
+#ifdef SO_RXQ_OVFL
+        if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+            // Total dropped by the kernel since the socket was opened
+            uint32_t drops;
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+            sock->kernel_drops = drops;
+            continue;
+        }
+#endif
+
+#ifdef SO_TIMESTAMP
+        if (cmsg->cmsg_type == SCM_TIMESTAMP) {
+            struct timeval tv;
+            memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+            datagram->arrival_ns = ((uint64_t)tv.tv_sec * 1000000000) + ((uint64_t)tv.tv_usec * 1000);
+            continue;
+        }
+#endif
+    }
+}
+
+static int _resolve_address( sa_family_t family, const char* address, struct sockaddr_storage *addr )
+{
+    struct addrinfo hints, *res;
+    int error;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICHOST;
+
+    error = getaddrinfo(address, NULL, &hints, &res);
+    if (error || res == NULL) {
+        mast_warn("Invalid address %s: %s", address, gai_strerror(error));
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(struct sockaddr_storage));
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+
+    return 0;
+}
+
+// Returns the number of sources that were resolved
+static int _resolve_sources( sa_family_t family, const mast_source_filter_t *filter, struct sockaddr_storage *sources )
+{
+    int count = 0;
+    int i;
+
+    if (filter == NULL || filter->mode == MAST_SOURCE_FILTER_NONE)
+        return 0;
+
+    for (i = 0; i < filter->count && i < MAST_SOCKET_MAX_SOURCES; i++) {
+        if (_resolve_address(family, filter->addresses[i], &sources[count]) == 0)
+            count++;
+    }
+
+    return count;
+}
+
+static int _join_membership( mast_socket_t *sock, const mast_socket_group_t *membership )
+{
+    if (membership->source_count > 0) {
+        return _join_sources(sock, &membership->group, membership->source_filter_mode,
+                             membership->sources, membership->source_count);
+    } else {
+        return _join_group(sock, &membership->group);
+    }
+}
+
+// Join a group and remember it, so that it can be joined again later
+static int _add_membership( mast_socket_t *sock, const struct sockaddr_storage *group, const mast_source_filter_t *filter )
+{
+    mast_socket_group_t *groups, *membership;
+
+    groups = realloc(sock->groups, (sock->group_count + 1) * sizeof(mast_socket_group_t));
+    if (groups == NULL) {
+        mast_error("Failed to allocate memory for multicast group");
+        return -1;
+    }
+    sock->groups = groups;
+
+    membership = &sock->groups[sock->group_count];
+    memset(membership, 0, sizeof(mast_socket_group_t));
+    memcpy(&membership->group, group, sizeof(struct sockaddr_storage));
+    membership->source_count = _resolve_sources(group->ss_family, filter, membership->sources);
+    if (membership->source_count > 0) {
+        mast_debug("Joining multicast group with source filter");
+        membership->source_filter_mode = filter->mode;
+    } else {
+        mast_debug("Joining multicast group");
+    }
+
+    if (_join_membership(sock, membership))
+        return -1;
+
+    sock->group_count++;
+    mast_interface_watch_socket(sock);
+
+    return 0;
+}
+
+
 int mast_socket_open_recv(mast_socket_t* sock, const char* address, const char* port, const char *ifname)
+{
+    return mast_socket_open_recv_filtered(sock, address, port, ifname, NULL);
+}
+
+int mast_socket_open_recv_filtered(mast_socket_t* sock, const char* address, const char* port, const char *ifname, const mast_source_filter_t *filter)
 {
     int is_multicast;
 
@@ -449,14 +748,23 @@ int mast_socket_open_recv(mast_socket_t* sock, const char* address, const char*
     // Work out what interface to receive packets on
     _lookup_interface(sock, ifname);
 
+    // Ask the kernel to record when each packet arrived
+    if (_enable_timestamps(sock)) {
+        mast_warn("Failed to enable receive timestamps");
+    }
+
+    // Report packets dropped because the receive buffer was full
+    _enable_drop_counter(sock);
+    _get_recv_buffer_size(sock);
+
     // Join multicast group ?
     is_multicast = _is_multicast( &sock->dest_addr );
     if (is_multicast == 1) {
-        mast_debug("Joining multicast group");
-        if (_join_group(sock)) {
+        if (_add_membership(sock, &sock->dest_addr, filter)) {
             mast_socket_close(sock);
             return -1;
         }
+        sock->joined_group = TRUE;
 
     } else if (is_multicast != 0) {
         mast_warn("Error checking if address is multicast");
@@ -465,6 +773,65 @@ int mast_socket_open_recv(mast_socket_t* sock, const char* address, const char*
     return 0;
 }
 
+int mast_socket_join_group(mast_socket_t* sock, const char* address, const mast_source_filter_t *filter)
+{
+    struct sockaddr_storage group;
+
+    if (_resolve_address(sock->dest_addr.ss_family, address, &group))
+        return -1;
+
+    if (_is_multicast(&group) != 1) {
+        mast_warn("Not a multicast group address: %s", address);
+        return -1;
+    }
+
+    // Datagrams for different groups need telling apart
+    if (!sock->pktinfo && _enable_pktinfo(sock))
+        return -1;
+
+    mast_debug("Joining additional multicast group: %s", address);
+    return _add_membership(sock, &group, filter);
+}
+
+int mast_socket_rejoin(mast_socket_t* sock)
+{
+    const mast_interface_t *iface;
+    const struct sockaddr_storage *addr;
+    int joined = 0;
+    int i;
+
+    iface = mast_interface_get(sock->ifname);
+    if (iface == NULL)
+        return -1;
+
+    // IPv4 groups are joined using the interface address
+    addr = sock->dest_addr.ss_family == AF_INET6 ? &iface->addr6 : &iface->addr4;
+    if (sock->dest_addr.ss_family == AF_INET && addr->ss_family != AF_INET) {
+        mast_debug("Waiting for an IPv4 address on %s before re-joining", sock->ifname);
+        return -1;
+    }
+
+    // Leave using the old interface, which may not exist any more
+    for (i = 0; i < sock->group_count; i++) {
+        if (_leave_group(sock, &sock->groups[i].group))
+            mast_debug("Failed to leave multicast group: %s", strerror(errno));
+    }
+
+    sock->if_index = iface->index;
+    if (addr->ss_family == sock->dest_addr.ss_family)
+        memcpy(&sock->src_addr, addr, sizeof(struct sockaddr_storage));
+
+    // Joining again also makes the kernel send new membership reports
+    for (i = 0; i < sock->group_count; i++) {
+        if (_join_membership(sock, &sock->groups[i]) == 0)
+            joined++;
+    }
+
+    mast_info("Re-joined %d of %d multicast groups on %s", joined, sock->group_count, sock->ifname);
+
+    return joined == sock->group_count ? 0 : -1;
+}
+
 int mast_socket_open_send(mast_socket_t* sock, const char* address, const char* port, const char *ifname)
 {
     int is_multicast;
@@ -495,11 +862,15 @@ int mast_socket_open_send(mast_socket_t* sock, const char* address, const char*
 }
 
 
-int mast_socket_recv( mast_socket_t* sock, void* data, unsigned  int len)
+static int _wait_for_data( mast_socket_t* sock )
 {
     fd_set readfds;
     struct timeval timeout;
-    int packet_len, retval;
+    int retval;
+
+    // An event loop has already told us that the socket is readable
+    if (sock->event_driven)
+        return 1;
 
     timeout.tv_sec = 60;
     timeout.tv_usec = 0;
@@ -508,6 +879,7 @@ int mast_socket_recv( mast_socket_t* sock, void* data, unsigned  int len)
     FD_ZERO(&readfds);
     FD_SET(sock->fd, &readfds);
     retval = select(FD_SETSIZE, &readfds, NULL, NULL, &timeout);
+    sock->syscall_count++;
 
     // Check return value
     if (retval == -1) {
@@ -519,13 +891,288 @@ int mast_socket_recv( mast_socket_t* sock, void* data, unsigned  int len)
         return 0;
     }
 
+    return retval;
+}
+
+
+int mast_socket_recv( mast_socket_t* sock, void* data, unsigned  int len)
+{
+    int packet_len, retval;
+
+    // Zero-copy backends return a pointer to the data instead of filling ours
+    if (sock->capture || sock->uring) {
+        mast_socket_datagram_t datagram;
+
+        retval = mast_socket_recv_batch(sock, &datagram, 1);
+        if (retval <= 0)
+            return retval;
+        if (datagram.len > len) {
+            mast_warn("Received datagram is bigger than buffer; truncating");
+            datagram.len = len;
+        }
+        memcpy(data, datagram.data, datagram.len);
+        return datagram.len;
+    }
+
+    retval = _wait_for_data(sock);
+    if (retval <= 0)
+        return retval;
+
     // Packet is waiting - read it in
-    packet_len = recv(sock->fd, data, len, 0);
+    packet_len = recv(sock->fd, data, len, MSG_DONTWAIT);
+    sock->syscall_count++;
+    if (packet_len > 0)
+        sock->packet_count++;
 
     return packet_len;
 }
 
 
+int mast_socket_enable_gro( mast_socket_t* sock )
+{
+#ifdef UDP_GRO
+    int one = 1;
+
+    if (setsockopt(sock->fd, SOL_UDP, UDP_GRO, &one, sizeof(one))) {
+        mast_warn("UDP_GRO failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if (sock->gro_buffer == NULL) {
+        sock->gro_buffer = malloc(MAST_SOCKET_GRO_BUFFER_LEN);
+        if (sock->gro_buffer == NULL) {
+            mast_error("Failed to allocate memory for GRO buffer");
+            return -1;
+        }
+    }
+
+    sock->gro_len = 0;
+    sock->gro_offset = 0;
+
+    return 0;
+#else
+    mast_warn("UDP Generic Receive Offload is not supported on this platform");
+    return -1;
+#endif
+}
+
+int mast_socket_enable_busy_poll( mast_socket_t* sock, int usecs )
+{
+#ifdef SO_BUSY_POLL
+    // Values above net.core.busy_read need CAP_NET_ADMIN
+    if (setsockopt(sock->fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs))) {
+        mast_warn("SO_BUSY_POLL failed: %s", strerror(errno));
+        return -1;
+    }
+
+#ifdef SO_PREFER_BUSY_POLL
+    {
+        // Leave the device queue to us rather than to softirq processing
+        int one = 1;
+        if (setsockopt(sock->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)))
+            mast_debug("SO_PREFER_BUSY_POLL failed: %s", strerror(errno));
+    }
+#endif
+
+    mast_debug("Busy polling socket for up to %dus", usecs);
+
+    return 0;
+#else
+    mast_warn("Socket busy polling is not supported on this platform");
+    return -1;
+#endif
+}
+
+// Read a (possibly coalesced) datagram into the GRO buffer
+static int _read_gro( mast_socket_t* sock, int flags )
+{
+    char control[MAST_SOCKET_CONTROL_LEN];
+    mast_socket_datagram_t timestamps;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    int len;
+
+    iov.iov_base = sock->gro_buffer;
+    iov.iov_len = MAST_SOCKET_GRO_BUFFER_LEN;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    len = recvmsg(sock->fd, &msg, flags);
+    sock->syscall_count++;
+    if (len <= 0)
+        return len;
+
+    // If the kernel coalesced datagrams, it tells us the segment size
+    sock->gro_segment = len;
+#ifdef UDP_GRO
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int segment;
+            memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+            if (segment > 0)
+                sock->gro_segment = segment;
+        }
+    }
+#else
+    (void)cmsg;
+#endif
+
+    // All the coalesced segments share the same timestamps
+    mast_socket_parse_control(sock, &msg, &timestamps);
+    sock->gro_arrival_ns = timestamps.arrival_ns;
+    sock->gro_arrival_hw_ns = timestamps.arrival_hw_ns;
+    sock->gro_local_addr = timestamps.local_addr;
+
+    sock->gro_len = len;
+    sock->gro_offset = 0;
+
+    return len;
+}
+
+static int _recv_batch_gro( mast_socket_t* sock, mast_socket_datagram_t* datagrams, int count )
+{
+    int received = 0;
+
+    while (received < count) {
+        unsigned int segment_len;
+
+        if (sock->gro_offset >= sock->gro_len) {
+            // Socket has already been checked for data, so never block here
+            int len = _read_gro(sock, MSG_DONTWAIT);
+            if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (len < 0) {
+                perror("recvmsg()");
+                return received > 0 ? received : -1;
+            }
+            if (len == 0)
+                break;
+        }
+
+        segment_len = sock->gro_len - sock->gro_offset;
+        if (segment_len > sock->gro_segment)
+            segment_len = sock->gro_segment;
+
+        if (segment_len > datagrams[received].len) {
+            mast_warn("Received datagram is bigger than buffer; truncating");
+            memcpy(datagrams[received].data, sock->gro_buffer + sock->gro_offset, datagrams[received].len);
+        } else {
+            memcpy(datagrams[received].data, sock->gro_buffer + sock->gro_offset, segment_len);
+            datagrams[received].len = segment_len;
+        }
+
+        datagrams[received].arrival_ns = sock->gro_arrival_ns;
+        datagrams[received].arrival_hw_ns = sock->gro_arrival_hw_ns;
+        datagrams[received].local_addr = sock->gro_local_addr;
+
+        sock->gro_offset += segment_len;
+        received++;
+    }
+
+    sock->packet_count += received;
+
+    return received;
+}
+
+int mast_socket_recv_batch( mast_socket_t* sock, mast_socket_datagram_t* datagrams, int count )
+{
+    int retval, i;
+
+    if (count > MAST_SOCKET_MAX_BATCH)
+        count = MAST_SOCKET_MAX_BATCH;
+
+    // Payloads are returned as pointers into the capture ring
+    if (sock->capture) {
+        return mast_capture_recv_batch(sock, datagrams, count);
+    } else if (sock->uring) {
+        return mast_uring_recv_batch(sock, datagrams, count);
+    }
+
+    // Segments left over from a previous coalesced datagram don't need a wait
+    if (sock->gro_buffer == NULL || sock->gro_offset >= sock->gro_len) {
+        retval = _wait_for_data(sock);
+        if (retval <= 0)
+            return retval;
+    }
+
+    if (sock->gro_buffer) {
+        return _recv_batch_gro(sock, datagrams, count);
+    }
+
+#ifdef HAVE_RECVMMSG
+    {
+        struct mmsghdr msgs[MAST_SOCKET_MAX_BATCH];
+        struct iovec iovecs[MAST_SOCKET_MAX_BATCH];
+        char control[MAST_SOCKET_MAX_BATCH][MAST_SOCKET_CONTROL_LEN];
+
+        memset(msgs, 0, sizeof(struct mmsghdr) * count);
+        for (i = 0; i < count; i++) {
+            iovecs[i].iov_base = datagrams[i].data;
+            iovecs[i].iov_len = datagrams[i].len;
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = control[i];
+            msgs[i].msg_hdr.msg_controllen = MAST_SOCKET_CONTROL_LEN;
+        }
+
+        // Read everything that is already queued, without blocking again
+        retval = recvmmsg(sock->fd, msgs, count, MSG_DONTWAIT, NULL);
+        sock->syscall_count++;
+        if (retval < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            perror("recvmmsg()");
+            return -1;
+        }
+
+        for (i = 0; i < retval; i++) {
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+                mast_warn("Received datagram is bigger than buffer; truncating");
+            datagrams[i].len = msgs[i].msg_len;
+            mast_socket_parse_control(sock, &msgs[i].msg_hdr, &datagrams[i]);
+        }
+    }
+#else
+    for (i = 0; i < count; i++) {
+        char control[MAST_SOCKET_CONTROL_LEN];
+        struct msghdr msg;
+        struct iovec iov;
+        int len;
+
+        iov.iov_base = datagrams[i].data;
+        iov.iov_len = datagrams[i].len;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        len = recvmsg(sock->fd, &msg, MSG_DONTWAIT);
+        sock->syscall_count++;
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            perror("recvmsg()");
+            return i > 0 ? i : -1;
+        }
+        datagrams[i].len = len;
+        mast_socket_parse_control(sock, &msg, &datagrams[i]);
+    }
+    retval = i;
+#endif
+
+    sock->packet_count += retval;
+
+    return retval;
+}
+
+
 int mast_socket_send( mast_socket_t* sock, void* data, unsigned  int len)
 {
     mast_debug("Sending %d byte packet", len);
@@ -537,27 +1184,311 @@ int mast_socket_send( mast_socket_t* sock, void* data, unsigned  int len)
                      (struct sockaddr*)&sock->dest_addr,
                      _sockaddr_len(sock->dest_addr.ss_family)
                  );
+    sock->syscall_count++;
     if (nbytes <= 0) {
         mast_warn("sending packet failed: %s", strerror(errno));
         return nbytes;
     }
 
+    sock->packet_count++;
+
     return nbytes;
 }
 
 
+int mast_socket_enable_gso( mast_socket_t* sock )
+{
+#ifdef UDP_SEGMENT
+    int zero = 0;
+
+    // Check that the kernel supports UDP segmentation offload
+    if (setsockopt(sock->fd, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero))) {
+        mast_warn("UDP_SEGMENT failed: %s", strerror(errno));
+        return -1;
+    }
+
+    sock->gso = TRUE;
+
+    return 0;
+#else
+    mast_warn("UDP Segmentation Offload is not supported on this platform");
+    return -1;
+#endif
+}
+
+static const struct sockaddr_storage* _datagram_dest( mast_socket_t* sock, mast_socket_datagram_t* datagram )
+{
+    return datagram->dest_addr ? datagram->dest_addr : &sock->dest_addr;
+}
+
+// Count how many of the datagrams can be sent as a single UDP GSO super-packet
+static int _gso_run_length( mast_socket_t* sock, mast_socket_datagram_t* datagrams, int count )
+{
+    const struct sockaddr_storage* dest = _datagram_dest(sock, &datagrams[0]);
+    unsigned int segment_len = datagrams[0].len;
+    unsigned int total_len = segment_len;
+    int run = 1;
+
+    if (!sock->gso)
+        return 1;
+
+    while (run < count && run < MAST_SOCKET_GSO_MAX_SEGMENTS) {
+        mast_socket_datagram_t *next = &datagrams[run];
+
+        // Every segment except the last must be the same size
+        if (next->len > segment_len || total_len + next->len > MAST_SOCKET_GSO_MAX_LEN)
+            break;
+        if (_datagram_dest(sock, next) != dest &&
+                memcmp(_datagram_dest(sock, next), dest, _sockaddr_len(dest->ss_family)) != 0)
+            break;
+
+        total_len += next->len;
+        run++;
+
+        if (next->len < segment_len)
+            break;
+    }
+
+    return run;
+}
+
+int mast_socket_send_batch( mast_socket_t* sock, mast_socket_datagram_t* datagrams, int count )
+{
+    int sent = 0;
+    int i;
+
+    if (count > MAST_SOCKET_MAX_BATCH)
+        count = MAST_SOCKET_MAX_BATCH;
+
+    mast_debug("Sending batch of %d packets", count);
+
+#ifdef HAVE_SENDMMSG
+    {
+        struct mmsghdr msgs[MAST_SOCKET_MAX_BATCH];
+        struct iovec iovecs[MAST_SOCKET_MAX_BATCH];
+        int runs[MAST_SOCKET_MAX_BATCH];
+#ifdef UDP_SEGMENT
+        char control[MAST_SOCKET_MAX_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+#endif
+        int msg_count = 0;
+        int retval;
+
+        // Build one message per datagram, or per run of segments if using GSO
+        memset(msgs, 0, sizeof(struct mmsghdr) * count);
+        i = 0;
+        while (i < count) {
+            const struct sockaddr_storage* dest = _datagram_dest(sock, &datagrams[i]);
+            struct msghdr *hdr = &msgs[msg_count].msg_hdr;
+            int j;
+
+            runs[msg_count] = _gso_run_length(sock, &datagrams[i], count - i);
+            for (j = 0; j < runs[msg_count]; j++) {
+                iovecs[i + j].iov_base = datagrams[i + j].data;
+                iovecs[i + j].iov_len = datagrams[i + j].len;
+            }
+
+            hdr->msg_name = (void*)dest;
+            hdr->msg_namelen = _sockaddr_len(dest->ss_family);
+            hdr->msg_iov = &iovecs[i];
+            hdr->msg_iovlen = runs[msg_count];
+
+#ifdef UDP_SEGMENT
+            if (runs[msg_count] > 1) {
+                struct cmsghdr *cmsg;
+                uint16_t segment_len = datagrams[i].len;
+
+                hdr->msg_control = control[msg_count];
+                hdr->msg_controllen = sizeof(control[msg_count]);
+                cmsg = CMSG_FIRSTHDR(hdr);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(segment_len));
+                memcpy(CMSG_DATA(cmsg), &segment_len, sizeof(segment_len));
+            }
+#endif
+
+            i += runs[msg_count];
+            msg_count++;
+        }
+
+        retval = sendmmsg(sock->fd, msgs, msg_count, 0);
+        sock->syscall_count++;
+        if (retval < 0) {
+            mast_warn("sending packets failed: %s", strerror(errno));
+            return -1;
+        }
+
+        for (i = 0; i < retval; i++) {
+            sent += runs[i];
+        }
+    }
+#else
+    for (i = 0; i < count; i++) {
+        const struct sockaddr_storage* dest = _datagram_dest(sock, &datagrams[i]);
+        int nbytes = sendto(
+                         sock->fd,
+                         datagrams[i].data, datagrams[i].len,
+                         0, // Flags
+                         (struct sockaddr*)dest,
+                         _sockaddr_len(dest->ss_family)
+                     );
+        sock->syscall_count++;
+        if (nbytes < 0) {
+            mast_warn("sending packet failed: %s", strerror(errno));
+            if (sent == 0)
+                return -1;
+            break;
+        }
+        sent++;
+    }
+#endif
+
+    sock->packet_count += sent;
+
+    return sent;
+}
+
+
+int mast_socket_set_recv_buffer( mast_socket_t* sock, int size )
+{
+    int retval = -1;
+    int granted;
+
+#ifdef SO_RCVBUFFORCE
+    // Allowed to go beyond net.core.rmem_max if we have CAP_NET_ADMIN
+    retval = setsockopt(sock->fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size));
+#endif
+    if (retval) {
+        retval = setsockopt(sock->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    if (retval) {
+        mast_warn("Failed to set receive buffer size: %s", strerror(errno));
+        return -1;
+    }
+
+    // The kernel may clamp the size, and Linux doubles it for bookkeeping
+    _get_recv_buffer_size(sock);
+    granted = sock->recv_buffer_size;
+#ifdef __linux__
+    granted /= 2;
+#endif
+    if (granted < size) {
+        mast_warn("Receive buffer limited to %d bytes; try raising net.core.rmem_max", granted);
+    } else {
+        mast_debug("Receive buffer size: %d bytes", sock->recv_buffer_size);
+    }
+
+    return 0;
+}
+
+int mast_socket_update_stats( mast_socket_t* sock )
+{
+    int retval = -1;
+
+    if (sock->capture) {
+        return mast_capture_update_stats(sock);
+    }
+
+#if defined(SO_MEMINFO) && defined(HAVE_LINUX_SOCK_DIAG_H)
+    {
+        uint32_t meminfo[SK_MEMINFO_VARS];
+        socklen_t len = sizeof(meminfo);
+
+        retval = getsockopt(sock->fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len);
+        if (retval == 0) {
+            sock->queue_bytes = meminfo[SK_MEMINFO_RMEM_ALLOC];
+            sock->recv_buffer_size = meminfo[SK_MEMINFO_RCVBUF];
+
+            // Picks up drops even if no packet has arrived since to carry SO_RXQ_OVFL
+            if (meminfo[SK_MEMINFO_DROPS] > sock->kernel_drops)
+                sock->kernel_drops = meminfo[SK_MEMINFO_DROPS];
+        }
+    }
+#endif
+
+    if (retval) {
+        // For UDP this is only the size of the next datagram
+        int queued = 0;
+        retval = ioctl(sock->fd, FIONREAD, &queued);
+        if (retval == 0)
+            sock->queue_bytes = queued;
+    }
+
+    if (sock->queue_bytes > sock->queue_peak_bytes)
+        sock->queue_peak_bytes = sock->queue_bytes;
+
+    return retval;
+}
+
+int mast_socket_enable_capture( mast_socket_t* sock )
+{
+    if (sock->gro_buffer || sock->uring) {
+        mast_error("Packet capture can't be used together with GRO or io_uring");
+        return -1;
+    }
+
+    return mast_capture_open(sock);
+}
+
+int mast_socket_enable_uring( mast_socket_t* sock )
+{
+    if (sock->gro_buffer || sock->capture) {
+        mast_error("io_uring can't be used together with GRO or packet capture");
+        return -1;
+    }
+
+    return mast_uring_open(sock);
+}
+
+int mast_socket_recv_fd( mast_socket_t* sock )
+{
+    if (sock->capture) {
+        return mast_capture_fd(sock);
+    } else if (sock->uring) {
+        return mast_uring_fd(sock);
+    } else {
+        return sock->fd;
+    }
+}
+
+
 void mast_socket_close(mast_socket_t* sock )
 {
     // Drop Multicast membership
     if (sock->joined_group)
     {
-        _leave_group( sock );
+        if (_leave_group(sock, &sock->dest_addr))
+            mast_warn("Failed to leave multicast group: %s", strerror(errno));
         sock->joined_group = 0;
     }
 
+    mast_interface_unwatch_socket(sock);
+    if (sock->groups) {
+        free(sock->groups);
+        sock->groups = NULL;
+        sock->group_count = 0;
+    }
+
+    if (sock->capture) {
+        mast_capture_close(sock);
+    }
+
+    if (sock->uring) {
+        mast_uring_close(sock);
+    }
+
+    if (sock->hw_timestamps) {
+        _restore_hw_timestamps(sock);
+    }
+
     // Close the sockets
     if (sock->fd >= 0) {
         close(sock->fd);
         sock->fd = -1;
     }
+
+    if (sock->gro_buffer) {
+        free(sock->gro_buffer);
+        sock->gro_buffer = NULL;
+    }
 }
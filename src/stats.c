@@ -0,0 +1,311 @@
+/*
+
+  stats.c
+
+  Reception statistics for each RTP source (SSRC), calculated as
+  described in RFC 3550 Appendix A. The work done for each packet
+  is constant, so it can be run on every packet received.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "config.h"
+#include "mast.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+
+#define RTP_SEQ_MOD     (1 << 16)
+#define MAX_DROPOUT     (3000)
+#define MAX_MISORDER    (100)
+
+#define SEEN_WORD(seq)  (((seq) % MAST_STATS_SEQ_WINDOW) / 64)
+#define SEEN_BIT(seq)   ((uint64_t)1 << ((seq) % 64))
+
+
+void mast_stats_init(mast_stats_t *stats, int clock_rate)
+{
+    memset(stats, 0, sizeof(mast_stats_t));
+    stats->clock_rate = clock_rate;
+}
+
+static void _init_seq(mast_stats_source_t *source, uint16_t seq)
+{
+    source->base_seq = seq;
+    source->max_seq = seq;
+    source->bad_seq = RTP_SEQ_MOD + 1;
+    source->cycles = 0;
+    source->received = 0;
+    source->expected_prior = 0;
+    source->received_prior = 0;
+    memset(source->seen, 0, sizeof(source->seen));
+    source->seen[SEEN_WORD(seq)] |= SEEN_BIT(seq);
+}
+
+// Forget the sequence numbers that the window is moving over
+static void _advance_window(mast_stats_source_t *source, uint16_t seq, uint16_t delta)
+{
+    uint16_t i;
+
+    if (delta >= MAST_STATS_SEQ_WINDOW) {
+        memset(source->seen, 0, sizeof(source->seen));
+    } else {
+        for (i = 1; i < delta; i++) {
+            uint16_t missing = source->max_seq + i;
+            source->seen[SEEN_WORD(missing)] &= ~SEEN_BIT(missing);
+        }
+    }
+
+    source->seen[SEEN_WORD(seq)] |= SEEN_BIT(seq);
+}
+
+// Returns FALSE if the packet should not be counted
+static int _update_seq(mast_stats_source_t *source, uint16_t seq)
+{
+    uint16_t udelta = seq - source->max_seq;
+
+    if (udelta == 0 || udelta > RTP_SEQ_MOD - MAX_MISORDER) {
+        // At or behind the highest sequence number so far
+        if (source->seen[SEEN_WORD(seq)] & SEEN_BIT(seq)) {
+            source->duplicates++;
+            return FALSE;
+        }
+        source->seen[SEEN_WORD(seq)] |= SEEN_BIT(seq);
+        source->reordered++;
+    } else if (udelta < MAX_DROPOUT) {
+        // In order, with a permissible gap
+        if (seq < source->max_seq) {
+            // Sequence number wrapped - count another 64K cycle
+            source->cycles += RTP_SEQ_MOD;
+        }
+        _advance_window(source, seq, udelta);
+        source->max_seq = seq;
+    } else {
+        // The sequence number made a very large jump
+        if (seq == source->bad_seq) {
+            // Two sequential packets: assume the other side restarted
+            _init_seq(source, seq);
+            source->resyncs++;
+        } else {
+            source->bad_seq = (seq + 1) & (RTP_SEQ_MOD - 1);
+            source->invalid++;
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+// Convert the arrival time into the same units as the RTP timestamp
+static uint32_t _arrival_units(uint64_t arrival_ns, int clock_rate)
+{
+    uint64_t secs = arrival_ns / 1000000000;
+    uint64_t nsecs = arrival_ns % 1000000000;
+
+    return (uint32_t)((secs * clock_rate) + ((nsecs * clock_rate) / 1000000000));
+}
+
+static void _update_jitter(mast_stats_t *stats, mast_stats_source_t *source, mast_rtp_packet_t *packet)
+{
+    int32_t transit, d;
+
+    if (packet->arrival_ns == 0 || stats->clock_rate <= 0)
+        return;
+
+    transit = (int32_t)(_arrival_units(packet->arrival_ns, stats->clock_rate) - packet->timestamp);
+    if (source->has_transit) {
+        d = transit - source->transit;
+        if (d < 0) d = -d;
+        // Scaled by 16, as in RFC 3550 A.8
+        source->jitter += d - ((source->jitter + 8) >> 4);
+    }
+    source->transit = transit;
+    source->has_transit = TRUE;
+}
+
+static uint32_t _hash(uint32_t ssrc)
+{
+    return (ssrc * 2654435761u) >> 16;
+}
+
+mast_stats_source_t* mast_stats_lookup(mast_stats_t *stats, uint32_t ssrc)
+{
+    uint32_t i = _hash(ssrc) & (MAST_STATS_MAX_SOURCES - 1);
+    int probes;
+
+    for (probes = 0; probes < MAST_STATS_MAX_SOURCES; probes++) {
+        mast_stats_source_t *source = &stats->sources[i];
+        if (!source->in_use)
+            return NULL;
+        if (source->ssrc == ssrc)
+            return source;
+        i = (i + 1) & (MAST_STATS_MAX_SOURCES - 1);
+    }
+
+    return NULL;
+}
+
+mast_stats_source_t* mast_stats_get(mast_stats_t *stats, uint32_t ssrc)
+{
+    uint32_t i = _hash(ssrc) & (MAST_STATS_MAX_SOURCES - 1);
+    int probes;
+
+    // Stop adding when the table is three quarters full, to keep lookups short
+    for (probes = 0; probes < MAST_STATS_MAX_SOURCES; probes++) {
+        mast_stats_source_t *source = &stats->sources[i];
+        if (source->in_use) {
+            if (source->ssrc == ssrc)
+                return source;
+        } else if (stats->count < (MAST_STATS_MAX_SOURCES * 3) / 4) {
+            memset(source, 0, sizeof(mast_stats_source_t));
+            source->in_use = TRUE;
+            source->ssrc = ssrc;
+            stats->count++;
+            return source;
+        } else {
+            return NULL;
+        }
+        i = (i + 1) & (MAST_STATS_MAX_SOURCES - 1);
+    }
+
+    return NULL;
+}
+
+mast_stats_source_t* mast_stats_add(mast_stats_t *stats, mast_rtp_packet_t *packet)
+{
+    mast_stats_source_t *source = mast_stats_get(stats, packet->ssrc);
+
+    if (source == NULL) {
+        stats->untracked++;
+        return NULL;
+    }
+
+    source->packets++;
+    source->bytes += packet->payload_length;
+    source->payload_type = packet->payload_type;
+    source->last_arrival_ns = packet->arrival_ns;
+
+    if (source->packets == 1) {
+        _init_seq(source, packet->sequence);
+    } else if (!_update_seq(source, packet->sequence)) {
+        return source;
+    }
+
+    source->received++;
+    _update_jitter(stats, source, packet);
+
+    return source;
+}
+
+uint64_t mast_stats_expected(const mast_stats_source_t *source)
+{
+    return ((uint64_t)source->cycles + source->max_seq) - source->base_seq + 1;
+}
+
+int64_t mast_stats_lost(const mast_stats_source_t *source)
+{
+    return (int64_t)mast_stats_expected(source) - (int64_t)source->received;
+}
+
+uint8_t mast_stats_interval(mast_stats_source_t *source)
+{
+    uint64_t expected = mast_stats_expected(source);
+    int64_t expected_interval = expected - source->expected_prior;
+    int64_t received_interval = source->received - source->received_prior;
+    int64_t lost_interval = expected_interval - received_interval;
+
+    source->expected_prior = expected;
+    source->received_prior = source->received;
+
+    if (expected_interval == 0 || lost_interval <= 0) {
+        source->fraction_lost = 0;
+    } else {
+        source->fraction_lost = (lost_interval << 8) / expected_interval;
+    }
+
+    return source->fraction_lost;
+}
+
+uint32_t mast_stats_jitter(const mast_stats_source_t *source)
+{
+    return source->jitter >> 4;
+}
+
+void mast_stats_print(mast_stats_t *stats, FILE *stream)
+{
+    int i;
+
+    for (i = 0; i < MAST_STATS_MAX_SOURCES; i++) {
+        mast_stats_source_t *source = &stats->sources[i];
+        uint32_t jitter;
+
+        // Sources only heard from over RTCP
+        if (!source->in_use || source->packets == 0)
+            continue;
+
+        jitter = mast_stats_jitter(source);
+        mast_stats_interval(source);
+
+        fprintf(stream, "SSRC 0x%8.8x  PT %-3u  ", source->ssrc, source->payload_type);
+        fprintf(stream, "packets %" PRIu64 "  bytes %" PRIu64 "  ", source->packets, source->bytes);
+        fprintf(stream, "expected %" PRIu64 "  received %" PRIu64 "  ",
+                mast_stats_expected(source), source->received);
+        fprintf(stream, "lost %" PRId64 " (%.1f%%)  ", mast_stats_lost(source),
+                (source->fraction_lost * 100.0) / 256);
+        fprintf(stream, "dup %" PRIu64 "  reorder %" PRIu64 "  ", source->duplicates, source->reordered);
+        if (stats->clock_rate > 0) {
+            fprintf(stream, "jitter %u (%.3f ms)\n", jitter, (jitter * 1000.0) / stats->clock_rate);
+        } else {
+            fprintf(stream, "jitter %u\n", jitter);
+        }
+    }
+
+    if (stats->untracked) {
+        fprintf(stream, "Packets from untracked sources: %" PRIu64 "\n", stats->untracked);
+    }
+}
+
+void mast_stats_print_json(mast_stats_t *stats, FILE *stream)
+{
+    int i, first = TRUE;
+
+    fprintf(stream, "{\"clock_rate\":%d,\"untracked\":%" PRIu64 ",\"sources\":[",
+            stats->clock_rate, stats->untracked);
+
+    for (i = 0; i < MAST_STATS_MAX_SOURCES; i++) {
+        mast_stats_source_t *source = &stats->sources[i];
+        uint32_t jitter;
+
+        // Sources only heard from over RTCP
+        if (!source->in_use || source->packets == 0)
+            continue;
+
+        jitter = mast_stats_jitter(source);
+        mast_stats_interval(source);
+
+        fprintf(stream, "%s{\"ssrc\":%u,\"payload_type\":%u,", first ? "" : ",",
+                source->ssrc, source->payload_type);
+        fprintf(stream, "\"packets\":%" PRIu64 ",\"bytes\":%" PRIu64 ",", source->packets, source->bytes);
+        fprintf(stream, "\"expected\":%" PRIu64 ",\"received\":%" PRIu64 ",",
+                mast_stats_expected(source), source->received);
+        fprintf(stream, "\"lost\":%" PRId64 ",\"fraction_lost\":%.4f,",
+                mast_stats_lost(source), source->fraction_lost / 256.0);
+        fprintf(stream, "\"duplicates\":%" PRIu64 ",\"reordered\":%" PRIu64 ",",
+                source->duplicates, source->reordered);
+        fprintf(stream, "\"jitter\":%u,\"last_arrival_ns\":%" PRIu64, jitter, source->last_arrival_ns);
+        if (source->sr_count) {
+            // Wall clock time of an RTP timestamp, from the last Sender Report
+            fprintf(stream, ",\"sr_rtp_timestamp\":%u,\"sr_unix_ns\":%" PRIu64,
+                    source->sr_rtp_timestamp, mast_ntp_to_unix_ns(source->sr_ntp));
+        }
+        fprintf(stream, "}");
+        first = FALSE;
+    }
+
+    fprintf(stream, "]}\n");
+}
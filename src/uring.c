@@ -0,0 +1,458 @@
+/*
+
+  uring.c
+
+  Receive backend that uses an io_uring multishot recvmsg, so that
+  the kernel writes datagrams straight into a ring of provided
+  buffers and completions are reaped in batches.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "config.h"
+#include "mast.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+// Multishot recvmsg arrived together with provided buffer rings
+#if defined(HAVE_LINUX_IO_URING_H) && defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define USE_URING
+#endif
+
+
+#ifdef USE_URING
+
+#define URING_BUFFER_GROUP   (0)
+#define URING_CONTROL_LEN    (128)
+
+struct mast_uring_s
+{
+    int fd;
+
+    // Submission queue
+    void *sq_ring;
+    size_t sq_ring_len;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+
+    // Completion queue
+    void *cq_ring;
+    size_t cq_ring_len;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Provided buffers
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_len;
+    uint8_t *buffers;
+    uint16_t buf_tail;
+
+    // Buffers handed out by the last receive, to be given back on the next
+    uint16_t pending[MAST_SOCKET_MAX_BATCH];
+    int pending_count;
+
+    // Template for the multishot recvmsg; only the lengths are used
+    struct msghdr msg;
+
+    // Set when the multishot request needs to be submitted again
+    int rearm;
+};
+
+
+static int _setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int _enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int _register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int _map_rings(struct mast_uring_s *uring, struct io_uring_params *params)
+{
+    uring->sq_ring_len = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    uring->cq_ring_len = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+
+    // Newer kernels map both rings with a single mmap()
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring->cq_ring_len > uring->sq_ring_len)
+            uring->sq_ring_len = uring->cq_ring_len;
+        uring->cq_ring_len = uring->sq_ring_len;
+    }
+
+    uring->sq_ring = mmap(NULL, uring->sq_ring_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+    if (uring->sq_ring == MAP_FAILED) {
+        uring->sq_ring = NULL;
+        return -1;
+    }
+
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        uring->cq_ring = uring->sq_ring;
+    } else {
+        uring->cq_ring = mmap(NULL, uring->cq_ring_len, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+        if (uring->cq_ring == MAP_FAILED) {
+            uring->cq_ring = NULL;
+            return -1;
+        }
+    }
+
+    uring->sqes_len = params->sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED) {
+        uring->sqes = NULL;
+        return -1;
+    }
+
+    uring->sq_tail = (unsigned*)((uint8_t*)uring->sq_ring + params->sq_off.tail);
+    uring->sq_mask = (unsigned*)((uint8_t*)uring->sq_ring + params->sq_off.ring_mask);
+    uring->sq_array = (unsigned*)((uint8_t*)uring->sq_ring + params->sq_off.array);
+
+    uring->cq_head = (unsigned*)((uint8_t*)uring->cq_ring + params->cq_off.head);
+    uring->cq_tail = (unsigned*)((uint8_t*)uring->cq_ring + params->cq_off.tail);
+    uring->cq_mask = (unsigned*)((uint8_t*)uring->cq_ring + params->cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe*)((uint8_t*)uring->cq_ring + params->cq_off.cqes);
+
+    return 0;
+}
+
+static uint8_t* _buffer(struct mast_uring_s *uring, uint16_t bid)
+{
+    return uring->buffers + ((size_t)bid * MAST_URING_BUFFER_SIZE);
+}
+
+static void _provide_buffer(struct mast_uring_s *uring, uint16_t bid)
+{
+    struct io_uring_buf *buf = &uring->buf_ring->bufs[uring->buf_tail & (MAST_URING_BUFFER_COUNT - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)_buffer(uring, bid);
+    buf->len = MAST_URING_BUFFER_SIZE;
+    buf->bid = bid;
+    uring->buf_tail++;
+}
+
+static void _publish_buffers(struct mast_uring_s *uring)
+{
+    __atomic_store_n(&uring->buf_ring->tail, uring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int _register_buffers(struct mast_uring_s *uring)
+{
+    struct io_uring_buf_reg reg;
+    long page_size = sysconf(_SC_PAGESIZE);
+    uint16_t bid;
+
+    // The buffer ring must be page aligned
+    uring->buf_ring_len = MAST_URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    uring->buf_ring = mmap(NULL, uring->buf_ring_len, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (uring->buf_ring == MAP_FAILED) {
+        uring->buf_ring = NULL;
+        return -1;
+    }
+
+    if (posix_memalign((void**)&uring->buffers, page_size, (size_t)MAST_URING_BUFFER_COUNT * MAST_URING_BUFFER_SIZE))
+        return -1;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)uring->buf_ring;
+    reg.ring_entries = MAST_URING_BUFFER_COUNT;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (_register(uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+        return -1;
+
+    for (bid = 0; bid < MAST_URING_BUFFER_COUNT; bid++) {
+        _provide_buffer(uring, bid);
+    }
+    _publish_buffers(uring);
+
+    return 0;
+}
+
+static int _submit_recvmsg(mast_socket_t *sock)
+{
+    struct mast_uring_s *uring = sock->uring;
+    unsigned tail = *uring->sq_tail;
+    unsigned index = tail & *uring->sq_mask;
+    struct io_uring_sqe *sqe = &uring->sqes[index];
+    int retval;
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = sock->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&uring->msg;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+
+    uring->sq_array[index] = index;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    retval = _enter(uring->fd, 1, 0, 0);
+    sock->syscall_count++;
+    if (retval < 0) {
+        mast_warn("Failed to submit io_uring recvmsg: %s", strerror(errno));
+        return -1;
+    }
+
+    uring->rearm = FALSE;
+
+    return 0;
+}
+
+static void _free_uring(struct mast_uring_s *uring)
+{
+    if (uring->fd >= 0)
+        close(uring->fd);
+    if (uring->sqes)
+        munmap(uring->sqes, uring->sqes_len);
+    if (uring->cq_ring && uring->cq_ring != uring->sq_ring)
+        munmap(uring->cq_ring, uring->cq_ring_len);
+    if (uring->sq_ring)
+        munmap(uring->sq_ring, uring->sq_ring_len);
+    if (uring->buf_ring)
+        munmap(uring->buf_ring, uring->buf_ring_len);
+    free(uring->buffers);
+    free(uring);
+}
+
+int mast_uring_open(mast_socket_t *sock)
+{
+    struct mast_uring_s *uring;
+    struct io_uring_params params;
+
+    uring = calloc(1, sizeof(struct mast_uring_s));
+    if (uring == NULL) {
+        mast_error("Failed to allocate memory for io_uring");
+        return -1;
+    }
+
+    // Leave room in the completion queue for every buffer to be filled
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = MAST_URING_BUFFER_COUNT * 2;
+    uring->fd = _setup(MAST_URING_QUEUE_DEPTH, &params);
+    if (uring->fd < 0) {
+        mast_warn("Failed to set up io_uring: %s", strerror(errno));
+        free(uring);
+        return -1;
+    }
+
+    if (_map_rings(uring, &params)) {
+        mast_warn("Failed to map io_uring: %s", strerror(errno));
+        _free_uring(uring);
+        return -1;
+    }
+
+    if (_register_buffers(uring)) {
+        mast_warn("Failed to register io_uring buffer ring: %s", strerror(errno));
+        _free_uring(uring);
+        return -1;
+    }
+
+    // Space in each buffer for the receive timestamps
+    uring->msg.msg_namelen = 0;
+    uring->msg.msg_controllen = URING_CONTROL_LEN;
+
+    sock->uring = uring;
+    if (_submit_recvmsg(sock)) {
+        sock->uring = NULL;
+        _free_uring(uring);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void _release_buffers(struct mast_uring_s *uring)
+{
+    int i;
+
+    if (uring->pending_count == 0)
+        return;
+
+    for (i = 0; i < uring->pending_count; i++) {
+        _provide_buffer(uring, uring->pending[i]);
+    }
+    _publish_buffers(uring);
+    uring->pending_count = 0;
+}
+
+static int _wait_for_completion(mast_socket_t *sock)
+{
+    struct pollfd pfd;
+    int retval;
+
+    if (sock->event_driven)
+        return 0;
+
+    pfd.fd = sock->uring->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    retval = poll(&pfd, 1, 60 * 1000);
+    sock->syscall_count++;
+    if (retval < 0) {
+        perror("poll()");
+        return -1;
+    } else if (retval == 0) {
+        mast_warn("Timed out waiting for packet after %d seconds", 60);
+    }
+
+    return retval;
+}
+
+// Returns 1 if the completion was turned into a datagram
+static int _handle_completion(mast_socket_t *sock, struct io_uring_cqe *cqe, mast_socket_datagram_t *datagram)
+{
+    struct mast_uring_s *uring = sock->uring;
+    struct io_uring_recvmsg_out *out;
+    struct msghdr msg;
+    uint16_t bid;
+    uint8_t *buffer;
+
+    // The kernel stops a multishot request when it runs out of buffers
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        uring->rearm = TRUE;
+
+    if (cqe->res < 0) {
+        if (cqe->res != -ENOBUFS)
+            mast_warn("io_uring recvmsg failed: %s", strerror(-cqe->res));
+        return 0;
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_BUFFER))
+        return 0;
+
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    buffer = _buffer(uring, bid);
+    uring->pending[uring->pending_count++] = bid;
+
+    out = (struct io_uring_recvmsg_out*)buffer;
+    if (out->flags & MSG_TRUNC)
+        mast_warn("Received datagram is bigger than buffer; truncating");
+
+    // Layout is: header, name, control, payload
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = buffer + sizeof(struct io_uring_recvmsg_out) + uring->msg.msg_namelen;
+    msg.msg_controllen = out->controllen;
+    mast_socket_parse_control(sock, &msg, datagram);
+
+    datagram->data = buffer + sizeof(struct io_uring_recvmsg_out) +
+                     uring->msg.msg_namelen + uring->msg.msg_controllen;
+    datagram->len = cqe->res - ((uint8_t*)datagram->data - buffer);
+
+    return 1;
+}
+
+int mast_uring_recv_batch(mast_socket_t *sock, mast_socket_datagram_t *datagrams, int count)
+{
+    struct mast_uring_s *uring = sock->uring;
+    int received = 0;
+
+    // Pointers from the previous batch are no longer valid
+    _release_buffers(uring);
+
+    while (received < count) {
+        unsigned head = *uring->cq_head;
+        unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+        if (head == tail) {
+            int retval;
+
+            if (uring->rearm && _submit_recvmsg(sock))
+                return -1;
+
+            if (received > 0)
+                break;
+
+            retval = _wait_for_completion(sock);
+            if (retval <= 0)
+                return retval;
+            continue;
+        }
+
+        while (head != tail && received < count) {
+            struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+            received += _handle_completion(sock, cqe, &datagrams[received]);
+            head++;
+        }
+        __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // Keep the kernel receiving while the caller handles this batch
+    if (uring->rearm && _submit_recvmsg(sock))
+        return -1;
+
+    sock->packet_count += received;
+
+    return received;
+}
+
+int mast_uring_fd(mast_socket_t *sock)
+{
+    return sock->uring->fd;
+}
+
+void mast_uring_close(mast_socket_t *sock)
+{
+    if (sock->uring == NULL)
+        return;
+
+    _free_uring(sock->uring);
+    sock->uring = NULL;
+}
+
+#else
+
+int mast_uring_open(mast_socket_t *sock)
+{
+    mast_warn("io_uring is not supported on this platform");
+    return -1;
+}
+
+int mast_uring_recv_batch(mast_socket_t *sock, mast_socket_datagram_t *datagrams, int count)
+{
+    return -1;
+}
+
+int mast_uring_fd(mast_socket_t *sock)
+{
+    return -1;
+}
+
+void mast_uring_close(mast_socket_t *sock)
+{
+}
+
+#endif
@@ -176,13 +176,43 @@ const char* mast_encoding_names[MAST_ENCODING_MAX] = {
 
 const char* mast_encoding_name(int encoding)
 {
-    if (encoding > 0 && encoding < MAST_ENCODING_MAX) {
+    if (encoding >= 0 && encoding < MAST_ENCODING_MAX) {
         return mast_encoding_names[encoding];
     } else {
         return NULL;
     }
 }
 
+int mast_encoding_sample_bytes(int encoding)
+{
+    switch(encoding) {
+    case MAST_ENCODING_L8:
+    case MAST_ENCODING_PCMU:
+    case MAST_ENCODING_PCMA:
+        return 1;
+    case MAST_ENCODING_L16:
+        return 2;
+    case MAST_ENCODING_L24:
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+uint8_t mast_encoding_silence(int encoding)
+{
+    switch(encoding) {
+    case MAST_ENCODING_L8:
+        return 0x80;
+    case MAST_ENCODING_PCMU:
+        return 0xFF;
+    case MAST_ENCODING_PCMA:
+        return 0xD5;
+    default:
+        return 0x00;
+    }
+}
+
 int mast_encoding_lookup(const char* name)
 {
     int i;
@@ -193,3 +223,33 @@ int mast_encoding_lookup(const char* name)
     }
     return -1;
 }
+
+uint64_t mast_ntp_to_unix_ns(uint64_t ntp)
+{
+    uint64_t secs = ntp >> 32;
+    uint64_t frac = ntp & 0xFFFFFFFF;
+
+    if (secs < MAST_NTP_UNIX_OFFSET)
+        return 0;
+
+    return ((secs - MAST_NTP_UNIX_OFFSET) * 1000000000) + ((frac * 1000000000) >> 32);
+}
+
+uint64_t mast_unix_ns_to_ntp(uint64_t unix_ns)
+{
+    uint64_t secs = (unix_ns / 1000000000) + MAST_NTP_UNIX_OFFSET;
+    uint64_t nsecs = unix_ns % 1000000000;
+
+    return (secs << 32) | ((nsecs << 32) / 1000000000);
+}
+
+void mast_unix_ns_to_iso8601(uint64_t unix_ns, char *buffer, size_t buffer_len)
+{
+    time_t secs = unix_ns / 1000000000;
+    char when[32];
+    struct tm tm;
+
+    gmtime_r(&secs, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buffer, buffer_len, "%s.%9.9luZ", when, (unsigned long)(unix_ns % 1000000000));
+}
@@ -11,20 +11,20 @@
 #include <sndfile.h>
 
 #include "mast.h"
-#include "bytestoint.h"
 
 
 
-SNDFILE * mast_writer_open(const char* format, mast_sdp_t *sdp)
+SNDFILE * mast_writer_open(const char* format, mast_sdp_t *sdp, uint64_t utc_ns)
 {
-    time_t now = time(0);
+    time_t start = utc_ns / 1000000000;
     struct tm tstruct;
     char filepath[MAST_MAX_FILEPATH_LEN];
+    char date[40];
     SF_INFO sfinfo;
+    SNDFILE *file;
 
-    // FIXME: use audio steam media clock instead
-    now = time(0);
-    localtime_r(&now, &tstruct);
+    // Name the file after the media clock time of the first sample
+    localtime_r(&start, &tstruct);
 
     // Append custom filepath to end of the root directory path
     // Ensure custom filepath is constructed OK by checking number of characters appended
@@ -40,12 +40,21 @@ SNDFILE * mast_writer_open(const char* format, mast_sdp_t *sdp)
     sfinfo.channels = sdp->channel_count;
 
     switch (sdp->encoding) {
+    case MAST_ENCODING_L8:
+        sfinfo.format |= SF_FORMAT_PCM_U8;
+        break;
     case MAST_ENCODING_L16:
         sfinfo.format |= SF_FORMAT_PCM_16;
         break;
     case MAST_ENCODING_L24:
         sfinfo.format |= SF_FORMAT_PCM_24;
         break;
+    case MAST_ENCODING_PCMU:
+        sfinfo.format |= SF_FORMAT_ULAW;
+        break;
+    case MAST_ENCODING_PCMA:
+        sfinfo.format |= SF_FORMAT_ALAW;
+        break;
     default:
         mast_error("Unsupported encoding: %s", mast_encoding_name(sdp->encoding));
         return NULL;
@@ -58,31 +67,33 @@ SNDFILE * mast_writer_open(const char* format, mast_sdp_t *sdp)
         return NULL;
     }
 
-    return sf_open(filepath, SFM_WRITE, &sfinfo);
+    file = sf_open(filepath, SFM_WRITE, &sfinfo);
+    if (file) {
+        mast_unix_ns_to_iso8601(utc_ns, date, sizeof(date));
+        sf_set_string(file, SF_STR_DATE, date);
+    }
+
+    return file;
 }
 
-void mast_writer_write(SNDFILE *file, uint8_t* payload, int payload_length)
+void mast_writer_write(SNDFILE *file, const mast_codec_t *codec, uint8_t* payload, int payload_length)
 {
-    int s32[RTP_MAX_PAYLOAD / 3];
+    int32_t s32[RTP_MAX_PAYLOAD];
     sf_count_t written = 0;
     sf_count_t count = 0;
-    int byte;
 
     if (payload_length > RTP_MAX_PAYLOAD) {
         mast_error("payload length is greater than maximum RTP payload size");
         return;
     }
 
-    // FIXME: make this work for 16-bit samples
-
-    if (payload_length % 3 != 0) {
-        mast_warn("payload length is not a multiple of 3");
+    if (payload_length % codec->sample_bytes != 0) {
+        mast_warn("payload length is not a multiple of %d", codec->sample_bytes);
     }
 
     // Convert payload to an array of 32-bit integers
-    for(byte=0; byte < payload_length; byte += 3) {
-        s32[count++] = bytesToInt24(&payload[byte]);
-    }
+    count = payload_length / codec->sample_bytes;
+    codec->decode(payload, count, s32);
 
     written = sf_write_int(file, s32, count);
     if (written != count) {
@@ -0,0 +1,114 @@
+/*
+
+  bench_convert.c
+
+  Benchmark for converting RTP payloads to and from 32-bit integer
+  and floating point samples, comparing each implementation supported
+  by this CPU with the time taken to just copy the same samples.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "mast.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_SAMPLES    (200000000)
+
+static uint8_t payload[RTP_MAX_PAYLOAD];
+static uint8_t encoded[RTP_MAX_PAYLOAD];
+static int32_t samples[RTP_MAX_PAYLOAD];
+static float float_samples[RTP_MAX_PAYLOAD];
+
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static void report(const char *name, uint64_t ns, int packets, int count, double copy_ns)
+{
+    double per_packet = (double)ns / packets;
+
+    printf("  %-16s %8.1f ns/packet  %6.2f ns/sample  %5.1fx copy\n",
+           name, per_packet, per_packet / count, per_packet / copy_ns);
+}
+
+static void run_benchmark(const char *name, int encoding, int count)
+{
+    const mast_codec_t *codec;
+    int packets = BENCH_SAMPLES / count;
+    int bytes = count * mast_encoding_sample_bytes(encoding);
+    double copy_ns;
+    uint64_t start;
+    int i, c;
+
+    printf("%s (%d samples, %d bytes)\n", name, count, bytes);
+
+    // Baseline: the payload bytes copied into the sample buffer
+    start = now_ns();
+    for (i = 0; i < packets; i++) {
+        memcpy(samples, payload, bytes);
+        __asm__ __volatile__("" : : "r"(samples) : "memory");
+    }
+    copy_ns = (double)(now_ns() - start) / packets;
+    printf("  %-16s %8.1f ns/packet\n", "memcpy", copy_ns);
+
+    for (c = 0; (codec = mast_codec_get(encoding, c)); c++) {
+        char label[32];
+
+        snprintf(label, sizeof(label), "%s decode", codec->name);
+        start = now_ns();
+        for (i = 0; i < packets; i++)
+            codec->decode(payload, count, samples);
+        report(label, now_ns() - start, packets, count, copy_ns);
+
+        snprintf(label, sizeof(label), "%s encode", codec->name);
+        start = now_ns();
+        for (i = 0; i < packets; i++)
+            codec->encode(samples, count, encoded);
+        report(label, now_ns() - start, packets, count, copy_ns);
+
+        snprintf(label, sizeof(label), "%s to float", codec->name);
+        start = now_ns();
+        for (i = 0; i < packets; i++)
+            mast_codec_decode_float(codec, payload, count, float_samples);
+        report(label, now_ns() - start, packets, count, copy_ns);
+
+        snprintf(label, sizeof(label), "%s from float", codec->name);
+        start = now_ns();
+        for (i = 0; i < packets; i++)
+            mast_codec_encode_float(codec, float_samples, count, encoded);
+        report(label, now_ns() - start, packets, count, copy_ns);
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    uint32_t seed = 1;
+    int i;
+
+    for (i = 0; i < sizeof(payload); i++) {
+        seed = seed * 1103515245 + 12345;
+        payload[i] = seed >> 16;
+    }
+
+    run_benchmark("L24 1ms stereo", MAST_ENCODING_L24, 96);
+    run_benchmark("L16 1ms stereo", MAST_ENCODING_L16, 96);
+    run_benchmark("L24 125us 64ch", MAST_ENCODING_L24, 384);
+    run_benchmark("L24 max payload", MAST_ENCODING_L24, 480);
+    run_benchmark("L8 20ms mono", MAST_ENCODING_L8, 160);
+    run_benchmark("PCMU 20ms mono", MAST_ENCODING_PCMU, 160);
+    run_benchmark("PCMA 20ms mono", MAST_ENCODING_PCMA, 160);
+
+    return exit_code;
+}
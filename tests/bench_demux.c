@@ -0,0 +1,106 @@
+/*
+
+  bench_demux.c
+
+  Benchmark for finding the session that a datagram belongs to from
+  its destination address, comparing the demux hash table with a
+  linear scan through the sessions.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "mast.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#define BENCH_LOOKUPS      (10000000)
+
+static struct sockaddr_storage addresses[4096];
+static int sessions[4096];
+
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static void make_addresses(int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        struct sockaddr_in *addr = (struct sockaddr_in*)&addresses[i];
+        memset(addr, 0, sizeof(struct sockaddr_storage));
+        addr->sin_family = AF_INET;
+        addr->sin_addr.s_addr = htonl(0xEF010000 + i);
+    }
+}
+
+static void* linear_lookup(int count, const struct sockaddr_storage *addr)
+{
+    const struct sockaddr_in *addr4 = (const struct sockaddr_in*)addr;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        const struct sockaddr_in *session = (const struct sockaddr_in*)&addresses[i];
+        if (session->sin_addr.s_addr == addr4->sin_addr.s_addr)
+            return &sessions[i];
+    }
+
+    return NULL;
+}
+
+static void run_benchmark(int count)
+{
+    mast_demux_t demux;
+    uint64_t start, hash_ns, linear_ns;
+    unsigned found = 0;
+    int i;
+
+    make_addresses(count);
+    mast_demux_init(&demux, count);
+    for (i = 0; i < count; i++) {
+        mast_demux_add(&demux, &addresses[i], &sessions[i]);
+    }
+
+    start = now_ns();
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+        found += mast_demux_lookup(&demux, &addresses[(i * 7) % count]) != NULL;
+    }
+    hash_ns = now_ns() - start;
+
+    start = now_ns();
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+        found += linear_lookup(count, &addresses[(i * 7) % count]) != NULL;
+    }
+    linear_ns = now_ns() - start;
+
+    printf(
+        "%5d sessions  hash %6.1f ns/lookup  linear %8.1f ns/lookup  (%u found)\n",
+        count,
+        (double)hash_ns / BENCH_LOOKUPS,
+        (double)linear_ns / BENCH_LOOKUPS,
+        found
+    );
+
+    mast_demux_free(&demux);
+}
+
+
+int main(int argc, char *argv[])
+{
+    run_benchmark(16);
+    run_benchmark(256);
+    run_benchmark(4096);
+
+    return exit_code;
+}
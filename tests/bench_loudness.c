@@ -0,0 +1,85 @@
+/*
+
+  bench_loudness.c
+
+  Benchmark for loudness measurement, comparing the scalar K-weighting
+  kernel with the vector kernels supported by this CPU. Each one is
+  timed through the whole mast_loudness_t data path, and reported as
+  a multiple of real time for one core.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "mast.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_SECONDS    (20)
+
+static uint8_t payload[RTP_MAX_PAYLOAD];
+
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static void run_benchmark(const char *name, int channels, int frames, int sample_rate)
+{
+    const mast_codec_t *codec = mast_codec_lookup(MAST_ENCODING_L24);
+    const mast_loudness_kernel_t *kernel;
+    int bytes = channels * frames * 3;
+    int packets = (sample_rate / frames) * BENCH_SECONDS;
+    int i, k;
+
+    printf("%s (%d channels, %d frames, %d bytes)\n", name, channels, frames, bytes);
+
+    for (k = 0; (kernel = mast_loudness_kernel_get(k)); k++);
+    for (k = k - 1; k >= 0; k--) {
+        mast_loudness_t loudness;
+        uint64_t start;
+        double ns;
+
+        kernel = mast_loudness_kernel_get(k);
+        if (mast_loudness_init(&loudness, channels, sample_rate))
+            exit(EXIT_FAILURE);
+        mast_loudness_set_kernel(&loudness, kernel->name);
+
+        start = now_ns();
+        for (i = 0; i < packets; i++) {
+            mast_loudness_process(&loudness, codec, payload, bytes);
+        }
+        ns = (double)(now_ns() - start);
+
+        printf("  %-8s %8.1f ns/packet  %6.1fx real time  (%.1f LUFS, %.1f LU)\n", kernel->name,
+               ns / packets, (BENCH_SECONDS * 1e9) / ns,
+               mast_loudness_integrated(&loudness), mast_loudness_range(&loudness));
+        mast_loudness_free(&loudness);
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    uint32_t seed = 1;
+    int i;
+
+    for (i = 0; i < sizeof(payload); i++) {
+        seed = seed * 1103515245 + 12345;
+        payload[i] = seed >> 16;
+    }
+
+    run_benchmark("L24 1ms", 2, 48, 48000);
+    run_benchmark("L24 1ms", 8, 48, 48000);
+    run_benchmark("L24 125us", 64, 6, 48000);
+
+    return exit_code;
+}
@@ -0,0 +1,151 @@
+/*
+
+  bench_parse.c
+
+  Benchmark for parsing RTP headers, comparing the original parser
+  (which did no validation and ignored extensions and padding) with
+  the current parser, called once per packet and in batches.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "mast.h"
+#include "hext.h"
+#include "bytestoint.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#define BENCH_BATCH       (MAST_SOCKET_MAX_BATCH)
+#define BENCH_ROUNDS      (200000)
+
+#define bitMask(byte, mask, shift) ((byte & (mask << shift)) >> shift)
+
+static mast_rtp_packet_t packets[BENCH_BATCH];
+static mast_rtp_packet_t *batch[BENCH_BATCH];
+
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static uint64_t now_cycles()
+{
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// The parser as it was before validation was added
+static int original_parse(mast_rtp_packet_t* packet, uint8_t* data, uint16_t length)
+{
+    int header_len = RTP_HEADER_LENGTH;
+
+    packet->version = bitMask(data[0], 0x02, 6);
+    packet->padding = bitMask(data[0], 0x01, 5);
+    packet->extension = bitMask(data[0], 0x01, 4);
+    packet->csrc_count = bitMask(data[0], 0x0F, 0);
+    packet->marker = bitMask(data[1], 0x01, 7);
+    packet->payload_type = bitMask(data[1], 0x7F, 0);
+    packet->sequence = bytesToUInt16(&data[2]);
+    packet->timestamp = bytesToUInt32(&data[4]);
+    packet->ssrc = bytesToUInt32(&data[8]);
+
+    header_len += (packet->csrc_count * 4);
+    packet->length = length;
+    packet->payload_length = length - header_len;
+    packet->payload = data + header_len;
+
+    return 0;
+}
+
+static void load_packets(const char* fixture)
+{
+    int i;
+
+    for (i = 0; i < BENCH_BATCH; i++) {
+        packets[i].length = hext_filename_to_buffer(fixture, packets[i].buffer, sizeof(packets[i].buffer));
+        batch[i] = &packets[i];
+    }
+}
+
+static void report(const char* name, uint64_t ns, uint64_t cycles, unsigned payload_bytes)
+{
+    double count = (double)BENCH_ROUNDS * BENCH_BATCH;
+
+#ifdef HAVE_RDTSC
+    printf("  %-10s %6.2f ns/packet  %6.1f cycles/packet  (%u)\n",
+           name, ns / count, cycles / count, payload_bytes);
+#else
+    printf("  %-10s %6.2f ns/packet  (%u)\n", name, ns / count, payload_bytes);
+    (void)cycles;
+#endif
+}
+
+static void run_benchmark(const char* fixture, const char* name)
+{
+    uint64_t start_ns, start_cycles;
+    unsigned payload_bytes;
+    int round, i;
+
+    load_packets(fixture);
+    printf("%s (%u bytes)\n", name, packets[0].length);
+
+    payload_bytes = 0;
+    start_ns = now_ns();
+    start_cycles = now_cycles();
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        for (i = 0; i < BENCH_BATCH; i++) {
+            original_parse(&packets[i], packets[i].buffer, packets[i].length);
+            payload_bytes += packets[i].payload_length;
+        }
+    }
+    report("original", now_ns() - start_ns, now_cycles() - start_cycles, payload_bytes);
+
+    payload_bytes = 0;
+    start_ns = now_ns();
+    start_cycles = now_cycles();
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        for (i = 0; i < BENCH_BATCH; i++) {
+            mast_rtp_parse(&packets[i]);
+            payload_bytes += packets[i].payload_length;
+        }
+    }
+    report("single", now_ns() - start_ns, now_cycles() - start_cycles, payload_bytes);
+
+    payload_bytes = 0;
+    start_ns = now_ns();
+    start_cycles = now_cycles();
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        int valid = mast_rtp_parse_batch(batch, BENCH_BATCH);
+        for (i = 0; i < valid; i++) {
+            payload_bytes += batch[i]->payload_length;
+        }
+    }
+    report("batch", now_ns() - start_ns, now_cycles() - start_cycles, payload_bytes);
+}
+
+
+int main(int argc, char *argv[])
+{
+    run_benchmark(FIXTURE_DIR "rtp_l24-48000-2_1ms.hext", "L24 1ms packet");
+    run_benchmark(FIXTURE_DIR "rtp_csrc_padding.hext", "CSRCs and padding");
+    run_benchmark(FIXTURE_DIR "rtp_extension_one_byte.hext", "Header extension");
+
+    return exit_code;
+}
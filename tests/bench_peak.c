@@ -0,0 +1,130 @@
+/*
+
+  bench_peak.c
+
+  Benchmark for finding the peak sample value of each channel,
+  comparing the scalar kernel with the vector kernels supported
+  by this CPU, for a few typical stream formats.
+
+  True-peak metering is timed through the whole mast_peak_t data path
+  and reported as a multiple of real time, for one core.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "mast.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_BYTES      (10000000 * 100)
+#define BENCH_SECONDS    (10)
+
+static uint8_t payload[RTP_MAX_PAYLOAD];
+
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static void run_benchmark(const char *name, int sample_size, int channels, int frames)
+{
+    const mast_peak_kernel_t *kernel;
+    int samples = channels * frames;
+    int packets = BENCH_BYTES / (samples * sample_size);
+    double scalar_ns = 0;
+    int i, k;
+
+    printf("%s (%d channels, %d frames, %d bytes)\n", name, channels, frames, samples * sample_size);
+
+    for (k = 0; (kernel = mast_peak_kernel_get(k)); k++);
+    for (k = k - 1; k >= 0; k--) {
+        mast_peak_kernel_func_t func;
+        uint32_t peaks[MAST_MAX_CHANNEL_COUNT];
+        uint32_t check = 0;
+        uint64_t start;
+        double ns;
+
+        kernel = mast_peak_kernel_get(k);
+        func = sample_size == 2 ? kernel->l16 : kernel->l24;
+
+        memset(peaks, 0, sizeof(peaks));
+        start = now_ns();
+        for (i = 0; i < packets; i++) {
+            func(payload, samples, channels, peaks);
+        }
+        ns = (double)(now_ns() - start) / packets;
+        for (i = 0; i < channels; i++)
+            check ^= peaks[i];
+
+        if (scalar_ns == 0)
+            scalar_ns = ns;
+        printf("  %-8s %8.1f ns/packet  %6.2f GB/s  %5.1fx  (%x)\n", kernel->name, ns,
+               (samples * sample_size) / ns, scalar_ns / ns, check);
+    }
+}
+
+
+static void run_true_peak_benchmark(const char *name, int channels, int frames, int sample_rate)
+{
+    const mast_peak_kernel_t *kernel;
+    int bytes = channels * frames * 3;
+    int packets = (sample_rate / frames) * BENCH_SECONDS;
+    int i, k;
+
+    printf("True-peak %s (%d channels, %d frames, %d bytes)\n", name, channels, frames, bytes);
+
+    for (k = 0; (kernel = mast_peak_kernel_get(k)); k++);
+    for (k = k - 1; k >= 0; k--) {
+        mast_peak_t peak;
+        uint64_t start;
+        double ns;
+
+        kernel = mast_peak_kernel_get(k);
+        mast_peak_init(&peak, channels);
+        mast_peak_set_kernel(&peak, kernel->name);
+        mast_peak_set_true_peak(&peak, TRUE);
+
+        start = now_ns();
+        for (i = 0; i < packets; i++) {
+            mast_peak_process_l24(&peak, payload, bytes);
+        }
+        ns = (double)(now_ns() - start);
+
+        printf("  %-8s %8.1f ns/packet  %6.1fx real time  (%.3f dBTP)\n", kernel->name, ns / packets,
+               (BENCH_SECONDS * 1e9) / ns, mast_peak_read_and_reset_all(&peak));
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    uint32_t seed = 1;
+    int i;
+
+    for (i = 0; i < sizeof(payload); i++) {
+        seed = seed * 1103515245 + 12345;
+        payload[i] = seed >> 16;
+    }
+
+    run_benchmark("L24 1ms", 3, 2, 48);
+    run_benchmark("L16 1ms", 2, 2, 48);
+    run_benchmark("L24 1ms", 3, 8, 48);
+    run_benchmark("L24 125us", 3, 64, 6);
+    run_benchmark("L16 125us", 2, 64, 6);
+    run_benchmark("L24 250us", 3, 16, 12);
+
+    run_true_peak_benchmark("L24 1ms", 2, 48, 48000);
+    run_true_peak_benchmark("L24 1ms", 8, 48, 48000);
+    run_true_peak_benchmark("L24 125us", 64, 6, 48000);
+
+    return exit_code;
+}
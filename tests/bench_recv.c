@@ -0,0 +1,167 @@
+/*
+
+  bench_recv.c
+
+  Benchmark for receiving RTP packets over the loopback interface,
+  comparing select() and recv() for each packet with the batched API,
+  receiving into a packet pool, the memory-mapped packet capture
+  backend and io_uring.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "mast.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_ADDRESS      "127.0.0.1"
+#define BENCH_PORT         "50004"
+#define BENCH_IFNAME       "lo"
+#define BENCH_PACKET_LEN   (300)
+#define BENCH_BURST        (MAST_SOCKET_MAX_BATCH)
+#define BENCH_ROUNDS       (2000)
+
+enum {
+    BENCH_MODE_SINGLE,
+    BENCH_MODE_BATCH,
+    BENCH_MODE_POOLED,
+    BENCH_MODE_BATCH_GRO,
+    BENCH_MODE_BATCH_CAPTURE,
+    BENCH_MODE_BATCH_URING
+};
+
+static const char* mode_names[] = {
+    "select + recv",
+    "mast_rtp_recv_batch",
+    "mast_rtp_recv_pooled",
+    "mast_rtp_recv_batch + GRO",
+    "mast_rtp_recv_batch + capture",
+    "mast_rtp_recv_batch + io_uring"
+};
+
+static mast_rtp_packet_t packets[MAST_SOCKET_MAX_BATCH];
+static mast_packet_pool_t *pool;
+
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static void send_burst(mast_socket_t *tx, uint16_t *sequence)
+{
+    uint8_t buffer[BENCH_PACKET_LEN];
+    int i;
+
+    memset(buffer, 0, sizeof(buffer));
+    buffer[0] = 0x80;
+    buffer[1] = 97;
+
+    for (i = 0; i < BENCH_BURST; i++) {
+        buffer[2] = (*sequence >> 8) & 0xFF;
+        buffer[3] = *sequence & 0xFF;
+        mast_socket_send(tx, buffer, sizeof(buffer));
+        (*sequence)++;
+    }
+}
+
+static int run_benchmark(int mode)
+{
+    mast_socket_t rx, tx;
+    uint16_t sequence = 0;
+    uint64_t received = 0;
+    uint64_t elapsed = 0, cpu = 0;
+    int round;
+
+    if (mast_socket_open_recv(&rx, BENCH_ADDRESS, BENCH_PORT, BENCH_IFNAME))
+        return -1;
+    if (mast_socket_open_send(&tx, BENCH_ADDRESS, BENCH_PORT, BENCH_IFNAME))
+        return -1;
+
+    if ((mode == BENCH_MODE_BATCH_GRO && mast_socket_enable_gro(&rx)) ||
+            (mode == BENCH_MODE_BATCH_CAPTURE && mast_socket_enable_capture(&rx)) ||
+            (mode == BENCH_MODE_BATCH_URING && mast_socket_enable_uring(&rx))) {
+        mast_socket_close(&rx);
+        mast_socket_close(&tx);
+        return -1;
+    }
+
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        int burst_received = 0;
+        uint64_t start, cpu_start;
+
+        send_burst(&tx, &sequence);
+
+        start = clock_ns(CLOCK_MONOTONIC);
+        cpu_start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+        while (burst_received < BENCH_BURST) {
+            int count;
+
+            if (mode == BENCH_MODE_SINGLE) {
+                // The baseline: one select() and one recv() system call per packet
+                int len = mast_socket_recv(&rx, packets[0].buffer, sizeof(packets[0].buffer));
+                if (len <= 0) break;
+                packets[0].length = len;
+                count = mast_rtp_parse(&packets[0]) == 0 ? 1 : -1;
+            } else if (mode == BENCH_MODE_POOLED) {
+                mast_rtp_packet_t *pooled[MAST_SOCKET_MAX_BATCH];
+                int i;
+
+                count = mast_rtp_recv_pooled(&rx, pool, pooled, BENCH_BURST - burst_received);
+                for (i = 0; i < count; i++) {
+                    mast_packet_unref(pooled[i]);
+                }
+            } else {
+                count = mast_rtp_recv_batch(&rx, packets, BENCH_BURST - burst_received);
+            }
+
+            if (count < 0) break;
+            burst_received += count;
+        }
+        elapsed += clock_ns(CLOCK_MONOTONIC) - start;
+        cpu += clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+        received += burst_received;
+    }
+
+    printf(
+        "%-30s %8" PRIu64 " packets  %6.3f syscalls/packet  %8.1f ns/packet  %8.1f CPU ns/packet\n",
+        mode_names[mode], received,
+        (double)rx.syscall_count / received,
+        (double)elapsed / received,
+        (double)cpu / received
+    );
+
+    mast_socket_close(&rx);
+    mast_socket_close(&tx);
+
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    quiet = TRUE;
+
+    pool = mast_packet_pool_create(MAST_PACKET_POOL_SIZE);
+
+    run_benchmark(BENCH_MODE_SINGLE);
+    run_benchmark(BENCH_MODE_BATCH);
+    run_benchmark(BENCH_MODE_POOLED);
+    run_benchmark(BENCH_MODE_BATCH_GRO);
+    run_benchmark(BENCH_MODE_BATCH_CAPTURE);
+    run_benchmark(BENCH_MODE_BATCH_URING);
+
+    mast_packet_pool_free(pool);
+
+    return exit_code;
+}
@@ -0,0 +1,141 @@
+/*
+
+  bench_send.c
+
+  Loopback throughput benchmark for sending RTP packets one at a time,
+  in batches with sendmmsg() and in batches with UDP GSO.
+
+  MAST: Multicast Audio Streaming Toolkit
+  Copyright (C) 2019  Nicholas Humfrey
+  License: MIT
+
+*/
+
+#include "mast.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_ADDRESS      "127.0.0.1"
+#define BENCH_PORT         "50006"
+#define BENCH_PACKET_LEN   (300)
+#define BENCH_BURST        (MAST_SOCKET_MAX_BATCH)
+#define BENCH_ROUNDS       (2000)
+
+enum {
+    BENCH_MODE_SINGLE,
+    BENCH_MODE_BATCH,
+    BENCH_MODE_BATCH_GSO,
+    BENCH_MODE_BATCH_GSO_GRO
+};
+
+static const char* mode_names[] = {
+    "mast_socket_send",
+    "mast_rtp_send_batch",
+    "mast_rtp_send_batch + GSO",
+    "mast_rtp_send_batch + GSO/GRO"
+};
+
+static mast_rtp_packet_t tx_packets[BENCH_BURST];
+static mast_rtp_packet_t rx_packets[MAST_SOCKET_MAX_BATCH];
+
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static void prepare_packets(uint16_t *sequence)
+{
+    int i;
+
+    for (i = 0; i < BENCH_BURST; i++) {
+        uint8_t *buffer = tx_packets[i].buffer;
+
+        memset(buffer, 0, BENCH_PACKET_LEN);
+        buffer[0] = 0x80;
+        buffer[1] = 97;
+        buffer[2] = (*sequence >> 8) & 0xFF;
+        buffer[3] = *sequence & 0xFF;
+        tx_packets[i].length = BENCH_PACKET_LEN;
+        (*sequence)++;
+    }
+}
+
+static int run_benchmark(int mode)
+{
+    mast_socket_t rx, tx;
+    uint16_t sequence = 0;
+    uint64_t sent = 0, received = 0;
+    uint64_t elapsed = 0;
+    int round;
+
+    if (mast_socket_open_recv(&rx, BENCH_ADDRESS, BENCH_PORT, NULL))
+        return -1;
+    if (mast_socket_open_send(&tx, BENCH_ADDRESS, BENCH_PORT, NULL))
+        return -1;
+
+    if ((mode == BENCH_MODE_BATCH_GSO || mode == BENCH_MODE_BATCH_GSO_GRO) && mast_socket_enable_gso(&tx))
+        goto done;
+    if (mode == BENCH_MODE_BATCH_GSO_GRO && mast_socket_enable_gro(&rx))
+        goto done;
+
+    // Poll the receive socket rather than waiting in select()
+    rx.event_driven = TRUE;
+
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        uint64_t start;
+        int count, i;
+
+        prepare_packets(&sequence);
+
+        start = now_ns();
+        if (mode == BENCH_MODE_SINGLE) {
+            for (i = 0; i < BENCH_BURST; i++) {
+                if (mast_socket_send(&tx, tx_packets[i].buffer, tx_packets[i].length) > 0)
+                    sent++;
+            }
+        } else {
+            count = mast_rtp_send_batch(&tx, tx_packets, BENCH_BURST);
+            if (count > 0)
+                sent += count;
+        }
+        elapsed += now_ns() - start;
+
+        // Drain the receiver so that the socket buffer doesn't overflow
+        while ((count = mast_rtp_recv_batch(&rx, rx_packets, MAST_SOCKET_MAX_BATCH)) > 0) {
+            received += count;
+        }
+    }
+
+    printf(
+        "%-32s %8" PRIu64 " sent %8" PRIu64 " received  %6.3f syscalls/packet  %10.0f packets/s\n",
+        mode_names[mode], sent, received,
+        (double)tx.syscall_count / sent,
+        (double)sent * 1000000000 / elapsed
+    );
+
+done:
+    mast_socket_close(&rx);
+    mast_socket_close(&tx);
+
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    quiet = TRUE;
+
+    run_benchmark(BENCH_MODE_SINGLE);
+    run_benchmark(BENCH_MODE_BATCH);
+    run_benchmark(BENCH_MODE_BATCH_GSO);
+    run_benchmark(BENCH_MODE_BATCH_GSO_GRO);
+
+    return exit_code;
+}